@@ -0,0 +1,37 @@
+// Runs 'task' over 'items' with at most 'concurrency' calls in flight. Results keep the order of 'items'.
+async function mapBounded(items, concurrency, task) {
+  const results = new Array(items.length);
+  let next = 0;
+  const worker = async () => {
+    while (next < items.length) {
+      const index = next++;
+      results[index] = await task(items[index], index);
+    }
+  };
+  const workers = [];
+  for (let i = 0; i < Math.min(concurrency, items.length); i++) {
+    workers.push(worker());
+  }
+  await Promise.all(workers);
+  return results;
+}
+
+// Sends one already encoded command to every device path. A failing device does not stop the others, each result
+// carries its own outcome and latency.
+async function sendCommandToDevices(client, names, binaryData, concurrency) {
+  return mapBounded(names, concurrency, async (name) => {
+    const sentAt = Date.now();
+    try {
+      await client.sendCommandToDevice({ name: name, binaryData: binaryData });
+      return { ok: true, latencyMs: Date.now() - sentAt };
+    } catch (e) {
+      const result = { ok: false, latencyMs: Date.now() - sentAt, error: e.details || e.message || String(e) };
+      if (e.code !== undefined) {
+        result.code = e.code;
+      }
+      return result;
+    }
+  });
+}
+
+module.exports = { mapBounded, sendCommandToDevices };
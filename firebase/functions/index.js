@@ -1,21 +1,31 @@
 const functions = require('firebase-functions');
 const { initializeApp, applicationDefault, cert } = require('firebase-admin/app');
-const { getFirestore, Timestamp, FieldValue, Filter } = require('firebase-admin/firestore');
+const { getFirestore, Timestamp, FieldValue, FieldPath, Filter } = require('firebase-admin/firestore');
 const iot = require('@google-cloud/iot');
+const { randomUUID } = require('crypto');
+const { sendCommandToDevices } = require('./fanout');
+const { LocalDeviceManagerClient } = require('./local-device-manager');
 
 initializeApp();
 
+const projectId = 'hydroponics-378311';
+const region = 'asia-east1';
+const registryId = 'hydroponics';
+
 const db = getFirestore();
-const iotClient = new iot.v1.DeviceManagerClient();
+// The local stand-in lets the command paths run against the emulators without a device registry.
+const iotClient = process.env.HYDROPONICS_DEVICE_MANAGER === 'local' ?
+  new LocalDeviceManagerClient() : new iot.v1.DeviceManagerClient();
 
 exports.httpSendCommand = functions.region('asia-southeast2').https.onRequest(async (req, res) => {
-  const projectId = 'hydroponics-378311';
-  const region = 'asia-east1';
-  const registryId = 'hydroponics';
   const deviceId = req.body.deviceId;
 
+  const cmdId = req.body.cmdId || randomUUID();
+  const command = { ...req.body, cmdId: cmdId };
+  const commandRef = db.collection('commands').doc(cmdId);
+
   const name = iotClient.devicePath(projectId, region, registryId, deviceId);
-  const data = Buffer.from(JSON.stringify(req.body)).toString('base64');
+  const data = Buffer.from(JSON.stringify(command)).toString('base64');
 
   const request = {
     name: name,
@@ -23,21 +33,445 @@ exports.httpSendCommand = functions.region('asia-southeast2').https.onRequest(as
   };
   functions.logger.info(request);
 
+  // sendCommandToDevice resolves once the device has acknowledged the message, so this is the round trip time.
+  const sentAt = Date.now();
   try {
     const [response] = await iotClient.sendCommandToDevice(request);
-    res.sendStatus(200);
+    const rttMs = Date.now() - sentAt;
+    await commandRef.set({
+      deviceId: deviceId,
+      cmdType: command.cmdType,
+      sentAt: Timestamp.fromMillis(sentAt),
+      rttMs: rttMs,
+    }, { merge: true });
+    res.status(200).json({ cmdId: cmdId, rttMs: rttMs });
   } catch (e) {
     functions.logger.error(e);
     res.sendStatus(404);
   }
 });
 
-exports.pubsubEventData = functions.region('asia-southeast2').pubsub.topic('event').onPublish(async (msg) => {
-  functions.logger.log(Buffer.from(msg.data, 'base64').toString());
-  const deviceId = msg.attributes.deviceId;
+// Batch commands use this id prefix, their acknowledgements are kept per device.
+const BATCH_ID_PREFIX = 'batch-';
+const BATCH_MAX_DEVICES = 1000;
+const BATCH_CONCURRENCY = 16;
+const BATCH_MAX_CONCURRENCY = 64;
+
+// Devices carry their tags as a comma separated 'tags' metadata value in the registry.
+async function devicesWithTag(tag) {
+  const [devices] = await iotClient.listDevices({
+    parent: iotClient.registryPath(projectId, region, registryId),
+    fieldMask: { paths: ['metadata'] },
+  });
+  return devices
+    .filter((device) => ((device.metadata && device.metadata.tags) || '').split(',').map((t) => t.trim()).includes(tag))
+    .map((device) => device.id);
+}
+
+// POST { deviceIds: [..] } or { tag: '..' }, plus the command fields of httpSendCommand and an optional concurrency.
+// The command is encoded once, every device receives the same payload and cmdId.
+exports.httpSendCommandBatch = functions.region('asia-southeast2').https.onRequest(async (req, res) => {
+  const { deviceIds, tag, concurrency, ...fields } = req.body;
+  const startedAt = Date.now();
+
+  let targets;
+  try {
+    targets = Array.isArray(deviceIds) ? [...new Set(deviceIds)] : tag ? await devicesWithTag(tag) : undefined;
+  } catch (e) {
+    functions.logger.error(e);
+    res.sendStatus(502);
+    return;
+  }
+  if (!targets || targets.length === 0 || targets.length > BATCH_MAX_DEVICES) {
+    res.status(400).json({ error: `deviceIds or a tag matching 1 to ${BATCH_MAX_DEVICES} devices is required` });
+    return;
+  }
+
+  // Firmware command ids are at most 39 characters.
+  const cmdId = `${BATCH_ID_PREFIX}${randomUUID().slice(0, 32)}`;
+  const command = { ...fields, cmdId: cmdId };
+  const data = Buffer.from(JSON.stringify(command)).toString('base64');
+  const limit = Math.min(Math.max(Number(concurrency) || BATCH_CONCURRENCY, 1), BATCH_MAX_CONCURRENCY);
+  functions.logger.info(`Batch ${cmdId}: ${targets.length} devices, concurrency ${limit}`);
+
+  const names = targets.map((deviceId) => iotClient.devicePath(projectId, region, registryId, deviceId));
+  const outcomes = await sendCommandToDevices(iotClient, names, data, limit);
+  const results = targets.map((deviceId, i) => ({ deviceId: deviceId, ...outcomes[i] }));
+  const sent = results.filter((result) => result.ok).length;
+  const elapsedMs = Date.now() - startedAt;
+
+  // One write for the whole batch, acknowledgements are merged in per device by pubsubStateData.
+  await db.collection('commands').doc(cmdId).set({
+    batch: true,
+    tag: tag || null,
+    cmdType: command.cmdType,
+    sentAt: Timestamp.fromMillis(startedAt),
+    elapsedMs: elapsedMs,
+    devices: Object.fromEntries(results.map(({ deviceId, ...outcome }) => [deviceId, outcome])),
+  }, { merge: true });
+
+  res.status(200).json({
+    cmdId: cmdId,
+    devices: targets.length,
+    sent: sent,
+    failed: targets.length - sent,
+    elapsedMs: elapsedMs,
+    results: results,
+  });
+});
 
-  const realtimeRef = db.collection('hydroponics').doc('realtime_update');
-  const storedRef = db.collection('stored');
+// Charts stay around this many points when no resolution is requested.
+const HISTORY_MAX_POINTS = 1500;
+// Upper bound of tier documents read for one request.
+const HISTORY_MAX_DOCS = 48;
+const HISTORY_CACHE_ENTRIES = 200;
+const HISTORY_CACHE_SETTLED_MS = 60 * 60 * 1000;
+const HISTORY_CACHE_OPEN_MS = 60 * 1000;
+
+// Responses by device, resolution and range. Ranges are aligned to the buckets, so dashboards reloading the same view
+// hit the same entry. Ranges whose buckets can still change expire quickly.
+const historyResponses = new Map();
+
+function parseTime(value, fallback) {
+  if (value === undefined) {
+    return fallback;
+  }
+  return /^\d+$/.test(value) ? Number(value) : Date.parse(value);
+}
+
+function historyPoints(tier, docs, from, to) {
+  const points = [];
+  for (const doc of docs) {
+    for (const [key, bucket] of Object.entries(doc.exists ? doc.get('buckets') || {} : {})) {
+      const t = tier.time(doc.id, key);
+      if (t < from || t >= to) {
+        continue;
+      }
+      const point = { t: new Date(t).toISOString(), count: bucket.count };
+      for (const metric of HISTORY_METRICS) {
+        const stats = bucket[metric];
+        if (stats && stats.count > 0) {
+          point[metric] = { min: stats.min, max: stats.max, avg: stats.sum / stats.count };
+        }
+      }
+      points.push(point);
+    }
+  }
+  return points.sort((a, b) => (a.t < b.t ? -1 : 1));
+}
+
+// GET ?deviceId=..&from=..&to=..&resolution=minute|hour|day, times as ISO strings or epoch millis. Defaults to the last
+// day at the finest resolution which stays within HISTORY_MAX_POINTS.
+exports.httpHistory = functions.region('asia-southeast2').https.onRequest(async (req, res) => {
+  const deviceId = req.query.deviceId;
+  const now = Date.now();
+  let to = parseTime(req.query.to, now);
+  let from = parseTime(req.query.from, to - DAY_MS);
+  if (!deviceId || Number.isNaN(from) || Number.isNaN(to) || from >= to) {
+    res.status(400).json({ error: 'deviceId and a valid from < to range are required' });
+    return;
+  }
+
+  const resolution = req.query.resolution ||
+    Object.keys(HISTORY_TIERS).find((name) => (to - from) / HISTORY_TIERS[name].bucketMs <= HISTORY_MAX_POINTS) ||
+    'day';
+  // Only the tiers themselves, a name like '__proto__' or 'constructor' must not reach the inherited properties.
+  if (typeof resolution !== 'string' || !Object.hasOwn(HISTORY_TIERS, resolution)) {
+    res.status(400).json({ error: `resolution must be one of ${Object.keys(HISTORY_TIERS).join(', ')}` });
+    return;
+  }
+  const tier = HISTORY_TIERS[resolution];
+  from -= from % tier.bucketMs;
+  to += (tier.bucketMs - (to % tier.bucketMs)) % tier.bucketMs;
+
+  const cacheKey = `${deviceId}/${resolution}/${from}/${to}`;
+  const cached = historyResponses.get(cacheKey);
+  if (cached && cached.expiresAt > now) {
+    res.set('Cache-Control', `private, max-age=${Math.floor((cached.expiresAt - now) / 1000)}`);
+    res.status(200).json(cached.body);
+    return;
+  }
+
+  const refs = [];
+  for (let t = from; t < to && refs.length <= HISTORY_MAX_DOCS; t = tier.next(t)) {
+    refs.push(historyRef(deviceId, resolution, t));
+  }
+  if (refs.length > HISTORY_MAX_DOCS) {
+    res.status(400).json({ error: 'range too long for this resolution' });
+    return;
+  }
+
+  try {
+    const docs = await db.getAll(...refs);
+    const body = { deviceId: deviceId, resolution: resolution, from: new Date(from).toISOString(),
+      to: new Date(to).toISOString(), points: historyPoints(tier, docs, from, to) };
+    const ttl = to + tier.settleMs < now ? HISTORY_CACHE_SETTLED_MS : HISTORY_CACHE_OPEN_MS;
+
+    historyResponses.delete(cacheKey);
+    if (historyResponses.size >= HISTORY_CACHE_ENTRIES) {
+      historyResponses.delete(historyResponses.keys().next().value);
+    }
+    historyResponses.set(cacheKey, { expiresAt: now + ttl, body: body });
+    res.set('Cache-Control', `private, max-age=${Math.floor(ttl / 1000)}`);
+    res.status(200).json(body);
+  } catch (e) {
+    functions.logger.error(e);
+    res.sendStatus(500);
+  }
+});
+
+exports.pubsubStateData = functions.region('asia-southeast2').pubsub.topic('state').onPublish(async (msg) => {
+  let ack;
+  try {
+    ack = msg.json;
+  } catch (e) {
+    // Plain text state updates (e.g. pump notifications) are not command acknowledgements.
+    return;
+  }
+  if (!ack || !ack.cmdId) {
+    return;
+  }
+
+  const commandRef = db.collection('commands').doc(ack.cmdId);
+  const result = {
+    result: ack.result,
+    queueMs: ack.queueUs / 1000,
+    execMs: ack.execUs / 1000,
+    ackedAt: FieldValue.serverTimestamp(),
+  };
+  if (ack.cmdId.startsWith(BATCH_ID_PREFIX)) {
+    await commandRef.set({ acks: { [msg.attributes.deviceId]: result } }, { merge: true });
+  } else {
+    await commandRef.set({ deviceId: msg.attributes.deviceId, ...result }, { merge: true });
+  }
+  functions.logger.log('Command acknowledged: ', ack);
+});
+
+// Per device realtime documents are written at most once per interval, and unchanged payloads only once per heartbeat
+// so the timestamp still shows the device is alive.
+const REALTIME_MIN_INTERVAL_MS = 10 * 1000;
+const REALTIME_HEARTBEAT_MS = 60 * 1000;
+
+// Last payload written per device by this instance.
+const realtimeCache = new Map();
+
+// Writes the latest sample to realtime/{deviceId} at a bounded rate. A sample arriving inside the interval is not
+// written, the device reports every few seconds so the next sample after the interval carries the newest values.
+async function realtimeUpdate(deviceId, sample) {
+  const payload = JSON.stringify(sample);
+  const now = Date.now();
+  const last = realtimeCache.get(deviceId);
+  if (last) {
+    const elapsed = now - last.writtenAt;
+    if (elapsed < REALTIME_MIN_INTERVAL_MS || (payload === last.payload && elapsed < REALTIME_HEARTBEAT_MS)) {
+      return false;
+    }
+  }
+
+  realtimeCache.set(deviceId, { payload: payload, writtenAt: now });
+  await db.collection('realtime').doc(deviceId).set({ ...sample, timestamp: FieldValue.serverTimestamp() });
+  return true;
+}
+
+// Telemetry history is kept in three packed tiers, a document holds every bucket of its period:
+//   history/{deviceId}/minute/{YYYY-MM-DDTHH}  minute buckets of an hour
+//   history/{deviceId}/hour/{YYYY-MM}          hour buckets of a month
+//   history/{deviceId}/day/{YYYY}              day buckets of a year
+// Samples are folded into the minute tier as they arrive. The marker document history/{deviceId} records the hour
+// being filled, the first sample of a later hour folds that hour into the hour and day tiers. All times are UTC.
+const HISTORY_METRICS = ['tdsValue', 'phValue', 'temperature', 'humidity', 'tankLevel'];
+const MINUTE_MS = 60 * 1000;
+const HOUR_MS = 60 * MINUTE_MS;
+const DAY_MS = 24 * HOUR_MS;
+
+const HISTORY_TIERS = {
+  minute: {
+    bucketMs: MINUTE_MS,
+    container: (t) => new Date(t).toISOString().slice(0, 13),
+    key: (t) => new Date(t).toISOString().slice(14, 16),
+    time: (container, key) => Date.parse(`${container}:${key}:00Z`),
+    next: (t) => t - (t % HOUR_MS) + HOUR_MS,
+    // Minutes change until their hour is closed.
+    settleMs: 2 * HOUR_MS,
+  },
+  hour: {
+    bucketMs: HOUR_MS,
+    container: (t) => new Date(t).toISOString().slice(0, 7),
+    key: (t) => new Date(t).toISOString().slice(8, 13),
+    time: (container, key) => Date.parse(`${container}-${key}:00:00Z`),
+    next: (t) => Date.UTC(new Date(t).getUTCFullYear(), new Date(t).getUTCMonth() + 1, 1),
+    settleMs: 2 * HOUR_MS,
+  },
+  day: {
+    bucketMs: DAY_MS,
+    container: (t) => new Date(t).toISOString().slice(0, 4),
+    key: (t) => new Date(t).toISOString().slice(5, 10),
+    time: (container, key) => Date.parse(`${container}-${key}T00:00:00Z`),
+    next: (t) => Date.UTC(new Date(t).getUTCFullYear() + 1, 0, 1),
+    settleMs: DAY_MS + 2 * HOUR_MS,
+  },
+};
+
+// Pub/Sub delivers at least once. Every folded message leaves history/{deviceId}/events/{eventId} behind, written
+// atomically with the sample, so a redelivery is recognised and dropped. The markers only matter while a message can
+// still be redelivered, a TTL policy on the expireAt field of the events collection group removes them afterwards.
+const HISTORY_EVENT_TTL_MS = 7 * DAY_MS;
+const ALREADY_EXISTS = 6;
+
+// Minute bucket being filled per device by this instance, with the extremes it is known to hold. Extremes only ever
+// widen, so a stale entry can only cause an unneeded transaction, never a wrong min or max.
+const historyCache = new Map();
+
+function historyRef(deviceId, tier, t) {
+  return db.collection('history').doc(deviceId).collection(tier).doc(HISTORY_TIERS[tier].container(t));
+}
+
+// A bucket is { count, <metric>: { min, max, sum, count } }, metrics missing from a sample are left out.
+function historyEventRef(deviceId, eventId) {
+  return db.collection('history').doc(deviceId).collection('events').doc(eventId);
+}
+
+function historyEventMarker(sampledAt) {
+  return { expireAt: new Date(sampledAt + HISTORY_EVENT_TTL_MS) };
+}
+
+function historySampleBucket(sample) {
+  const bucket = { count: 1 };
+  for (const metric of HISTORY_METRICS) {
+    const value = sample[metric];
+    if (typeof value === 'number') {
+      bucket[metric] = { min: value, max: value, sum: value, count: 1 };
+    }
+  }
+  return bucket;
+}
+
+function historyMerge(into, bucket) {
+  if (!into) {
+    return bucket;
+  }
+  const merged = { count: into.count + bucket.count };
+  for (const metric of HISTORY_METRICS) {
+    const a = into[metric];
+    const b = bucket[metric];
+    if (a && b) {
+      merged[metric] = {
+        min: Math.min(a.min, b.min),
+        max: Math.max(a.max, b.max),
+        sum: a.sum + b.sum,
+        count: a.count + b.count,
+      };
+    } else if (a || b) {
+      merged[metric] = a || b;
+    }
+  }
+  return merged;
+}
+
+function historyWidens(bucket, sample) {
+  return HISTORY_METRICS.some((metric) => {
+    const value = sample[metric];
+    const stats = bucket[metric];
+    return typeof value === 'number' && (!stats || value < stats.min || value > stats.max);
+  });
+}
+
+// Reads the minute bucket in a transaction to fold the sample into min and max. When the sample starts a new hour,
+// the hour recorded in the marker is folded into the hour and day tiers exactly once.
+async function historyTransaction(deviceId, eventId, sampledAt, sample) {
+  const hourStart = sampledAt - (sampledAt % HOUR_MS);
+  const key = HISTORY_TIERS.minute.key(sampledAt);
+  const ref = historyRef(deviceId, 'minute', sampledAt);
+  const markerRef = db.collection('history').doc(deviceId);
+  const eventRef = historyEventRef(deviceId, eventId);
+
+  const bucket = await db.runTransaction(async (tx) => {
+    const [doc, marker, event] = await tx.getAll(ref, markerRef, eventRef);
+    if (event.exists) {
+      return undefined;
+    }
+    const openHour = marker.exists ? marker.get('openHour') : undefined;
+    const closing = openHour !== undefined && openHour < hourStart;
+
+    if (closing) {
+      const closingRef = historyRef(deviceId, 'minute', openHour);
+      const hourRef = historyRef(deviceId, 'hour', openHour);
+      const dayRef = historyRef(deviceId, 'day', openHour);
+      const dayKey = HISTORY_TIERS.day.key(openHour);
+      const [closingDoc, dayDoc] = await tx.getAll(closingRef, dayRef);
+      if (closingDoc.exists && !closingDoc.get('closed')) {
+        const hour = Object.values(closingDoc.get('buckets') || {}).reduce(historyMerge, undefined);
+        if (hour) {
+          const day = historyMerge(dayDoc.exists ? dayDoc.get(new FieldPath('buckets', dayKey)) : undefined, hour);
+          tx.set(hourRef, { buckets: { [HISTORY_TIERS.hour.key(openHour)]: hour } }, { merge: true });
+          tx.set(dayRef, { buckets: { [dayKey]: day } }, { merge: true });
+        }
+        tx.update(closingRef, { closed: true });
+      }
+    }
+    if (openHour === undefined || closing) {
+      tx.set(markerRef, { openHour: hourStart }, { merge: true });
+    }
+
+    // A late sample of an hour which is already closed only reaches the minute tier.
+    const merged = historyMerge(doc.exists ? doc.get(new FieldPath('buckets', key)) : undefined,
+      historySampleBucket(sample));
+    tx.set(ref, { buckets: { [key]: merged } }, { merge: true });
+    tx.create(eventRef, historyEventMarker(sampledAt));
+    return merged;
+  });
+  if (!bucket) {
+    functions.logger.log('Redelivered sample dropped: ', deviceId, eventId);
+    return;
+  }
+  historyCache.set(deviceId, { minuteStart: sampledAt - (sampledAt % MINUTE_MS), bucket: bucket });
+}
+
+// Folds one telemetry sample into the device history. Samples within the known extremes of the current minute are
+// plain increments without a read, only a new minute or a new extreme takes the transaction. The increments are
+// committed in one batch with the creation of the event marker, a redelivery fails the whole batch.
+async function historySample(deviceId, eventId, sampledAt, sample) {
+  const cached = historyCache.get(deviceId);
+  if (!cached || cached.minuteStart !== sampledAt - (sampledAt % MINUTE_MS) || historyWidens(cached.bucket, sample)) {
+    return historyTransaction(deviceId, eventId, sampledAt, sample);
+  }
+
+  const key = HISTORY_TIERS.minute.key(sampledAt);
+  const update = [new FieldPath('buckets', key, 'count'), FieldValue.increment(1)];
+  cached.bucket.count += 1;
+  for (const metric of HISTORY_METRICS) {
+    const value = sample[metric];
+    if (typeof value === 'number') {
+      update.push(new FieldPath('buckets', key, metric, 'sum'), FieldValue.increment(value));
+      update.push(new FieldPath('buckets', key, metric, 'count'), FieldValue.increment(1));
+    }
+  }
+  const batch = db.batch();
+  batch.create(historyEventRef(deviceId, eventId), historyEventMarker(sampledAt));
+  batch.update(historyRef(deviceId, 'minute', sampledAt), ...update);
+  try {
+    await batch.commit();
+  } catch (e) {
+    if (e.code !== ALREADY_EXISTS) {
+      throw e;
+    }
+    cached.bucket.count -= 1;
+    functions.logger.log('Redelivered sample dropped: ', deviceId, eventId);
+  }
+}
+
+exports.pubsubEventData = functions.region('asia-southeast2').pubsub.topic('event').onPublish(async (msg, context) => {
+  const deviceId = msg.attributes.deviceId;
+  // Benchmark filler load only exercises the device's uplink, it is dropped unread.
+  if (msg.attributes.subFolder === 'bench') {
+    return;
+  }
+  // Device logs are streamed as plain text on the logs subfolder, they never reach the telemetry collections.
+  if (msg.attributes.subFolder === 'logs') {
+    functions.logger.log(`Device log ${deviceId}:\n${Buffer.from(msg.data, 'base64').toString()}`);
+    return;
+  }
+  functions.logger.log(Buffer.from(msg.data, 'base64').toString());
 
   const data = {
     initialized: msg.json.initialized,
@@ -47,16 +481,16 @@ exports.pubsubEventData = functions.region('asia-southeast2').pubsub.topic('even
     temperature: msg.json.temperature,
     humidity: msg.json.humidity,
     tankLevel: msg.json.tankLevel,
-    timestamp: FieldValue.serverTimestamp(),
   };
+  // Controllers with several reservoirs list them all, the top level values are those of the first reservoir.
+  if (Array.isArray(msg.json.reservoirs)) {
+    data.reservoirs = msg.json.reservoirs;
+  }
 
-  const update = await realtimeRef.update(data);
-  functions.logger.log('Update: ', update);
-
-  const currentTms = Timestamp.now().toMillis();
-  const snapshot = await storedRef.where('timestamp', '>', new Date(currentTms - (60 * 60 * 1000))).get();
-  if (snapshot.empty) {
-    const add = await storedRef.add(data);
-    functions.logger.log('Add: ', add);
+  if (await realtimeUpdate(deviceId, data)) {
+    functions.logger.log('Realtime update: ', deviceId);
   }
+
+  // Bucketed by publish time, redeliveries of a message land in the hour it was sent in.
+  await historySample(deviceId, context.eventId, Date.parse(context.timestamp), data);
 });
@@ -0,0 +1,47 @@
+// In-process stand-in for the Cloud IoT DeviceManagerClient, used when HYDROPONICS_DEVICE_MANAGER=local. It implements
+// the calls the functions make, with a simulated round trip and offline devices, and keeps what was sent.
+const GRPC_NOT_FOUND = 5;
+const GRPC_FAILED_PRECONDITION = 9;
+
+class LocalDeviceManagerClient {
+  // devices: [{ id, tags: [..], online }], latencyMs: [min, max] round trip of a command.
+  constructor(options = {}) {
+    const count = options.count || Number(process.env.HYDROPONICS_LOCAL_DEVICES) || 8;
+    this.devices = options.devices ||
+      Array.from({ length: count }, (_, i) => ({ id: `device-${i}`, tags: ['local', `row-${i % 4}`], online: true }));
+    this.latencyMs = options.latencyMs || [20, 120];
+    this.sent = [];
+  }
+
+  devicePath(project, location, registry, device) {
+    return `projects/${project}/locations/${location}/registries/${registry}/devices/${device}`;
+  }
+
+  registryPath(project, location, registry) {
+    return `projects/${project}/locations/${location}/registries/${registry}`;
+  }
+
+  async listDevices(request) {
+    const devices = this.devices.map((device) => ({ id: device.id, metadata: { tags: device.tags.join(',') } }));
+    return [devices, null, {}];
+  }
+
+  async sendCommandToDevice(request) {
+    const id = request.name.split('/').pop();
+    const device = this.devices.find((d) => d.id === id);
+    const [min, max] = this.latencyMs;
+    await new Promise((resolve) => setTimeout(resolve, min + Math.random() * (max - min)));
+
+    if (!device) {
+      throw Object.assign(new Error(`Device ${id} not found`), { code: GRPC_NOT_FOUND, details: 'not found' });
+    }
+    if (!device.online) {
+      throw Object.assign(new Error(`Device ${id} is not connected`),
+        { code: GRPC_FAILED_PRECONDITION, details: 'device not connected' });
+    }
+    this.sent.push({ deviceId: id, binaryData: request.binaryData, at: Date.now() });
+    return [{}];
+  }
+}
+
+module.exports = { LocalDeviceManagerClient };
@@ -0,0 +1,298 @@
+#!/usr/bin/env node
+// Synthetic fleet load against the cloud functions, run in process with the Firestore emulator:
+//
+//   npm run loadgen                                   (starts the emulator, uses the LOADGEN_* environment)
+//   FIRESTORE_EMULATOR_HOST=localhost:8080 node tools/loadgen.js --devices 200 --interval 2000 --duration 60
+//
+// Every simulated device publishes EVENT_DATA shaped telemetry to a local Pub/Sub stand-in, which delivers it to
+// pubsubEventData with a bounded number of concurrent invocations, like a scaled out function would receive it.
+// Commands go through httpSendCommand against the local device manager. The report gives the throughput, p50/p99
+// latencies and the Firestore operations per message.
+//
+// All invocations share this process, so the per instance caches of the functions behave like a single warm instance.
+
+const OPTIONS = {
+  devices: ['LOADGEN_DEVICES', 50, 'simulated devices'],
+  interval: ['LOADGEN_INTERVAL_MS', 2000, 'telemetry period of a device in ms'],
+  duration: ['LOADGEN_DURATION_S', 30, 'length of the run in seconds'],
+  concurrency: ['LOADGEN_CONCURRENCY', 32, 'concurrent pubsubEventData invocations'],
+  commands: ['LOADGEN_COMMAND_RATE', 0, 'httpSendCommand calls per second'],
+};
+
+function parseOptions(argv) {
+  const options = {};
+  for (const [name, [env, fallback]] of Object.entries(OPTIONS)) {
+    options[name] = process.env[env] !== undefined ? Number(process.env[env]) : fallback;
+  }
+  for (let i = 0; i < argv.length; i++) {
+    const name = argv[i].replace(/^--/, '');
+    if (!(name in OPTIONS) || Number.isNaN(Number(argv[i + 1]))) {
+      const usage = Object.entries(OPTIONS).map(([n, [env, d, help]]) => `  --${n} (${env}, ${d}): ${help}`);
+      console.error(`Usage: loadgen.js [options]\n${usage.join('\n')}`);
+      process.exit(1);
+    }
+    options[name] = Number(argv[++i]);
+  }
+  return options;
+}
+
+const options = parseOptions(process.argv.slice(2));
+if (!process.env.FIRESTORE_EMULATOR_HOST) {
+  console.error('FIRESTORE_EMULATOR_HOST is not set, refusing to generate load against a live project');
+  process.exit(1);
+}
+process.env.GCLOUD_PROJECT = process.env.GCLOUD_PROJECT || 'demo-hydroponics';
+process.env.HYDROPONICS_DEVICE_MANAGER = 'local';
+process.env.HYDROPONICS_LOCAL_DEVICES = String(options.devices);
+
+const { DocumentReference, Firestore, Query, Transaction, WriteBatch } = require('firebase-admin/firestore');
+const functions = require('firebase-functions');
+
+// Firestore operation counters. The public calls nest (a document get goes through getAll, every write through a
+// WriteBatch), only the outermost call of a synchronous chain is counted.
+const ops = { reads: 0, writes: 0, transactions: 0, attempts: 0 };
+let depth = 0;
+
+function countCalls(prototype, method, count) {
+  const original = prototype[method];
+  prototype[method] = function (...args) {
+    if (depth > 0) {
+      return original.apply(this, args);
+    }
+    depth++;
+    try {
+      const result = original.apply(this, args);
+      if (result && typeof result.then === 'function') {
+        return result.then((value) => {
+          count(value, args);
+          return value;
+        });
+      }
+      count(result, args);
+      return result;
+    } finally {
+      depth--;
+    }
+  };
+}
+
+const countRead = (value) => {
+  ops.reads += Array.isArray(value) ? value.length : value && value.size !== undefined ? Math.max(value.size, 1) : 1;
+};
+const countWrite = () => {
+  ops.writes++;
+};
+countCalls(DocumentReference.prototype, 'get', countRead);
+countCalls(Query.prototype, 'get', countRead);
+countCalls(Firestore.prototype, 'getAll', countRead);
+countCalls(Transaction.prototype, 'get', countRead);
+countCalls(Transaction.prototype, 'getAll', countRead);
+for (const method of ['create', 'set', 'update', 'delete']) {
+  countCalls(WriteBatch.prototype, method, countWrite);
+}
+const runTransaction = Firestore.prototype.runTransaction;
+Firestore.prototype.runTransaction = function (update, ...rest) {
+  ops.transactions++;
+  return runTransaction.call(this, (tx) => {
+    ops.attempts++;
+    return update(tx);
+  }, ...rest);
+};
+
+const fns = require('../index');
+
+// Latency samples in ms.
+class Histogram {
+  constructor() {
+    this.samples = [];
+  }
+
+  add(value) {
+    this.samples.push(value);
+  }
+
+  percentile(p) {
+    if (this.samples.length === 0) {
+      return 0;
+    }
+    const sorted = [...this.samples].sort((a, b) => a - b);
+    return sorted[Math.min(sorted.length - 1, Math.floor((p / 100) * sorted.length))];
+  }
+}
+
+// Local stand-in for the Pub/Sub push subscription: an unbounded topic queue drained by a bounded number of
+// concurrent deliveries. A message which fails is counted, not redelivered.
+class LocalBroker {
+  constructor(concurrency, handler) {
+    this.concurrency = concurrency;
+    this.handler = handler;
+    this.queue = [];
+    this.inFlight = 0;
+    this.maxBacklog = 0;
+    this.delivered = 0;
+    this.failed = 0;
+    this.queueDelay = new Histogram();
+    this.latency = new Histogram();
+  }
+
+  publish(attributes, json) {
+    this.queue.push({ attributes: attributes, json: json, publishedAt: Date.now() });
+    this.maxBacklog = Math.max(this.maxBacklog, this.queue.length);
+    this.pump();
+  }
+
+  pump() {
+    while (this.inFlight < this.concurrency && this.queue.length > 0) {
+      this.deliver(this.queue.shift());
+    }
+  }
+
+  async deliver(entry) {
+    this.inFlight++;
+    const startedAt = Date.now();
+    this.queueDelay.add(startedAt - entry.publishedAt);
+    const message = new functions.pubsub.Message({
+      data: Buffer.from(JSON.stringify(entry.json)).toString('base64'),
+      attributes: entry.attributes,
+    });
+    try {
+      await this.handler(message, {
+        eventId: `${entry.attributes.deviceId}-${entry.publishedAt}`,
+        timestamp: new Date(entry.publishedAt).toISOString(),
+      });
+      this.delivered++;
+    } catch (e) {
+      this.failed++;
+      if (this.failed <= 5) {
+        console.error(e);
+      }
+    }
+    this.latency.add(Date.now() - startedAt);
+    this.inFlight--;
+    this.pump();
+  }
+
+  drained() {
+    return this.queue.length === 0 && this.inFlight === 0;
+  }
+}
+
+// Random walk around the usual operating point, formatted like EVENT_DATA in main/mqtt.c.
+function createDevice(index) {
+  const state = { tds: 800, ph: 6, temperature: 27, humidity: 70, tank: 15 };
+  const walk = (value, step, min, max) => Math.min(max, Math.max(min, value + (Math.random() - 0.5) * step));
+  return {
+    id: `device-${index}`,
+    telemetry() {
+      state.tds = walk(state.tds, 10, 400, 1400);
+      state.ph = walk(state.ph, 0.05, 4.5, 8);
+      state.temperature = walk(state.temperature, 0.2, 18, 35);
+      state.humidity = walk(state.humidity, 0.5, 30, 95);
+      state.tank = walk(state.tank, 0.1, 5, 25);
+      return {
+        initialized: true,
+        elapsedDays: 12,
+        tdsValue: Number(state.tds.toFixed(2)),
+        phValue: Number(state.ph.toFixed(2)),
+        temperature: Number(state.temperature.toFixed(1)),
+        humidity: Number(state.humidity.toFixed(1)),
+        tankLevel: Number(state.tank.toFixed(2)),
+      };
+    },
+  };
+}
+
+function sendCommand(deviceId, latency, results) {
+  const startedAt = Date.now();
+  return new Promise((resolve) => {
+    const done = (status) => {
+      latency.add(Date.now() - startedAt);
+      results[status < 400 ? 'ok' : 'failed']++;
+      resolve();
+    };
+    const res = {
+      status(code) {
+        this.code = code;
+        return this;
+      },
+      json() {
+        done(this.code);
+      },
+      sendStatus(code) {
+        done(code);
+      },
+    };
+    fns.httpSendCommand({ body: { deviceId: deviceId, cmdType: 2, tds: 0, ph: 0 } }, res);
+  });
+}
+
+async function main() {
+  const broker = new LocalBroker(options.concurrency, fns.pubsubEventData.run.bind(fns.pubsubEventData));
+  const devices = Array.from({ length: options.devices }, (_, i) => createDevice(i));
+  const commandLatency = new Histogram();
+  const commandResults = { ok: 0, failed: 0 };
+  const commands = [];
+  const timers = [];
+  let published = 0;
+
+  console.log(`loadgen: ${options.devices} devices every ${options.interval} ms for ${options.duration} s, ` +
+    `${options.concurrency} concurrent invocations, ${options.commands} commands/s`);
+  const startedAt = Date.now();
+
+  // Devices start spread over one period, like a fleet which did not boot at the same instant.
+  devices.forEach((device, i) => {
+    timers.push(setTimeout(() => {
+      const publish = () => {
+        broker.publish({ deviceId: device.id, subFolder: '' }, device.telemetry());
+        published++;
+      };
+      publish();
+      timers.push(setInterval(publish, options.interval));
+    }, (i * options.interval) / devices.length));
+  });
+  if (options.commands > 0) {
+    timers.push(setInterval(() => {
+      const device = devices[Math.floor(Math.random() * devices.length)];
+      commands.push(sendCommand(device.id, commandLatency, commandResults));
+    }, 1000 / options.commands));
+  }
+  const progress = setInterval(() => {
+    const elapsed = (Date.now() - startedAt) / 1000;
+    console.log(`  ${elapsed.toFixed(0)} s: published ${published}, delivered ${broker.delivered}, ` +
+      `backlog ${broker.queue.length}, reads ${ops.reads}, writes ${ops.writes}`);
+  }, 5000);
+
+  await new Promise((resolve) => setTimeout(resolve, options.duration * 1000));
+  timers.forEach((timer) => clearInterval(timer));
+  const publishEnd = Date.now();
+  while (!broker.drained()) {
+    await new Promise((resolve) => setTimeout(resolve, 50));
+  }
+  await Promise.all(commands);
+  clearInterval(progress);
+
+  const seconds = (Date.now() - startedAt) / 1000;
+  const processed = broker.delivered + broker.failed;
+  const perMessage = (count) => (processed > 0 ? (count / processed).toFixed(2) : '-');
+  const rate = (processed / seconds).toFixed(1);
+  const delay = broker.queueDelay;
+  console.log(`
+Telemetry
+  published          ${published} (${(published / ((publishEnd - startedAt) / 1000)).toFixed(1)} msg/s offered)
+  processed          ${processed} in ${seconds.toFixed(1)} s (${rate} msg/s), ${broker.failed} failed
+  latency            p50 ${broker.latency.percentile(50)} ms, p99 ${broker.latency.percentile(99)} ms
+  queue delay        p50 ${delay.percentile(50)} ms, p99 ${delay.percentile(99)} ms, max backlog ${broker.maxBacklog}
+Commands
+  sent               ${commandResults.ok} ok, ${commandResults.failed} failed
+  latency            p50 ${commandLatency.percentile(50)} ms, p99 ${commandLatency.percentile(99)} ms
+Firestore
+  reads              ${ops.reads} (${perMessage(ops.reads)} per message)
+  writes             ${ops.writes} (${perMessage(ops.writes)} per message)
+  transactions       ${ops.transactions} (${ops.attempts} attempts, ${perMessage(ops.transactions)} per message)`);
+  process.exit(broker.failed > 0 ? 2 : 0);
+}
+
+main().catch((e) => {
+  console.error(e);
+  process.exit(1);
+});
@@ -0,0 +1,270 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "driver/gpio.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "soc/gpio_struct.h"
+
+#include "actuator.h"
+#include "context.h"
+#include "error.h"
+#include "mqtt.h"
+#include "settings.h"
+#include "storage.h"
+
+#define ACTUATOR_CYCLES_KEY "act_cycles"
+#define ACTUATOR_CYCLES_MILESTONE 1000 // (int) Log an output's cycle count every this many cycles
+#define ACTUATOR_CYCLES_PERIOD 600     // (int) Cycle count report period, changed counts are persisted, in seconds
+
+#define ACTUATOR_DOSING_MIN_OFF 1000    // (int) Rest of a dosing pump between two doses, in millis
+#define ACTUATOR_TANK_PUMP_MIN_ON 10000 // (int) Shortest run of the circulation pump, in millis
+#define ACTUATOR_TANK_PUMP_MIN_OFF 5000 // (int) Shortest stop of the circulation pump, in millis
+#define ACTUATOR_VALVE_MIN_ON 2000      // (int) Shortest opening of a solenoid valve, in millis
+#define ACTUATOR_VALVE_MIN_OFF 2000     // (int) Shortest closing of a solenoid valve, in millis
+
+/* Output levels of a reservoir as an ACTUATOR_BIT set, and the cycle counts of its outputs in actuator_t order. */
+#define ACTUATOR_REPORT_CHANNEL "{"                                 \
+                                "\"outputs\":%u,"                   \
+                                "\"cycles\":[%u,%u,%u,%u,%u,%u,%u]" \
+                                "}"
+#define ACTUATOR_REPORT_CHANNEL_LENGTH 112 // (int) Room for one formatted ACTUATOR_REPORT_CHANNEL and its separator
+
+_Static_assert(ACTUATOR_MAX == 7, "ACTUATOR_REPORT_CHANNEL lists one cycle count per actuator");
+
+typedef struct {
+    const char *name;
+    int32_t min_on;  // in millis, a request to switch off earlier is held back
+    int32_t min_off; // in millis, a request to switch on earlier is held back
+} actuator_limits_t;
+
+static const char *TAG = "actuator";
+
+/* Dose lengths come from the settings, the dosing pumps are never held on. */
+static const actuator_limits_t limits[ACTUATOR_MAX] = {
+    [ACTUATOR_PH_UP_PUMP] = {"ph_up_pump", 0, ACTUATOR_DOSING_MIN_OFF},
+    [ACTUATOR_PH_DOWN_PUMP] = {"ph_down_pump", 0, ACTUATOR_DOSING_MIN_OFF},
+    [ACTUATOR_TDS_A_PUMP] = {"tds_a_pump", 0, ACTUATOR_DOSING_MIN_OFF},
+    [ACTUATOR_TDS_B_PUMP] = {"tds_b_pump", 0, ACTUATOR_DOSING_MIN_OFF},
+    [ACTUATOR_TANK_PUMP] = {"tank_pump", ACTUATOR_TANK_PUMP_MIN_ON, ACTUATOR_TANK_PUMP_MIN_OFF},
+    [ACTUATOR_SOURCE_VALVE] = {"source_valve", ACTUATOR_VALVE_MIN_ON, ACTUATOR_VALVE_MIN_OFF},
+    [ACTUATOR_DRAIN_VALVE] = {"drain_valve", ACTUATOR_VALVE_MIN_ON, ACTUATOR_VALVE_MIN_OFF},
+};
+
+/* Outputs of a reservoir which must never be on together. */
+static const uint32_t interlocks[] = {
+    ACTUATOR_BIT(ACTUATOR_SOURCE_VALVE) | ACTUATOR_BIT(ACTUATOR_DRAIN_VALVE),
+    ACTUATOR_BIT(ACTUATOR_PH_UP_PUMP) | ACTUATOR_BIT(ACTUATOR_PH_DOWN_PUMP),
+};
+
+static gpio_num_t pins[CONTEXT_RESERVOIRS][ACTUATOR_MAX];
+static uint32_t connected[CONTEXT_RESERVOIRS];
+
+/* Shadow of the output levels, the registers are only written for outputs which change. */
+static portMUX_TYPE actuator_spinlock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t shadow[CONTEXT_RESERVOIRS];
+static int64_t changed_at[CONTEXT_RESERVOIRS][ACTUATOR_MAX]; // esp_timer time of the last change, 0 before the first
+
+/* Off to on transitions, persisted for wear tracking. The layout does not depend on the configured reservoir count,
+ * so the counts survive changing it. They are persisted periodically rather than on every switch, a power loss
+ * forgets at most the last period of cycles. */
+static uint32_t cycles[SETTINGS_MAX_RESERVOIRS][ACTUATOR_MAX];
+static bool cycles_changed = false;
+static esp_timer_handle_t cycles_timer;
+
+bool actuator_is_connected(actuator_t actuator, int channel)
+{
+    return (connected[channel] & ACTUATOR_BIT(actuator)) != 0;
+}
+
+/* Stores a snapshot of the counts taken under the lock, so the blob is never written while a switch updates it, and
+ * reports the counts and output levels on the state topic. */
+static void actuator_cycles_timer_cb(void *arg)
+{
+    ARG_UNUSED(arg);
+    static uint32_t snapshot[SETTINGS_MAX_RESERVOIRS][ACTUATOR_MAX];
+    static char msg[CONTEXT_RESERVOIRS * ACTUATOR_REPORT_CHANNEL_LENGTH + 20];
+    uint32_t levels[CONTEXT_RESERVOIRS];
+    portENTER_CRITICAL(&actuator_spinlock);
+    bool changed = cycles_changed;
+    memcpy(snapshot, cycles, sizeof(snapshot));
+    memcpy(levels, shadow, sizeof(levels));
+    cycles_changed = false;
+    portEXIT_CRITICAL(&actuator_spinlock);
+
+    esp_err_t err = changed ? storage_set_blob(ACTUATOR_CYCLES_KEY, snapshot, sizeof(snapshot)) : ESP_OK;
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to store the cycle counts, err: %s", esp_err_to_name(err));
+        portENTER_CRITICAL(&actuator_spinlock);
+        cycles_changed = true;
+        portEXIT_CRITICAL(&actuator_spinlock);
+    }
+
+    int length = snprintf(msg, sizeof(msg), "{\"actuators\":[");
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        const uint32_t *count = snapshot[channel];
+        length += snprintf(&msg[length], sizeof(msg) - length, "%s" ACTUATOR_REPORT_CHANNEL, channel > 0 ? "," : "",
+                           levels[channel], count[0], count[1], count[2], count[3], count[4], count[5], count[6]);
+        length = MIN(length, sizeof(msg) - 1);
+    }
+    snprintf(&msg[length], sizeof(msg) - length, "]}");
+    if (mqtt_publish_state(msg) != ESP_OK) {
+        ESP_LOGD(TAG, "Unable to publish the cycle counts, not connected");
+    }
+}
+
+/* Drops the changes which come before the minimum on or off time of the output. */
+static uint32_t actuator_hold_locked(int channel, uint32_t target, int64_t now)
+{
+    uint32_t changes = target ^ shadow[channel];
+    for (int i = 0; i < ACTUATOR_MAX; i++) {
+        if (!(changes & ACTUATOR_BIT(i)) || changed_at[channel][i] == 0) {
+            continue;
+        }
+        int32_t min = (shadow[channel] & ACTUATOR_BIT(i)) ? limits[i].min_on : limits[i].min_off;
+        if (now - changed_at[channel][i] < min * 1000LL) {
+            target ^= ACTUATOR_BIT(i);
+        }
+    }
+    return target;
+}
+
+/* Applies the changes of a reservoir with one write to each set and clear register. Outputs are cleared before others
+ * are set, so interlocked outputs never overlap. */
+static void actuator_write_locked(int channel, uint32_t off, uint32_t on)
+{
+    uint64_t clear = 0;
+    uint64_t set = 0;
+    for (int i = 0; i < ACTUATOR_MAX; i++) {
+        if (off & ACTUATOR_BIT(i)) {
+            clear |= 1ULL << pins[channel][i];
+        } else if (on & ACTUATOR_BIT(i)) {
+            set |= 1ULL << pins[channel][i];
+        }
+    }
+    /* GPIO 32 and up live in the second bank. */
+    if (clear & UINT32_MAX) {
+        GPIO.out_w1tc = (uint32_t)clear;
+    }
+    if (clear >> 32) {
+        GPIO.out1_w1tc.val = (uint32_t)(clear >> 32);
+    }
+    if (set & UINT32_MAX) {
+        GPIO.out_w1ts = (uint32_t)set;
+    }
+    if (set >> 32) {
+        GPIO.out1_w1ts.val = (uint32_t)(set >> 32);
+    }
+}
+
+/* Drives the outputs of 'channel' selected by 'mask' to the levels in 'levels', both are ACTUATOR_BIT sets. Outputs
+ * which are not connected are ignored. A change is held back when it would come before the output's minimum on or
+ * off time, or would switch on an output interlocked with one which stays on. The other changes still apply, and
+ * ESP_ERR_INVALID_STATE tells the caller to ask again later. */
+esp_err_t actuator_set(int channel, uint32_t mask, uint32_t levels)
+{
+    ARG_CHECK(channel >= 0 && channel < CONTEXT_RESERVOIRS, "invalid channel %d", channel);
+
+    mask &= connected[channel];
+    uint32_t requested = levels & mask;
+    uint32_t milestones = 0;
+    uint32_t reached[ACTUATOR_MAX];
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&actuator_spinlock);
+    uint32_t target = actuator_hold_locked(channel, (shadow[channel] & ~mask) | requested, now);
+    for (int i = 0; i < sizeof(interlocks) / sizeof(interlocks[0]); i++) {
+        if ((target & interlocks[i]) == interlocks[i]) {
+            /* The shadow never has both on, drop the one this request would switch on. */
+            target &= ~(interlocks[i] & ~shadow[channel]);
+        }
+    }
+    uint32_t off = shadow[channel] & ~target;
+    uint32_t on = target & ~shadow[channel];
+    actuator_write_locked(channel, off, on);
+    for (int i = 0; i < ACTUATOR_MAX; i++) {
+        if ((off | on) & ACTUATOR_BIT(i)) {
+            changed_at[channel][i] = now;
+        }
+        if ((on & ACTUATOR_BIT(i)) && ++cycles[channel][i] % ACTUATOR_CYCLES_MILESTONE == 0) {
+            milestones |= ACTUATOR_BIT(i);
+            reached[i] = cycles[channel][i];
+        }
+    }
+    shadow[channel] = target;
+    cycles_changed |= on != 0;
+    portEXIT_CRITICAL(&actuator_spinlock);
+
+    for (int i = 0; i < ACTUATOR_MAX; i++) {
+        if (milestones & ACTUATOR_BIT(i)) {
+            ESP_LOGI(TAG, "%d: %s reached %u cycles", channel, limits[i].name, reached[i]);
+        }
+    }
+    if ((target & mask) != requested) {
+        ESP_LOGD(TAG, "%d: held back 0x%02x", channel, (target & mask) ^ requested);
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
+
+esp_err_t actuator_init(context_t *context)
+{
+    ARG_CHECK(context != NULL, ERR_PARAM_NULL);
+
+    settings_t settings;
+    settings_get(&settings);
+
+    uint64_t pin_bit_mask = 0;
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        pins[channel][ACTUATOR_PH_UP_PUMP] = settings.reservoir.ph_up_pump[channel];
+        pins[channel][ACTUATOR_PH_DOWN_PUMP] = settings.reservoir.ph_down_pump[channel];
+        pins[channel][ACTUATOR_TDS_A_PUMP] = settings.reservoir.tds_a_pump[channel];
+        pins[channel][ACTUATOR_TDS_B_PUMP] = settings.reservoir.tds_b_pump[channel];
+        pins[channel][ACTUATOR_TANK_PUMP] = settings.reservoir.tank_pump[channel];
+        pins[channel][ACTUATOR_SOURCE_VALVE] = settings.reservoir.source_valve[channel];
+        pins[channel][ACTUATOR_DRAIN_VALVE] = settings.reservoir.drain_valve[channel];
+        for (int i = 0; i < ACTUATOR_MAX; i++) {
+            if (pins[channel][i] != GPIO_NUM_NC) {
+                connected[channel] |= ACTUATOR_BIT(i);
+                pin_bit_mask |= 1ULL << pins[channel][i];
+            }
+        }
+    }
+
+    /* Start with everything off, the levels are only ever changed through the shadow from here on. */
+    GPIO.out_w1tc = (uint32_t)pin_bit_mask;
+    GPIO.out1_w1tc.val = (uint32_t)(pin_bit_mask >> 32);
+    gpio_config_t config = {
+        .intr_type = GPIO_INTR_DISABLE,
+        .mode = GPIO_MODE_OUTPUT,
+        .pin_bit_mask = pin_bit_mask,
+        .pull_up_en = 1,
+    };
+    ESP_ERROR_CHECK(gpio_config(&config));
+
+    size_t length = sizeof(cycles);
+    esp_err_t err = storage_get_blob(ACTUATOR_CYCLES_KEY, cycles, &length);
+    if (err != ESP_OK || length != sizeof(cycles)) {
+        memset(cycles, 0, sizeof(cycles));
+    }
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        for (int i = 0; i < ACTUATOR_MAX; i++) {
+            if (connected[channel] & ACTUATOR_BIT(i)) {
+                ESP_LOGI(TAG, "%d: %s on GPIO %d, %u cycles", channel, limits[i].name, pins[channel][i],
+                         cycles[channel][i]);
+            }
+        }
+    }
+
+    const esp_timer_create_args_t cycles_timer_args = {
+        .callback = &actuator_cycles_timer_cb,
+        .name = "actuator_cycles_timer",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&cycles_timer_args, &cycles_timer));
+    return esp_timer_start_periodic(cycles_timer, ACTUATOR_CYCLES_PERIOD * 1000000LL);
+}
@@ -0,0 +1,30 @@
+#ifndef HYDROPONICS_ACTUATOR_H
+#define HYDROPONICS_ACTUATOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#include "context.h"
+
+typedef enum {
+    ACTUATOR_PH_UP_PUMP,
+    ACTUATOR_PH_DOWN_PUMP,
+    ACTUATOR_TDS_A_PUMP,
+    ACTUATOR_TDS_B_PUMP,
+    ACTUATOR_TANK_PUMP,
+    ACTUATOR_SOURCE_VALVE,
+    ACTUATOR_DRAIN_VALVE,
+    ACTUATOR_MAX,
+} actuator_t;
+
+#define ACTUATOR_BIT(actuator) (1U << (actuator))
+
+bool actuator_is_connected(actuator_t actuator, int channel);
+
+esp_err_t actuator_set(int channel, uint32_t mask, uint32_t levels);
+
+esp_err_t actuator_init(context_t *context);
+
+#endif // HYDROPONICS_ACTUATOR_H
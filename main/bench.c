@@ -0,0 +1,190 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "cJSON.h"
+
+#include "bench.h"
+#include "error.h"
+#include "mqtt.h"
+#include "placement.h"
+
+#define BENCH_DEFAULT_PERIOD 10     // (int) Probe loop period in millis
+#define BENCH_DEFAULT_DURATION 30   // (int) Run time in seconds
+#define BENCH_DEFAULT_LOAD_RATE 20  // (int) Filler publishes per second, 0 measures without network load
+#define BENCH_MAX_DURATION 300      // (int) Longest run accepted, in seconds
+#define BENCH_MAX_LOAD_RATE 100     // (int) Highest publish rate accepted
+#define BENCH_LOAD_SIZE 512         // (int) Bytes per filler publish
+#define BENCH_BUCKET_US 50          // (int) Width of a jitter histogram bucket
+#define BENCH_BUCKETS 64            // (int) Histogram buckets, the last one collects everything beyond
+
+#define BENCH_RESULT "{\"bench\":{"           \
+                     "\"layout\":\"%s\","     \
+                     "\"build\":\"%s\","      \
+                     "\"core\":%d,"           \
+                     "\"priority\":%u,"       \
+                     "\"periodUs\":%d,"       \
+                     "\"samples\":%u,"        \
+                     "\"loadRate\":%d,"       \
+                     "\"loadPublished\":%u,"  \
+                     "\"jitterMeanUs\":%lld," \
+                     "\"jitterP99Us\":%lld,"  \
+                     "\"jitterMaxUs\":%lld,"  \
+                     "\"latencyMaxUs\":%lld"  \
+                     "}}"
+
+typedef struct {
+    placement_layout_t layout;
+    int period_ms;
+    int duration;
+    int load_rate;
+} bench_job_t;
+
+static const char *TAG = "bench";
+
+static bench_job_t job;
+static TaskHandle_t bench_task_handle;
+static volatile bool load_running;
+static uint32_t load_published;
+static char filler[BENCH_LOAD_SIZE];
+
+/* Keeps the TLS and Wi-Fi path busy with QoS 0 publishes on the bench subfolder, placed like the MQTT task. */
+static void bench_load_task(void *arg)
+{
+    TaskHandle_t bench_task = (TaskHandle_t)arg;
+    TickType_t period = MAX(1, pdMS_TO_TICKS(1000 / job.load_rate));
+    TickType_t wake = xTaskGetTickCount();
+    while (load_running) {
+        if (mqtt_publish_bench(filler, sizeof(filler)) == ESP_OK) {
+            load_published++;
+        }
+        vTaskDelayUntil(&wake, period);
+    }
+    xTaskNotifyGive(bench_task);
+    vTaskDelete(NULL);
+}
+
+/* Runs a periodic loop placed like an acquisition task and records how far each wake-up strays from the period, and
+ * how late it is against the ideal schedule. Only the probe and the load follow the requested layout, the rest of the
+ * firmware keeps the one it was built with, which the result reports as "build". */
+static void bench_task(void *arg)
+{
+    ARG_UNUSED(arg);
+    const placement_t *probe = placement_get(job.layout, PLACEMENT_TASK_PH);
+    const placement_t *load = placement_get(job.layout, PLACEMENT_TASK_MQTT);
+    TickType_t period = pdMS_TO_TICKS(job.period_ms);
+    int32_t period_us = period * portTICK_PERIOD_MS * 1000;
+    uint32_t samples = job.duration * 1000000LL / period_us;
+
+    load_published = 0;
+    load_running = job.load_rate > 0;
+    if (load_running) {
+        xTaskCreatePinnedToCore(bench_load_task, "bench_load", 2560, xTaskGetCurrentTaskHandle(), load->priority, NULL,
+                                load->core);
+    }
+
+    uint32_t histogram[BENCH_BUCKETS] = {0};
+    int64_t jitter_sum = 0;
+    int64_t jitter_max = 0;
+    int64_t latency_max = 0;
+    TickType_t wake = xTaskGetTickCount();
+    int64_t started_at = esp_timer_get_time();
+    int64_t woken_at = started_at;
+    for (uint32_t i = 1; i <= samples; i++) {
+        vTaskDelayUntil(&wake, period);
+        int64_t now = esp_timer_get_time();
+        int64_t jitter = llabs(now - woken_at - period_us);
+        woken_at = now;
+        jitter_sum += jitter;
+        jitter_max = MAX(jitter_max, jitter);
+        latency_max = MAX(latency_max, now - started_at - (int64_t)i * period_us);
+        histogram[MIN(jitter / BENCH_BUCKET_US, BENCH_BUCKETS - 1)]++;
+    }
+
+    if (load_running) {
+        load_running = false;
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+
+    /* Upper edge of the bucket holding the 99th percentile, the maximum once it falls into the overflow bucket. */
+    int bucket = 0;
+    uint32_t below = 0;
+    while (bucket < BENCH_BUCKETS - 1 && (below += histogram[bucket]) < samples - samples / 100) {
+        bucket++;
+    }
+    int64_t p99 = bucket < BENCH_BUCKETS - 1 ? (bucket + 1) * BENCH_BUCKET_US : jitter_max;
+
+    char *msg = NULL;
+    asprintf(&msg, BENCH_RESULT, placement_layout_name(job.layout), placement_layout_name(placement_layout()),
+             probe->core == tskNO_AFFINITY ? -1 : probe->core, probe->priority, period_us, samples, job.load_rate,
+             load_published, jitter_sum / MAX(samples, 1), p99, jitter_max, latency_max);
+    if (msg != NULL) {
+        ESP_LOGI(TAG, "%s", msg);
+        if (mqtt_publish_state(msg) != ESP_OK) {
+            ESP_LOGW(TAG, "Unable to publish the result, not connected");
+        }
+        free(msg);
+    }
+
+    bench_task_handle = NULL;
+    vTaskDelete(NULL);
+}
+
+/* Handles {"layout":"split","periodMs":10,"durationSec":30,"loadRate":20}, every field is optional. The result is
+ * published on the state topic once the run is over. */
+esp_err_t bench_request(const cJSON *json)
+{
+    const cJSON *layout = cJSON_GetObjectItem(json, "layout");
+    const cJSON *period = cJSON_GetObjectItem(json, "periodMs");
+    const cJSON *duration = cJSON_GetObjectItem(json, "durationSec");
+    const cJSON *load_rate = cJSON_GetObjectItem(json, "loadRate");
+    ARG_CHECK(layout == NULL || cJSON_IsString(layout), "layout must be a layout name");
+    ARG_CHECK(period == NULL || (cJSON_IsNumber(period) && period->valueint >= portTICK_PERIOD_MS &&
+                                 period->valueint <= 1000), "invalid period");
+    ARG_CHECK(duration == NULL || (cJSON_IsNumber(duration) && duration->valueint > 0 &&
+                                   duration->valueint <= BENCH_MAX_DURATION), "invalid duration");
+    ARG_CHECK(load_rate == NULL || (cJSON_IsNumber(load_rate) && load_rate->valueint >= 0 &&
+                                    load_rate->valueint <= BENCH_MAX_LOAD_RATE), "invalid load rate");
+
+    placement_layout_t selected = placement_layout();
+    if (layout != NULL) {
+        for (selected = 0; selected < PLACEMENT_LAYOUT_MAX; selected++) {
+            if (strcmp(layout->valuestring, placement_layout_name(selected)) == 0) {
+                break;
+            }
+        }
+        ARG_CHECK(selected < PLACEMENT_LAYOUT_MAX, "unknown layout %s", layout->valuestring);
+    }
+    if (bench_task_handle != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    job = (bench_job_t){
+        .layout = selected,
+        .period_ms = period != NULL ? period->valueint : BENCH_DEFAULT_PERIOD,
+        .duration = duration != NULL ? duration->valueint : BENCH_DEFAULT_DURATION,
+        .load_rate = load_rate != NULL ? load_rate->valueint : BENCH_DEFAULT_LOAD_RATE,
+    };
+    snprintf(filler, sizeof(filler), "-- bench load --\n");
+    memset(filler + strlen(filler), '.', sizeof(filler) - strlen(filler) - 1);
+    filler[sizeof(filler) - 1] = '\n';
+
+    const placement_t *probe = placement_get(job.layout, PLACEMENT_TASK_PH);
+    ESP_LOGI(TAG, "Measuring %s layout for %d s, period %d ms, load %d/s", placement_layout_name(job.layout),
+             job.duration, job.period_ms, job.load_rate);
+    if (xTaskCreatePinnedToCore(bench_task, "bench", 3072, NULL, probe->priority, &bench_task_handle, probe->core) !=
+        pdPASS) {
+        bench_task_handle = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,10 @@
+#ifndef HYDROPONICS_BENCH_H
+#define HYDROPONICS_BENCH_H
+
+#include "esp_err.h"
+
+#include "cJSON.h"
+
+esp_err_t bench_request(const cJSON *json);
+
+#endif // HYDROPONICS_BENCH_H
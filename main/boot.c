@@ -0,0 +1,74 @@
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "boot.h"
+
+#define BOOT_MAX_STAGES 24
+
+static const char *TAG = "boot";
+
+static const char *milestone_names[BOOT_MILESTONE_MAX] = {
+    [BOOT_MILESTONE_SENSOR] = "first sensor reading",
+    [BOOT_MILESTONE_NETWORK] = "network connected",
+    [BOOT_MILESTONE_TIME] = "time set",
+    [BOOT_MILESTONE_PUBLISH] = "first publish",
+};
+
+static struct {
+    const char *name;
+    int64_t at;
+} stages[BOOT_MAX_STAGES];
+static int stage_count = 0;
+
+static int64_t milestones[BOOT_MILESTONE_MAX];
+static portMUX_TYPE spinlock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Records the end of an init stage in app_main. Only called from the main task. */
+void boot_mark_stage(const char *stage)
+{
+    if (stage_count < BOOT_MAX_STAGES) {
+        stages[stage_count].name = stage;
+        stages[stage_count].at = esp_timer_get_time();
+        stage_count++;
+    }
+}
+
+/* Records the first occurrence of a milestone, later occurrences are ignored. The timeline is logged once the first
+ * telemetry has been published. */
+void boot_mark_milestone(boot_milestone_t milestone)
+{
+    if (milestones[milestone] != 0) {
+        return;
+    }
+    bool first = false;
+    portENTER_CRITICAL(&spinlock);
+    if (milestones[milestone] == 0) {
+        milestones[milestone] = esp_timer_get_time();
+        first = true;
+    }
+    portEXIT_CRITICAL(&spinlock);
+
+    if (first && milestone == BOOT_MILESTONE_PUBLISH) {
+        boot_report();
+    }
+}
+
+void boot_report(void)
+{
+    int64_t previous = 0;
+    for (int i = 0; i < stage_count; i++) {
+        ESP_LOGI(TAG, "%-12s %7lld us (+%lld us)", stages[i].name, stages[i].at, stages[i].at - previous);
+        previous = stages[i].at;
+    }
+    for (int i = 0; i < BOOT_MILESTONE_MAX; i++) {
+        if (milestones[i] != 0) {
+            ESP_LOGI(TAG, "%s after %lld ms", milestone_names[i], milestones[i] / 1000);
+        } else {
+            ESP_LOGI(TAG, "%s pending", milestone_names[i]);
+        }
+    }
+}
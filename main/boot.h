@@ -0,0 +1,18 @@
+#ifndef HYDROPONICS_BOOT_H
+#define HYDROPONICS_BOOT_H
+
+typedef enum {
+    BOOT_MILESTONE_SENSOR,
+    BOOT_MILESTONE_NETWORK,
+    BOOT_MILESTONE_TIME,
+    BOOT_MILESTONE_PUBLISH,
+    BOOT_MILESTONE_MAX,
+} boot_milestone_t;
+
+void boot_mark_stage(const char *stage);
+
+void boot_mark_milestone(boot_milestone_t milestone);
+
+void boot_report(void);
+
+#endif // HYDROPONICS_BOOT_H
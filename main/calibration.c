@@ -0,0 +1,355 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+
+#include "cJSON.h"
+
+#include "calibration.h"
+#include "context.h"
+#include "error.h"
+#include "mqtt.h"
+#include "ph.h"
+#include "placement.h"
+#include "settings.h"
+#include "storage.h"
+#include "tds.h"
+
+#define CALIBRATION_KEY "calibration"
+#define CALIBRATION_MAGIC 0x4859444C // "HYDL"
+#define CALIBRATION_VERSION 2        // Curves per reservoir
+#define CALIBRATION_MAX_POINTS 5
+
+#define CALIBRATION_SAMPLE_PERIOD 10   // (int) Sample period while calibrating, in millis
+#define CALIBRATION_WINDOW 50          // (int) Number of samples the settling variance is computed over
+#define CALIBRATION_STABLE_STDDEV 3.0  // (float) Maximum standard deviation of a settled reading, in mV
+#define CALIBRATION_STABLE_SAMPLES 100 // (int) Consecutive samples the reading has to stay settled for
+#define CALIBRATION_TIMEOUT 60000      // (int) Give up when the reading does not settle within this, in millis
+#define CALIBRATION_MIN_SPACING 10.0   // (float) Minimum voltage difference between two points, in mV
+
+#define CALIBRATION_RESULT "{"                     \
+                           "\"calibration\":{"     \
+                           "\"probe\":\"%s\","     \
+                           "\"channel\":%d,"       \
+                           "\"reference\":%.3f,"   \
+                           "\"voltage\":%.1f,"     \
+                           "\"stddev\":%.2f,"      \
+                           "\"settleMs\":%lld,"    \
+                           "\"points\":%d,"        \
+                           "\"result\":\"%s\""     \
+                           "}}"
+
+/* Points are kept sorted by voltage, readings are interpolated linearly between neighbouring points. */
+typedef struct {
+    uint32_t count;
+    struct {
+        float voltage; // in mV
+        float value;   // pH or ppm
+    } points[CALIBRATION_MAX_POINTS];
+} calibration_curve_t;
+
+/* Stored like the settings, behind a header whose CRC covers the curves. */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t length; // Size of the curves following the header
+    uint32_t crc;    // CRC32 of the curves following the header
+} calibration_header_t;
+
+typedef struct {
+    calibration_header_t header;
+    calibration_curve_t curves[SETTINGS_MAX_RESERVOIRS][CALIBRATION_PROBE_MAX];
+} calibration_blob_t;
+
+typedef struct {
+    calibration_probe_t probe;
+    int channel; // Reservoir whose probe is sampled and whose curve gets the point
+    float reference;
+} calibration_job_t;
+
+static const char *TAG = "calibration";
+
+static const char *probe_names[] = {
+    [CALIBRATION_PROBE_PH] = "ph",
+    [CALIBRATION_PROBE_TDS] = "tds",
+};
+
+static uint32_t (*const probe_samplers[])(int channel) = {
+    [CALIBRATION_PROBE_PH] = ph_sample_voltage,
+    [CALIBRATION_PROBE_TDS] = tds_sample_voltage,
+};
+
+static portMUX_TYPE calibration_spinlock = portMUX_INITIALIZER_UNLOCKED;
+/* One curve per probe of every reservoir, laid out like the stored settings to survive a reservoir count change. */
+static calibration_curve_t curves[SETTINGS_MAX_RESERVOIRS][CALIBRATION_PROBE_MAX];
+static volatile int active_probe = -1;
+
+static QueueHandle_t calibration_queue;
+
+bool calibration_is_active(calibration_probe_t probe)
+{
+    return active_probe == probe;
+}
+
+/* Returns ESP_ERR_INVALID_STATE when the probe has less than two points, the caller falls back to its own formula. */
+esp_err_t calibration_apply(calibration_probe_t probe, int channel, float voltage, float *out_value)
+{
+    ARG_CHECK(probe < CALIBRATION_PROBE_MAX && out_value != NULL, ERR_PARAM_NULL);
+    ARG_CHECK(channel >= 0 && channel < CONTEXT_RESERVOIRS, "invalid channel");
+
+    calibration_curve_t curve;
+    portENTER_CRITICAL(&calibration_spinlock);
+    curve = curves[channel][probe];
+    portEXIT_CRITICAL(&calibration_spinlock);
+    if (curve.count < 2) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    /* Find the segment holding the voltage, the outer segments are extrapolated. */
+    int i = 1;
+    while (i < curve.count - 1 && voltage > curve.points[i].voltage) {
+        i++;
+    }
+    float v0 = curve.points[i - 1].voltage, v1 = curve.points[i].voltage;
+    float y0 = curve.points[i - 1].value, y1 = curve.points[i].value;
+    *out_value = y0 + (voltage - v0) * (y1 - y0) / (v1 - v0);
+    return ESP_OK;
+}
+
+static esp_err_t calibration_store(void)
+{
+    calibration_blob_t blob;
+    portENTER_CRITICAL(&calibration_spinlock);
+    memcpy(blob.curves, curves, sizeof(blob.curves));
+    portEXIT_CRITICAL(&calibration_spinlock);
+
+    blob.header = (calibration_header_t){
+        .magic = CALIBRATION_MAGIC,
+        .version = CALIBRATION_VERSION,
+        .length = sizeof(blob.curves),
+        .crc = esp_rom_crc32_le(0, (const uint8_t *)blob.curves, sizeof(blob.curves)),
+    };
+    esp_err_t err = storage_set_blob(CALIBRATION_KEY, &blob, sizeof(blob));
+    return err == ESP_OK ? storage_commit() : err;
+}
+
+/* Loads the stored curves, a blob of another layout or failing its CRC is discarded and the probes start without
+ * calibration. */
+static esp_err_t calibration_load(void)
+{
+    calibration_blob_t *blob = malloc(sizeof(calibration_blob_t));
+    if (blob == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    size_t length = sizeof(calibration_blob_t);
+    esp_err_t err = storage_get_blob(CALIBRATION_KEY, blob, &length);
+    if (err == ESP_OK) {
+        const calibration_header_t *header = &blob->header;
+        if (length != sizeof(calibration_blob_t) || header->magic != CALIBRATION_MAGIC ||
+            header->version != CALIBRATION_VERSION || header->length != sizeof(blob->curves)) {
+            err = ESP_ERR_INVALID_SIZE;
+        } else if (header->crc != esp_rom_crc32_le(0, (const uint8_t *)blob->curves, sizeof(blob->curves))) {
+            err = ESP_ERR_INVALID_CRC;
+        } else {
+            memcpy(curves, blob->curves, sizeof(curves));
+        }
+    }
+    free(blob);
+    return err;
+}
+
+static esp_err_t calibration_add_point(calibration_probe_t probe, int channel, float voltage, float value)
+{
+    calibration_curve_t curve;
+    portENTER_CRITICAL(&calibration_spinlock);
+    curve = curves[channel][probe];
+    portEXIT_CRITICAL(&calibration_spinlock);
+
+    /* Re-calibrating a reference replaces its point. */
+    for (int i = 0; i < curve.count; i++) {
+        if (curve.points[i].value == value) {
+            memmove(&curve.points[i], &curve.points[i + 1], (curve.count - i - 1) * sizeof(curve.points[0]));
+            curve.count--;
+            break;
+        }
+    }
+    if (curve.count == CALIBRATION_MAX_POINTS) {
+        return ESP_ERR_NO_MEM;
+    }
+    int pos = 0;
+    while (pos < curve.count && curve.points[pos].voltage < voltage) {
+        pos++;
+    }
+    if ((pos > 0 && voltage - curve.points[pos - 1].voltage < CALIBRATION_MIN_SPACING) ||
+        (pos < curve.count && curve.points[pos].voltage - voltage < CALIBRATION_MIN_SPACING)) {
+        ESP_LOGW(TAG, "%.1f mV is too close to an existing point", voltage);
+        return ESP_ERR_INVALID_ARG;
+    }
+    memmove(&curve.points[pos + 1], &curve.points[pos], (curve.count - pos) * sizeof(curve.points[0]));
+    curve.points[pos].voltage = voltage;
+    curve.points[pos].value = value;
+    curve.count++;
+
+    portENTER_CRITICAL(&calibration_spinlock);
+    curves[channel][probe] = curve;
+    portEXIT_CRITICAL(&calibration_spinlock);
+    return calibration_store();
+}
+
+/* Clears the curve of one reservoir's probe, or of the probes of every reservoir with a negative channel. */
+static esp_err_t calibration_clear(calibration_probe_t probe, int channel)
+{
+    portENTER_CRITICAL(&calibration_spinlock);
+    for (int i = 0; i < CONTEXT_RESERVOIRS; i++) {
+        if (channel < 0 || channel == i) {
+            curves[i][probe].count = 0;
+        }
+    }
+    portEXIT_CRITICAL(&calibration_spinlock);
+
+    ESP_LOGI(TAG, "Cleared %s calibration of channel %d", probe_names[probe], channel);
+    return calibration_store();
+}
+
+/* Samples the probe until the standard deviation over the last CALIBRATION_WINDOW samples stays below
+ * CALIBRATION_STABLE_STDDEV for CALIBRATION_STABLE_SAMPLES samples in a row. */
+static esp_err_t calibration_settle(calibration_probe_t probe, int channel, float *out_voltage, float *out_stddev,
+                                    int64_t *out_settle_ms)
+{
+    float window[CALIBRATION_WINDOW];
+    int count = 0, stable = 0;
+    int64_t started_at = esp_timer_get_time();
+    TickType_t last_wake = xTaskGetTickCount();
+
+    while (esp_timer_get_time() - started_at < CALIBRATION_TIMEOUT * 1000LL) {
+        window[count % CALIBRATION_WINDOW] = (float)probe_samplers[probe](channel);
+        count++;
+        if (count >= CALIBRATION_WINDOW) {
+            float mean = 0, variance = 0;
+            for (int i = 0; i < CALIBRATION_WINDOW; i++) {
+                mean += window[i];
+            }
+            mean /= CALIBRATION_WINDOW;
+            for (int i = 0; i < CALIBRATION_WINDOW; i++) {
+                variance += (window[i] - mean) * (window[i] - mean);
+            }
+            variance /= CALIBRATION_WINDOW - 1;
+            *out_voltage = mean;
+            *out_stddev = sqrtf(variance);
+            stable = *out_stddev < CALIBRATION_STABLE_STDDEV ? stable + 1 : 0;
+            if (stable >= CALIBRATION_STABLE_SAMPLES) {
+                *out_settle_ms = (esp_timer_get_time() - started_at) / 1000;
+                return ESP_OK;
+            }
+        }
+        vTaskDelayUntil(&last_wake, MAX(1, pdMS_TO_TICKS(CALIBRATION_SAMPLE_PERIOD)));
+    }
+    *out_settle_ms = CALIBRATION_TIMEOUT;
+    return ESP_ERR_TIMEOUT;
+}
+
+static void calibration_task(void *arg)
+{
+    ARG_UNUSED(arg);
+    calibration_job_t job;
+    while (true) {
+        xQueueReceive(calibration_queue, &job, portMAX_DELAY);
+
+        ESP_LOGI(TAG, "Calibrating %s %d at %.3f", probe_names[job.probe], job.channel, job.reference);
+        float voltage = 0, stddev = 0;
+        int64_t settle_ms = 0;
+        esp_err_t err = calibration_settle(job.probe, job.channel, &voltage, &stddev, &settle_ms);
+        if (err == ESP_OK) {
+            err = calibration_add_point(job.probe, job.channel, voltage, job.reference);
+        }
+        active_probe = -1;
+
+        ESP_LOGI(TAG, "%d: %s %.3f -> %.1f mV (stddev %.2f) in %lld ms, err: %s", job.channel, probe_names[job.probe],
+                 job.reference, voltage, stddev, settle_ms, esp_err_to_name(err));
+        char *msg = NULL;
+        asprintf(&msg, CALIBRATION_RESULT, probe_names[job.probe], job.channel, job.reference, voltage, stddev,
+                 settle_ms, curves[job.channel][job.probe].count,
+                 err == ESP_OK ? "ok" : err == ESP_ERR_TIMEOUT ? "timeout" : "error");
+        if (msg != NULL) {
+            mqtt_publish_state(msg);
+            free(msg);
+        }
+    }
+}
+
+/* Handles {"probe":"ph","reference":7.0} to capture a point and {"probe":"ph","clear":true} to drop the curve. The
+ * capture runs in the background and reports on the state topic, the probe's control loop pauses meanwhile. An optional
+ * "channel" selects the reservoir whose probe is calibrated, the first one by default, and the one cleared, all of them
+ * by default. */
+esp_err_t calibration_request(const cJSON *json)
+{
+    const cJSON *probe = cJSON_GetObjectItem(json, "probe");
+    const cJSON *reference = cJSON_GetObjectItem(json, "reference");
+    const cJSON *channel = cJSON_GetObjectItem(json, "channel");
+    ARG_CHECK(cJSON_IsString(probe), "probe is required");
+    ARG_CHECK(channel == NULL || (cJSON_IsNumber(channel) && channel->valueint >= 0 &&
+                                  channel->valueint < CONTEXT_RESERVOIRS), "invalid channel");
+
+    calibration_job_t job = {.probe = CALIBRATION_PROBE_MAX};
+    for (int i = 0; i < CALIBRATION_PROBE_MAX; i++) {
+        if (strcmp(probe->valuestring, probe_names[i]) == 0) {
+            job.probe = i;
+        }
+    }
+    ARG_CHECK(job.probe < CALIBRATION_PROBE_MAX, "unknown probe %s", probe->valuestring);
+
+    if (cJSON_IsTrue(cJSON_GetObjectItem(json, "clear"))) {
+        return calibration_clear(job.probe, channel != NULL ? channel->valueint : -1);
+    }
+    ARG_CHECK(cJSON_IsNumber(reference), "reference is required");
+    job.reference = (float)reference->valuedouble;
+    job.channel = channel != NULL ? channel->valueint : 0;
+
+    if (active_probe != -1) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    active_probe = job.probe;
+    if (xQueueSend(calibration_queue, &job, 0) != pdTRUE) {
+        active_probe = -1;
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
+
+esp_err_t calibration_init(context_t *context)
+{
+    ARG_UNUSED(context);
+
+    esp_err_t err = calibration_load();
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGW(TAG, "Stored calibration is unusable, discarding it. err: %s", esp_err_to_name(err));
+    }
+    for (int channel = 0; channel < SETTINGS_MAX_RESERVOIRS; channel++) {
+        for (int i = 0; i < CALIBRATION_PROBE_MAX; i++) {
+            calibration_curve_t *curve = &curves[channel][i];
+            if (err != ESP_OK || curve->count > CALIBRATION_MAX_POINTS) {
+                curve->count = 0;
+            }
+            if (channel < CONTEXT_RESERVOIRS) {
+                ESP_LOGI(TAG, "%d: %s: %d point(s)", channel, probe_names[i], curve->count);
+            }
+        }
+    }
+
+    calibration_queue = xQueueCreate(1, sizeof(calibration_job_t));
+    if (calibration_queue == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    xTaskCreatePinnedToCore(calibration_task, "calibration", 3072, NULL, placement_priority(PLACEMENT_TASK_CALIBRATION),
+                            NULL, placement_core(PLACEMENT_TASK_CALIBRATION));
+    return ESP_OK;
+}
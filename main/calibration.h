@@ -0,0 +1,26 @@
+#ifndef HYDROPONICS_CALIBRATION_H
+#define HYDROPONICS_CALIBRATION_H
+
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+#include "cJSON.h"
+
+#include "context.h"
+
+typedef enum {
+    CALIBRATION_PROBE_PH,
+    CALIBRATION_PROBE_TDS,
+    CALIBRATION_PROBE_MAX,
+} calibration_probe_t;
+
+bool calibration_is_active(calibration_probe_t probe);
+
+esp_err_t calibration_apply(calibration_probe_t probe, int channel, float voltage, float *out_value);
+
+esp_err_t calibration_request(const cJSON *json);
+
+esp_err_t calibration_init(context_t *context);
+
+#endif // HYDROPONICS_CALIBRATION_H
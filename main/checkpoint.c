@@ -0,0 +1,197 @@
+#include <stddef.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_private/esp_clk.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#include "checkpoint.h"
+#include "context.h"
+#include "error.h"
+
+#define CHECKPOINT_MAGIC 0x48594443                    // "HYDC"
+#define CHECKPOINT_VERSION (0x200 | CONTEXT_RESERVOIRS) // The layout depends on the reservoir count
+
+#if CONFIG_HYDROPONICS_POWER_LIGHT_SLEEP
+/* Every period is a wake-up out of light sleep. Readings restored after a reset may be that old, the pump lockouts are
+ * saved as they are armed and a stale one only ever runs longer. */
+#define CHECKPOINT_INTERVAL 60000 // (int) Checkpoint period in millis
+#else
+#define CHECKPOINT_INTERVAL 1000 // (int) Checkpoint period in millis
+#endif
+
+/* Runtime state kept in RTC slow memory across software resets. Timestamps are taken from the RTC timer, which keeps
+ * counting through a reset while esp_timer starts again from zero. */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t rtc_time;
+    bool time_valid;
+    int64_t wall_time;
+    bool cycle_initialized;
+    int64_t cycle_start_time;
+    float tds[CONTEXT_RESERVOIRS];
+    float ph[CONTEXT_RESERVOIRS];
+    float tank[CONTEXT_RESERVOIRS];
+    float temp;
+    float humidity;
+    int64_t pump_lockout[CHECKPOINT_PUMP_MAX][CONTEXT_RESERVOIRS];
+    uint32_t crc;
+} checkpoint_t;
+
+static const char *TAG = "checkpoint";
+
+static RTC_NOINIT_ATTR checkpoint_t checkpoint;
+
+static context_t *context;
+static esp_timer_handle_t checkpoint_timer;
+static portMUX_TYPE checkpoint_spinlock = portMUX_INITIALIZER_UNLOCKED;
+
+static int64_t pump_ready_at[CHECKPOINT_PUMP_MAX][CONTEXT_RESERVOIRS];
+static int64_t restored_pump_lockout[CHECKPOINT_PUMP_MAX][CONTEXT_RESERVOIRS];
+
+static uint32_t checkpoint_crc(const checkpoint_t *state)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)state, offsetof(checkpoint_t, crc));
+}
+
+/* Remaining pump lockout restored from the checkpoint, in micros. */
+int64_t checkpoint_get_pump_lockout(checkpoint_pump_t pump, int channel)
+{
+    return restored_pump_lockout[pump][channel];
+}
+
+/* Called when a pump lockout is armed, 'ready_at' is in esp_timer time. The checkpoint is refreshed right away, the
+ * periodic one may be a minute away. */
+void checkpoint_set_pump_ready_at(checkpoint_pump_t pump, int channel, int64_t ready_at)
+{
+    pump_ready_at[pump][channel] = ready_at;
+    checkpoint_save();
+}
+
+void checkpoint_save(void)
+{
+    if (context == NULL) {
+        return;
+    }
+    checkpoint_t state = {
+        .magic = CHECKPOINT_MAGIC,
+        .version = CHECKPOINT_VERSION,
+        .rtc_time = esp_clk_rtc_time(),
+        .time_valid = (xEventGroupGetBits(context->event_group) & CONTEXT_EVENT_TIME) != 0,
+        .cycle_initialized = context->cycle.initialized,
+        .cycle_start_time = context->cycle.start_time,
+        .temp = context->sensors.temp,
+        .humidity = context->sensors.humidity,
+    };
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    state.wall_time = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+    int64_t now = esp_timer_get_time();
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        state.tds[channel] = context->sensors.tds.value[channel];
+        state.ph[channel] = context->sensors.ph.value[channel];
+        state.tank[channel] = context->sensors.tank.value[channel];
+        for (int i = 0; i < CHECKPOINT_PUMP_MAX; i++) {
+            int64_t ready_at = pump_ready_at[i][channel];
+            state.pump_lockout[i][channel] = ready_at > now ? ready_at - now : 0;
+        }
+    }
+    state.crc = checkpoint_crc(&state);
+    /* Saved from the timer, the dosing tasks and the shutdown handler, a torn copy would fail its CRC. */
+    portENTER_CRITICAL(&checkpoint_spinlock);
+    checkpoint = state;
+    portEXIT_CRITICAL(&checkpoint_spinlock);
+}
+
+static void checkpoint_timer_cb(void *arg)
+{
+    ARG_UNUSED(arg);
+    checkpoint_save();
+}
+
+static bool checkpoint_is_valid(void)
+{
+    switch (esp_reset_reason()) {
+    case ESP_RST_SW:
+    case ESP_RST_PANIC:
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+        break;
+    default:
+        /* RTC memory content is undefined after a power cycle or a brownout. */
+        return false;
+    }
+    return checkpoint.magic == CHECKPOINT_MAGIC && checkpoint.version == CHECKPOINT_VERSION &&
+           checkpoint.crc == checkpoint_crc(&checkpoint) && esp_clk_rtc_time() >= checkpoint.rtc_time;
+}
+
+static void checkpoint_restore(void)
+{
+    int64_t downtime = (int64_t)(esp_clk_rtc_time() - checkpoint.rtc_time);
+
+    if (checkpoint.time_valid) {
+        int64_t wall_time = checkpoint.wall_time + downtime;
+        struct timeval tv = {
+            .tv_sec = wall_time / 1000000,
+            .tv_usec = wall_time % 1000000,
+        };
+        settimeofday(&tv, NULL);
+        ESP_ERROR_CHECK(context_set_time_updated(context));
+    }
+    if (checkpoint.cycle_initialized) {
+        ESP_ERROR_CHECK(context_set_cycle(context, checkpoint.cycle_start_time));
+    }
+
+    /* Seed the last known readings so control does not start from zero while the first samples are taken. */
+    context_lock(context);
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        context->sensors.tds.value[channel] = checkpoint.tds[channel];
+        context->sensors.ph.value[channel] = checkpoint.ph[channel];
+        context->sensors.tank.value[channel] = checkpoint.tank[channel];
+    }
+    context->sensors.temp = checkpoint.temp;
+    context->sensors.humidity = checkpoint.humidity;
+    context_unlock(context);
+    xEventGroupSetBits(context->event_group, CONTEXT_EVENT_TDS | CONTEXT_EVENT_PH | CONTEXT_EVENT_TANK |
+                                                 CONTEXT_EVENT_TEMPERATURE | CONTEXT_EVENT_HUMIDITY);
+
+    for (int i = 0; i < CHECKPOINT_PUMP_MAX; i++) {
+        for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+            int64_t lockout = checkpoint.pump_lockout[i][channel];
+            restored_pump_lockout[i][channel] = lockout > downtime ? lockout - downtime : 0;
+        }
+    }
+    ESP_LOGI(TAG, "Restored state from %lld ms ago (time %s, cycle %s)", downtime / 1000,
+             checkpoint.time_valid ? "valid" : "unset", checkpoint.cycle_initialized ? "running" : "idle");
+}
+
+esp_err_t checkpoint_init(context_t *ctx)
+{
+    ARG_CHECK(ctx != NULL, ERR_PARAM_NULL);
+
+    context = ctx;
+    if (checkpoint_is_valid()) {
+        checkpoint_restore();
+    } else {
+        ESP_LOGI(TAG, "No valid checkpoint, cold start");
+    }
+    memset(&checkpoint, 0, sizeof(checkpoint));
+
+    const esp_timer_create_args_t checkpoint_timer_args = {
+        .callback = &checkpoint_timer_cb,
+        .name = "checkpoint_timer",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&checkpoint_timer_args, &checkpoint_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(checkpoint_timer, CHECKPOINT_INTERVAL * 1000));
+    /* esp_restart runs the shutdown handlers, so a requested restart always leaves an up to date checkpoint. */
+    return esp_register_shutdown_handler(checkpoint_save);
+}
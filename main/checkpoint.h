@@ -0,0 +1,24 @@
+#ifndef HYDROPONICS_CHECKPOINT_H
+#define HYDROPONICS_CHECKPOINT_H
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#include "context.h"
+
+typedef enum {
+    CHECKPOINT_PUMP_PH,
+    CHECKPOINT_PUMP_TDS,
+    CHECKPOINT_PUMP_MAX,
+} checkpoint_pump_t;
+
+int64_t checkpoint_get_pump_lockout(checkpoint_pump_t pump, int channel);
+
+void checkpoint_set_pump_ready_at(checkpoint_pump_t pump, int channel, int64_t ready_at);
+
+void checkpoint_save(void);
+
+esp_err_t checkpoint_init(context_t *context);
+
+#endif // HYDROPONICS_CHECKPOINT_H
@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "cJSON.h"
+
+#include "bench.h"
+#include "calibration.h"
+#include "command.h"
+#include "context.h"
+#include "cycle.h"
+#include "error.h"
+#include "logstream.h"
+#include "mqtt.h"
+#include "ntp.h"
+#include "ota.h"
+#include "placement.h"
+#include "recipe.h"
+#include "settings.h"
+#include "wifi.h"
+
+#define COMMAND_START_CYCLE 0
+#define COMMAND_END_CYCLE 1
+#define COMMAND_SET_CONSTANT 2
+#define COMMAND_ADD_NETWORK 3
+#define COMMAND_SET_SETTINGS 4
+#define COMMAND_CALIBRATE 5
+#define COMMAND_SET_RECIPE 6
+#define COMMAND_SET_TIMEZONE 7
+#define COMMAND_SET_LOG_LEVEL 8
+#define COMMAND_BENCHMARK 9
+#define COMMAND_OTA_DELTA 10
+
+#define COMMAND_QUEUE_LENGTH 4 // (int) Pending commands per priority level
+#define COMMAND_ID_LENGTH 40
+
+#define COMMAND_ACK "{"                   \
+                    "\"cmdId\":\"%s\","   \
+                    "\"cmdType\":%d,"     \
+                    "\"result\":\"%s\","  \
+                    "\"queueUs\":%lld,"   \
+                    "\"execUs\":%lld"     \
+                    "}"
+
+typedef enum {
+    COMMAND_PRIORITY_HIGH,
+    COMMAND_PRIORITY_NORMAL,
+    COMMAND_PRIORITY_MAX,
+} command_priority_t;
+
+typedef struct {
+    int type;
+    char id[COMMAND_ID_LENGTH];
+    int64_t received_at;
+    cJSON *json;
+} command_t;
+
+typedef esp_err_t (*command_handler_t)(const cJSON *json);
+
+typedef struct {
+    command_priority_t priority;
+    command_handler_t handler;
+} command_entry_t;
+
+static const char *TAG = "command";
+
+static context_t *context;
+
+static QueueHandle_t command_queues[COMMAND_PRIORITY_MAX];
+static SemaphoreHandle_t command_pending;
+
+static esp_err_t command_start_cycle(const cJSON *json)
+{
+    ARG_UNUSED(json);
+    return cycle_start();
+}
+
+/* The control tasks keep running, the cycle drains the tanks and goes back to idle without a restart. */
+static esp_err_t command_end_cycle(const cJSON *json)
+{
+    ARG_UNUSED(json);
+    return cycle_end();
+}
+
+/* Sets the probe offsets of the reservoir in "channel", or of every reservoir without it. */
+static esp_err_t command_set_constant(const cJSON *json)
+{
+    const cJSON *tds = cJSON_GetObjectItem(json, "tds");
+    const cJSON *ph = cJSON_GetObjectItem(json, "ph");
+    const cJSON *channel = cJSON_GetObjectItem(json, "channel");
+    ARG_CHECK(cJSON_IsNumber(tds) && cJSON_IsNumber(ph), "tds and ph constants are required");
+    ARG_CHECK(channel == NULL || (cJSON_IsNumber(channel) && channel->valueint >= 0 &&
+                                  channel->valueint < CONTEXT_RESERVOIRS), "invalid channel");
+    for (int i = 0; i < CONTEXT_RESERVOIRS; i++) {
+        if (channel == NULL || channel->valueint == i) {
+            context->sensors.tds.constant[i] = tds->valueint;
+            context->sensors.ph.constant[i] = ph->valueint;
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t command_add_network(const cJSON *json)
+{
+    const cJSON *ssid = cJSON_GetObjectItem(json, "ssid");
+    const cJSON *password = cJSON_GetObjectItem(json, "password");
+    ARG_CHECK(cJSON_IsString(ssid) && cJSON_IsString(password), "ssid and password are required");
+    return wifi_add_network((const uint8_t *)ssid->valuestring, (const uint8_t *)password->valuestring);
+}
+
+static esp_err_t command_set_settings(const cJSON *json)
+{
+    esp_err_t err = settings_update(cJSON_GetObjectItem(json, "settings"));
+    /* Targets set by the current recipe stage take precedence over the ones from the settings. */
+    return err == ESP_OK ? recipe_update() : err;
+}
+
+static esp_err_t command_set_recipe(const cJSON *json)
+{
+    return recipe_set(cJSON_GetObjectItem(json, "recipe"));
+}
+
+static esp_err_t command_set_timezone(const cJSON *json)
+{
+    const cJSON *tz = cJSON_GetObjectItem(json, "tz");
+    ARG_CHECK(cJSON_IsString(tz), "tz is required");
+    return ntp_set_timezone(tz->valuestring);
+}
+
+static const command_entry_t commands[] = {
+    [COMMAND_START_CYCLE] = {COMMAND_PRIORITY_NORMAL, command_start_cycle},
+    [COMMAND_END_CYCLE] = {COMMAND_PRIORITY_HIGH, command_end_cycle},
+    [COMMAND_SET_CONSTANT] = {COMMAND_PRIORITY_NORMAL, command_set_constant},
+    [COMMAND_ADD_NETWORK] = {COMMAND_PRIORITY_NORMAL, command_add_network},
+    [COMMAND_SET_SETTINGS] = {COMMAND_PRIORITY_NORMAL, command_set_settings},
+    [COMMAND_CALIBRATE] = {COMMAND_PRIORITY_NORMAL, calibration_request},
+    [COMMAND_SET_RECIPE] = {COMMAND_PRIORITY_NORMAL, command_set_recipe},
+    [COMMAND_SET_TIMEZONE] = {COMMAND_PRIORITY_NORMAL, command_set_timezone},
+    [COMMAND_SET_LOG_LEVEL] = {COMMAND_PRIORITY_NORMAL, logstream_configure},
+    [COMMAND_BENCHMARK] = {COMMAND_PRIORITY_NORMAL, bench_request},
+    [COMMAND_OTA_DELTA] = {COMMAND_PRIORITY_NORMAL, ota_request},
+};
+
+static void command_acknowledge(const char *id, int type, const char *result, int64_t queue_us, int64_t exec_us)
+{
+    char *msg = NULL;
+    asprintf(&msg, COMMAND_ACK, id, type, result, queue_us, exec_us);
+    if (msg == NULL) {
+        return;
+    }
+    if (mqtt_publish_state(msg) != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to acknowledge command %s, not connected", id);
+    }
+    free(msg);
+}
+
+static void command_execute(command_t *cmd)
+{
+    int64_t started_at = esp_timer_get_time();
+    esp_err_t err = commands[cmd->type].handler(cmd->json);
+    int64_t finished_at = esp_timer_get_time();
+
+    ESP_LOGI(TAG, "Command %s (type %d) done in %lld us, err: %s", cmd->id, cmd->type,
+             finished_at - started_at, esp_err_to_name(err));
+    command_acknowledge(cmd->id, cmd->type, err == ESP_OK ? "ok" : "error",
+                        started_at - cmd->received_at, finished_at - started_at);
+    cJSON_Delete(cmd->json);
+}
+
+static void command_task(void *arg)
+{
+    ARG_UNUSED(arg);
+    while (true) {
+        xSemaphoreTake(command_pending, portMAX_DELAY);
+        command_t cmd;
+        for (int priority = 0; priority < COMMAND_PRIORITY_MAX; priority++) {
+            if (xQueueReceive(command_queues[priority], &cmd, 0) == pdTRUE) {
+                command_execute(&cmd);
+                break;
+            }
+        }
+    }
+}
+
+/* Called from the iotc event loop, so only parse and enqueue here. The payload is not retained by the caller. */
+esp_err_t command_submit(const uint8_t *payload, size_t length)
+{
+    ARG_CHECK(payload != NULL, ERR_PARAM_NULL);
+
+    command_t cmd = {
+        .type = -1,
+        .received_at = esp_timer_get_time(),
+        .json = cJSON_ParseWithLength((const char *)payload, length),
+    };
+    const cJSON *type = cJSON_GetObjectItem(cmd.json, "cmdType");
+    const cJSON *id = cJSON_GetObjectItem(cmd.json, "cmdId");
+    if (cJSON_IsString(id)) {
+        strlcpy(cmd.id, id->valuestring, sizeof(cmd.id));
+    }
+    if (cJSON_IsNumber(type)) {
+        cmd.type = type->valueint;
+    }
+    if (cmd.type < 0 || cmd.type >= sizeof(commands) / sizeof(commands[0]) || commands[cmd.type].handler == NULL) {
+        ESP_LOGE(TAG, "Invalid command type: %d", cmd.type);
+        command_acknowledge(cmd.id, cmd.type, "invalid", 0, 0);
+        cJSON_Delete(cmd.json);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (xQueueSend(command_queues[commands[cmd.type].priority], &cmd, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Command queue full, rejecting command %s", cmd.id);
+        command_acknowledge(cmd.id, cmd.type, "busy", 0, 0);
+        cJSON_Delete(cmd.json);
+        return ESP_ERR_NO_MEM;
+    }
+    xSemaphoreGive(command_pending);
+    return ESP_OK;
+}
+
+esp_err_t command_init(context_t *ctx)
+{
+    ARG_CHECK(ctx != NULL, ERR_PARAM_NULL);
+
+    context = ctx;
+    for (int priority = 0; priority < COMMAND_PRIORITY_MAX; priority++) {
+        command_queues[priority] = xQueueCreate(COMMAND_QUEUE_LENGTH, sizeof(command_t));
+        if (command_queues[priority] == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    command_pending = xSemaphoreCreateCounting(COMMAND_QUEUE_LENGTH * COMMAND_PRIORITY_MAX, 0);
+    if (command_pending == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    xTaskCreatePinnedToCore(command_task, "command", 4096, NULL, placement_priority(PLACEMENT_TASK_COMMAND), NULL,
+                            placement_core(PLACEMENT_TASK_COMMAND));
+    return ESP_OK;
+}
@@ -0,0 +1,15 @@
+#ifndef HYDROPONICS_COMMAND_H
+#define HYDROPONICS_COMMAND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#include "context.h"
+
+esp_err_t command_submit(const uint8_t *payload, size_t length);
+
+esp_err_t command_init(context_t *context);
+
+#endif // HYDROPONICS_COMMAND_H
@@ -3,14 +3,10 @@
 
 #include "esp_err.h"
 
+#include "boot.h"
 #include "context.h"
 #include "error.h"
 
-#define CONTEXT_PH_MIN_VALUE 5.5
-#define CONTEXT_PH_MAX_VALUE 6.5
-#define CONTEXT_TANK_MIN_VALUE 20
-#define CONTEXT_TANK_MAX_VALUE 24
-
 #define context_set(p, v, f)  \
     do {                      \
         if ((p) != (v)) {     \
@@ -52,23 +48,25 @@ context_t *context_create(void)
     context->sensors.temp = 0;
     context->sensors.humidity = 0;
 
-    context->sensors.tds.value = 0;
-    context->sensors.tds.target_min = 0;
+    /* pH and tank targets are applied from the settings. */
     context->sensors.tds.target_min = 0;
-    context->sensors.tds.constant = 0;
+    context->sensors.tds.target_max = 0;
     context->sensors.tds.task_handle = NULL;
-
-    context->sensors.ph.value = 0;
-    context->sensors.ph.target_min = CONTEXT_PH_MIN_VALUE;
-    context->sensors.ph.target_max = CONTEXT_PH_MAX_VALUE;
-    context->sensors.ph.constant = 0;
+    context->sensors.ph.target_min = 0;
+    context->sensors.ph.target_max = 0;
     context->sensors.ph.task_handle = NULL;
-
-    context->sensors.tank.value = 0;
-    context->sensors.tank.target_min = CONTEXT_TANK_MIN_VALUE;
-    context->sensors.tank.target_max = CONTEXT_TANK_MAX_VALUE;
+    context->sensors.tank.target_min = 0;
+    context->sensors.tank.target_max = 0;
     context->sensors.tank.task_handle = NULL;
 
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        context->sensors.tds.value[channel] = 0;
+        context->sensors.tds.constant[channel] = 0;
+        context->sensors.ph.value[channel] = 0;
+        context->sensors.ph.constant[channel] = 0;
+        context->sensors.tank.value[channel] = 0;
+    }
+
     return context;
 }
 
@@ -82,10 +80,12 @@ inline void context_unlock(context_t *context)
     portEXIT_CRITICAL(&context->spinlock);
 }
 
-esp_err_t context_set_tds(context_t *context, float value)
+esp_err_t context_set_tds(context_t *context, int channel, float value)
 {
     ARG_CHECK(context != NULL, ERR_PARAM_NULL);
-    context_set_single(context, context->sensors.tds.value, value, CONTEXT_EVENT_TDS);
+    ARG_CHECK(channel >= 0 && channel < CONTEXT_RESERVOIRS, "invalid channel %d", channel);
+    boot_mark_milestone(BOOT_MILESTONE_SENSOR);
+    context_set_single(context, context->sensors.tds.value[channel], value, CONTEXT_EVENT_TDS);
     return ESP_OK;
 }
 
@@ -97,22 +97,50 @@ esp_err_t context_set_target_tds(context_t *context, float min, float max)
     return ESP_OK;
 }
 
-esp_err_t context_set_ph(context_t *context, float value)
+esp_err_t context_set_target_ph(context_t *context, float min, float max)
+{
+    ARG_CHECK(context != NULL, ERR_PARAM_NULL);
+    context_set_single(context, context->sensors.ph.target_min, min, CONTEXT_EVENT_PH);
+    context_set_single(context, context->sensors.ph.target_max, max, CONTEXT_EVENT_PH);
+    return ESP_OK;
+}
+
+esp_err_t context_set_ph(context_t *context, int channel, float value)
 {
     ARG_CHECK(context != NULL, ERR_PARAM_NULL);
-    context_set_single(context, context->sensors.ph.value, value, CONTEXT_EVENT_PH);
+    ARG_CHECK(channel >= 0 && channel < CONTEXT_RESERVOIRS, "invalid channel %d", channel);
+    boot_mark_milestone(BOOT_MILESTONE_SENSOR);
+    context_set_single(context, context->sensors.ph.value[channel], value, CONTEXT_EVENT_PH);
     return ESP_OK;
 }
 
-esp_err_t context_set_tank(context_t *context, float value)
+esp_err_t context_set_tank(context_t *context, int channel, float value)
 {
     ARG_CHECK(context != NULL, ERR_PARAM_NULL);
-    context_set_single(context, context->sensors.tank.value, value, CONTEXT_EVENT_TANK);
+    ARG_CHECK(channel >= 0 && channel < CONTEXT_RESERVOIRS, "invalid channel %d", channel);
+    boot_mark_milestone(BOOT_MILESTONE_SENSOR);
+    context_set_single(context, context->sensors.tank.value[channel], value, CONTEXT_EVENT_TANK);
+    return ESP_OK;
+}
+
+/* Dosing is only done while the reservoir is filled to its target range. */
+bool context_tank_in_range(context_t *context, int channel)
+{
+    float level = context->sensors.tank.value[channel];
+    return level >= context->sensors.tank.target_min && level <= context->sensors.tank.target_max;
+}
+
+esp_err_t context_set_target_tank(context_t *context, float min, float max)
+{
+    ARG_CHECK(context != NULL, ERR_PARAM_NULL);
+    context_set_single(context, context->sensors.tank.target_min, min, CONTEXT_EVENT_TANK);
+    context_set_single(context, context->sensors.tank.target_max, max, CONTEXT_EVENT_TANK);
     return ESP_OK;
 }
 
 esp_err_t context_set_temp_humidity(context_t *context, float temp, float humidity)
 {
+    boot_mark_milestone(BOOT_MILESTONE_SENSOR);
     EventBits_t bitsToSet = 0U;
     context_lock(context);
     context_set(context->sensors.temp, temp, CONTEXT_EVENT_TEMPERATURE);
@@ -134,6 +162,9 @@ esp_err_t context_set_network_connected(context_t *context, bool connected)
 {
     ARG_CHECK(context != NULL, ERR_PARAM_NULL);
     context_set_flags(context, connected, CONTEXT_EVENT_NETWORK);
+    if (connected) {
+        boot_mark_milestone(BOOT_MILESTONE_NETWORK);
+    }
     return ESP_OK;
 }
 
@@ -147,6 +178,7 @@ esp_err_t context_set_network_error(context_t *context, bool error)
 esp_err_t context_set_time_updated(context_t *context)
 {
     ARG_CHECK(context != NULL, ERR_PARAM_NULL);
+    boot_mark_milestone(BOOT_MILESTONE_TIME);
     xEventGroupSetBits(context->event_group, CONTEXT_EVENT_TIME);
     return ESP_OK;
 }
@@ -165,3 +197,11 @@ esp_err_t context_set_cycle(context_t *context, int64_t start_time)
     context_set_single(context, context->cycle.initialized, true, CONTEXT_EVENT_CYCLE);
     return ESP_OK;
 }
+
+esp_err_t context_clear_cycle(context_t *context)
+{
+    ARG_CHECK(context != NULL, ERR_PARAM_NULL);
+    context_set_single(context, context->cycle.initialized, false, CONTEXT_EVENT_CYCLE);
+    context_set_single(context, context->cycle.elapsed_days, 0, CONTEXT_EVENT_CYCLE);
+    return ESP_OK;
+}
@@ -9,6 +9,8 @@
 
 #include "esp_bit_defs.h"
 
+#define CONTEXT_RESERVOIRS CONFIG_HYDROPONICS_RESERVOIR_COUNT // (int) Reservoirs run by this controller
+
 #define CONTEXT_UNKNOWN_VALUE INT16_MIN
 #define CONTEXT_VALUE_IS_VALID(x) ((x) != CONTEXT_UNKNOWN_VALUE)
 
@@ -51,22 +53,24 @@ typedef struct {
     struct {
         volatile float temp;
         volatile float humidity;
+        /* Readings are laid out per field, indexed by reservoir, so a control pass walks each array once. The targets
+         * are shared by all reservoirs. */
         struct {
-            volatile float value;
+            volatile float value[CONTEXT_RESERVOIRS];
             volatile float target_min;
             volatile float target_max;
-            volatile int constant;
+            volatile int constant[CONTEXT_RESERVOIRS];
             TaskHandle_t task_handle;
         } tds;
         struct {
-            volatile float value;
+            volatile float value[CONTEXT_RESERVOIRS];
             volatile float target_min;
             volatile float target_max;
-            volatile int constant;
+            volatile int constant[CONTEXT_RESERVOIRS];
             TaskHandle_t task_handle;
         } ph;
         struct {
-            volatile float value;
+            volatile float value[CONTEXT_RESERVOIRS];
             volatile float target_min;
             volatile float target_max;
             TaskHandle_t task_handle;
@@ -80,13 +84,19 @@ void context_lock(context_t *context);
 
 void context_unlock(context_t *context);
 
-esp_err_t context_set_tds(context_t *context, float value);
+esp_err_t context_set_tds(context_t *context, int channel, float value);
 
 esp_err_t context_set_target_tds(context_t *context, float min, float max);
 
-esp_err_t context_set_ph(context_t *context, float value);
+esp_err_t context_set_ph(context_t *context, int channel, float value);
+
+esp_err_t context_set_target_ph(context_t *context, float min, float max);
+
+esp_err_t context_set_tank(context_t *context, int channel, float value);
 
-esp_err_t context_set_tank(context_t *context, float value);
+bool context_tank_in_range(context_t *context, int channel);
+
+esp_err_t context_set_target_tank(context_t *context, float min, float max);
 
 esp_err_t context_set_temp_humidity(context_t *context, float temp, float humidity);
 
@@ -102,4 +112,6 @@ esp_err_t context_set_iot_connected(context_t *context, bool connected);
 
 esp_err_t context_set_cycle(context_t *context, int64_t start_time);
 
+esp_err_t context_clear_cycle(context_t *context);
+
 #endif // HYDROPONICS_CONTEXT_H
@@ -4,78 +4,227 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
-#include "driver/gpio.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "context.h"
+#include "cycle.h"
 #include "error.h"
+#include "mqtt.h"
+#include "placement.h"
+#include "recipe.h"
 #include "storage.h"
 
-#define GROW_LIGHT_GPIO 21
+#define CYCLE_STATE_MSG "{"                   \
+                        "\"cycle\":\"%s\","   \
+                        "\"latencyUs\":%lld," \
+                        "\"previousMs\":%lld" \
+                        "}"
+
+#define CYCLE_ERROR_MSG "{"                 \
+                        "\"cycle\":\"%s\"," \
+                        "\"error\":\"%s\""  \
+                        "}"
+
+typedef enum {
+    CYCLE_REQUEST_START,
+    CYCLE_REQUEST_END,
+    CYCLE_REQUEST_FILLED,
+    CYCLE_REQUEST_DRAINED,
+    CYCLE_REQUEST_DRAIN_FAILED,
+    CYCLE_REQUEST_MAX,
+} cycle_request_t;
 
 static const char *TAG = "cycle";
 
-static void cycle_task(void *arg)
+static const char *state_names[CYCLE_STATE_MAX] = {
+    [CYCLE_STATE_IDLE] = "idle",
+    [CYCLE_STATE_FILLING] = "filling",
+    [CYCLE_STATE_RUNNING] = "running",
+    [CYCLE_STATE_DRAINING] = "draining",
+};
+
+static context_t *context;
+
+/* Transitions are requested from any task and carried out by the cycle task, in request order per kind. */
+static portMUX_TYPE cycle_spinlock = portMUX_INITIALIZER_UNLOCKED;
+static volatile cycle_state_t state = CYCLE_STATE_IDLE;
+static int64_t requested_at[CYCLE_REQUEST_MAX]; // esp_timer time of the pending requests, 0 when none is pending
+static int64_t pending_since = 0;               // Request time of the transition the control jobs have not applied yet
+static int64_t entered_at = 0;                  // esp_timer time the current state was applied
+
+cycle_state_t cycle_get_state(void)
+{
+    return state;
+}
+
+static void cycle_request(cycle_request_t request)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&cycle_spinlock);
+    if (requested_at[request] == 0) {
+        requested_at[request] = now;
+    }
+    portEXIT_CRITICAL(&cycle_spinlock);
+    xTaskNotifyGive(context->cycle.task_handle);
+}
+
+esp_err_t cycle_start(void)
+{
+    if (state != CYCLE_STATE_IDLE) {
+        ESP_LOGW(TAG, "Cannot start a cycle while %s", state_names[state]);
+        return ESP_ERR_INVALID_STATE;
+    }
+    cycle_request(CYCLE_REQUEST_START);
+    return ESP_OK;
+}
+
+esp_err_t cycle_end(void)
+{
+    if (state != CYCLE_STATE_FILLING && state != CYCLE_STATE_RUNNING) {
+        ESP_LOGW(TAG, "Cannot end a cycle while %s", state_names[state]);
+        return ESP_ERR_INVALID_STATE;
+    }
+    cycle_request(CYCLE_REQUEST_END);
+    return ESP_OK;
+}
+
+/* Called by the tank task once every tank reached its minimum level. */
+void cycle_filled(void)
 {
-    context_t *context = (context_t *)arg;
-    ARG_ERROR_CHECK(context != NULL, ERR_PARAM_NULL);
+    cycle_request(CYCLE_REQUEST_FILLED);
+}
 
-    ESP_LOGI(TAG, "Waiting for cycle time to be initialized.");
-    xEventGroupWaitBits(context->event_group, CONTEXT_EVENT_TIME | CONTEXT_EVENT_CYCLE,
-                        pdFALSE, pdTRUE, portMAX_DELAY);
+/* Called by the tank task once every tank is drained and its outputs are closed. */
+void cycle_drained(void)
+{
+    cycle_request(CYCLE_REQUEST_DRAINED);
+}
 
-    gpio_config_t config = {
-        .intr_type = GPIO_INTR_DISABLE,
-        .mode = GPIO_MODE_OUTPUT,
-        .pin_bit_mask = (1ULL << GROW_LIGHT_GPIO),
-        .pull_up_en = 1,
-    };
-    gpio_config(&config);
+/* Called by the tank task when the tanks did not drain in time, its outputs are closed and the cycle goes back to
+ * idle with an error published, so that a failed level sensor or a blocked drain does not hold the device. */
+void cycle_drain_failed(void)
+{
+    cycle_request(CYCLE_REQUEST_DRAIN_FAILED);
+}
+
+/* Called by the tank task after a pass in 'applied', the first one after a transition completes it. */
+void cycle_acknowledge(cycle_state_t applied)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&cycle_spinlock);
+    bool completed = applied == state && pending_since != 0;
+    int64_t latency = now - pending_since;
+    int64_t previous = now - entered_at;
+    if (completed) {
+        pending_since = 0;
+        entered_at = now;
+    }
+    portEXIT_CRITICAL(&cycle_spinlock);
+    if (!completed) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "%s in %lld us, previous state lasted %lld ms", state_names[applied], latency, previous / 1000);
+    char msg[96];
+    snprintf(msg, sizeof(msg), CYCLE_STATE_MSG, state_names[applied], latency, previous / 1000);
+    if (mqtt_publish_state(msg) != ESP_OK) {
+        ESP_LOGD(TAG, "Unable to publish the cycle state, not connected");
+    }
+}
+
+static void cycle_on_start(void)
+{
+    int64_t start_time = (int64_t)time(NULL);
+    ESP_ERROR_CHECK(context_set_cycle(context, start_time));
+    ESP_ERROR_CHECK(storage_set_i64("cycle_start_tm", start_time));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(recipe_update());
+    /* The cycle start must survive a power loss, don't wait for the coalesced commit. */
+    ESP_ERROR_CHECK_WITHOUT_ABORT(storage_commit());
 
     struct tm timeinfo = {0};
     char strftime_buf[64] = {0};
     localtime_r((time_t *)&context->cycle.start_time, &timeinfo);
     strftime(strftime_buf, sizeof(strftime_buf), "%F %R", &timeinfo);
     ESP_LOGI(TAG, "Cycle started on %s", strftime_buf);
+}
 
-    while (true) {
-        time_t current_time = time(NULL);
-        localtime_r(&current_time, &timeinfo);
-        if (timeinfo.tm_hour > 5 && timeinfo.tm_hour < 18) {
-            gpio_set_level(GROW_LIGHT_GPIO, 1);
-        } else {
-            gpio_set_level(GROW_LIGHT_GPIO, 0);
-        }
-        double elapsed_time = difftime(current_time, (time_t)context->cycle.start_time);
-        int elapsed_days = (int)(elapsed_time / (24 * 3600)) + 1;
-        ESP_LOGI(TAG, "Days since cycle start: %d", elapsed_days);
-        context->cycle.elapsed_days = elapsed_days;
-        if (elapsed_days > 21) {
-            context_set_target_tds(context, 875, 925);
-        } else if (elapsed_days > 14) {
-            context_set_target_tds(context, 775, 825);
-        } else if (elapsed_days > 7) {
-            context_set_target_tds(context, 675, 725);
-        } else if (elapsed_days > 0) {
-            context_set_target_tds(context, 575, 625);
+static void cycle_on_end(void)
+{
+    ESP_ERROR_CHECK_WITHOUT_ABORT(recipe_stop());
+    ESP_ERROR_CHECK(context_clear_cycle(context));
+    ESP_ERROR_CHECK(storage_set_i64("cycle_start_tm", 0));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(storage_commit());
+}
+
+/* Moves to 'next' if 'request' is pending and allowed in the current state, the control jobs are woken to apply it. */
+static void cycle_transition(cycle_request_t request, cycle_state_t from, cycle_state_t to, cycle_state_t next)
+{
+    portENTER_CRITICAL(&cycle_spinlock);
+    int64_t at = requested_at[request];
+    requested_at[request] = 0;
+    portEXIT_CRITICAL(&cycle_spinlock);
+    if (at == 0 || state < from || state > to) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "%s -> %s", state_names[state], state_names[next]);
+    if (request == CYCLE_REQUEST_START) {
+        cycle_on_start();
+    } else if (request == CYCLE_REQUEST_END) {
+        cycle_on_end();
+    } else if (request == CYCLE_REQUEST_DRAIN_FAILED) {
+        ESP_LOGE(TAG, "Tanks not drained in time, giving up");
+        char msg[64];
+        snprintf(msg, sizeof(msg), CYCLE_ERROR_MSG, state_names[state], "drain timeout");
+        if (mqtt_publish_state(msg) != ESP_OK) {
+            ESP_LOGD(TAG, "Unable to publish the cycle error, not connected");
         }
-        vTaskDelay(pdMS_TO_TICKS(10 * 60 * 1000));
+    }
+    portENTER_CRITICAL(&cycle_spinlock);
+    state = next;
+    pending_since = at;
+    portEXIT_CRITICAL(&cycle_spinlock);
+    if (context->sensors.tank.task_handle != NULL) {
+        xTaskNotifyGive(context->sensors.tank.task_handle);
     }
 }
 
-esp_err_t cycle_init(context_t *context)
+static void cycle_task(void *arg)
 {
-    ARG_CHECK(context != NULL, ERR_PARAM_NULL);
+    ARG_UNUSED(arg);
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        cycle_transition(CYCLE_REQUEST_START, CYCLE_STATE_IDLE, CYCLE_STATE_IDLE, CYCLE_STATE_FILLING);
+        cycle_transition(CYCLE_REQUEST_FILLED, CYCLE_STATE_FILLING, CYCLE_STATE_FILLING, CYCLE_STATE_RUNNING);
+        cycle_transition(CYCLE_REQUEST_END, CYCLE_STATE_FILLING, CYCLE_STATE_RUNNING, CYCLE_STATE_DRAINING);
+        cycle_transition(CYCLE_REQUEST_DRAINED, CYCLE_STATE_DRAINING, CYCLE_STATE_DRAINING, CYCLE_STATE_IDLE);
+        cycle_transition(CYCLE_REQUEST_DRAIN_FAILED, CYCLE_STATE_DRAINING, CYCLE_STATE_DRAINING, CYCLE_STATE_IDLE);
+    }
+}
+
+esp_err_t cycle_init(context_t *ctx)
+{
+    ARG_CHECK(ctx != NULL, ERR_PARAM_NULL);
 
+    context = ctx;
     int64_t start_time = 0;
     ESP_ERROR_CHECK(storage_get_i64("cycle_start_tm", &start_time));
     if (start_time > 0) {
         ESP_ERROR_CHECK(context_set_cycle(context, start_time));
     }
+    /* A cycle restored from storage or the checkpoint checks the tank levels again before dosing. */
+    if (context->cycle.initialized) {
+        state = CYCLE_STATE_FILLING;
+        pending_since = esp_timer_get_time();
+        ESP_ERROR_CHECK_WITHOUT_ABORT(recipe_update());
+    }
+    ESP_LOGI(TAG, "Starting %s", state_names[state]);
 
-    xTaskCreatePinnedToCore(cycle_task, "cycle", 2048, context, 3, &context->cycle.task_handle, tskNO_AFFINITY);
+    xTaskCreatePinnedToCore(cycle_task, "cycle", 3072, NULL, placement_priority(PLACEMENT_TASK_CYCLE),
+                            &context->cycle.task_handle, placement_core(PLACEMENT_TASK_CYCLE));
     if (context->cycle.task_handle == NULL) {
         return ESP_FAIL;
     }
     return ESP_OK;
-}
\ No newline at end of file
+}
@@ -5,6 +5,30 @@
 
 #include "context.h"
 
+/* Lifecycle of a grow cycle. Filling waits for the tanks to reach their level, dosing only runs while running, and
+ * draining empties the tanks before going back to idle. */
+typedef enum {
+    CYCLE_STATE_IDLE,
+    CYCLE_STATE_FILLING,
+    CYCLE_STATE_RUNNING,
+    CYCLE_STATE_DRAINING,
+    CYCLE_STATE_MAX,
+} cycle_state_t;
+
+cycle_state_t cycle_get_state(void);
+
+esp_err_t cycle_start(void);
+
+esp_err_t cycle_end(void);
+
+void cycle_filled(void);
+
+void cycle_drained(void);
+
+void cycle_drain_failed(void);
+
+void cycle_acknowledge(cycle_state_t state);
+
 esp_err_t cycle_init(context_t *context);
 
 #endif // HYDROPONICS_CYCLE_H
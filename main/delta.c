@@ -0,0 +1,307 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "esp32/rom/miniz.h"
+#include "mbedtls/sha256.h"
+
+#include "delta.h"
+#include "error.h"
+
+#define DELTA_WINDOW_SIZE (1 << DELTA_WINDOW_BITS)
+#define DELTA_OUT_SIZE 4096    // (int) Patched bytes buffered per write, one flash sector
+#define DELTA_CONTROL_SIZE 12  // (int) diff_len, extra_len and seek of a record
+
+/* Header offsets, every integer is little endian. */
+#define DELTA_HEADER_SOURCE_SIZE 4
+#define DELTA_HEADER_TARGET_SIZE 8
+#define DELTA_HEADER_SOURCE_SHA256 12
+#define DELTA_HEADER_TARGET_SHA256 44
+#define DELTA_HEADER_FLAGS 76
+
+typedef enum {
+    DELTA_STAGE_HEADER,
+    DELTA_STAGE_BODY,
+    DELTA_STAGE_DONE,
+} delta_stage_t;
+
+/* The whole patcher is one allocation, sized by the inflater and the two buffers and not by the images. */
+typedef struct {
+    delta_io_t io;
+    delta_stage_t stage;
+    delta_stats_t stats;
+    bool has_expected;
+    uint8_t expected_sha256[DELTA_SHA256_SIZE];
+    uint8_t header[DELTA_HEADER_SIZE];
+    uint32_t header_length;
+    uint8_t control[DELTA_CONTROL_SIZE];
+    uint32_t control_length;
+    bool in_record;
+    uint32_t diff_left;
+    uint32_t extra_left;
+    int32_t seek;
+    uint32_t source_pos;
+    mbedtls_sha256_context sha;
+    tinfl_decompressor inflator;
+    uint32_t window_pos;
+    uint8_t window[DELTA_WINDOW_SIZE]; // Circular output of the inflater, also its back reference window
+    uint32_t out_length;
+    uint8_t out[DELTA_OUT_SIZE];
+} delta_state_t;
+
+static const char *TAG = "delta";
+
+static delta_state_t *state;
+
+static uint32_t delta_get_u32(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static esp_err_t delta_flush(void)
+{
+    if (state->out_length == 0) {
+        return ESP_OK;
+    }
+    mbedtls_sha256_update(&state->sha, state->out, state->out_length);
+    esp_err_t err = state->io.write(state->io.arg, state->out, state->out_length);
+    state->stats.written += state->out_length;
+    state->out_length = 0;
+    return err;
+}
+
+/* Hashes the source before anything is written, a patch made against another image would only show up in the final
+ * hash, after the inactive slot was overwritten. The output buffer is still free at this point. */
+static esp_err_t delta_check_source(const uint8_t *sha256)
+{
+    uint8_t digest[DELTA_SHA256_SIZE];
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+
+    esp_err_t err = ESP_OK;
+    for (uint32_t offset = 0; offset < state->stats.source_size && err == ESP_OK; offset += DELTA_OUT_SIZE) {
+        size_t length = MIN(DELTA_OUT_SIZE, state->stats.source_size - offset);
+        err = state->io.read(state->io.arg, offset, state->out, length);
+        if (err == ESP_OK) {
+            mbedtls_sha256_update(&sha, state->out, length);
+        }
+    }
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+
+    if (err == ESP_OK && memcmp(digest, sha256, DELTA_SHA256_SIZE) != 0) {
+        ESP_LOGE(TAG, "Patch was made against another image than the running one");
+        return ESP_ERR_INVALID_VERSION;
+    }
+    return err;
+}
+
+static esp_err_t delta_parse_header(void)
+{
+    const uint8_t *header = state->header;
+    ARG_CHECK(memcmp(header, DELTA_MAGIC, strlen(DELTA_MAGIC)) == 0, "not a delta patch");
+    ARG_CHECK(delta_get_u32(header + DELTA_HEADER_FLAGS) == 0, "unsupported patch flags");
+
+    state->stats.source_size = delta_get_u32(header + DELTA_HEADER_SOURCE_SIZE);
+    state->stats.target_size = delta_get_u32(header + DELTA_HEADER_TARGET_SIZE);
+    if (state->has_expected &&
+        memcmp(state->expected_sha256, header + DELTA_HEADER_TARGET_SHA256, DELTA_SHA256_SIZE) != 0) {
+        ESP_LOGE(TAG, "Patch builds another image than the requested one");
+        return ESP_ERR_INVALID_VERSION;
+    }
+    memcpy(state->expected_sha256, header + DELTA_HEADER_TARGET_SHA256, DELTA_SHA256_SIZE);
+    ESP_LOGI(TAG, "Patching %u bytes into %u bytes", state->stats.source_size, state->stats.target_size);
+    return delta_check_source(header + DELTA_HEADER_SOURCE_SHA256);
+}
+
+/* A record copies diff_len source bytes with the diff bytes added, appends extra_len literal bytes, then moves the
+ * source position by seek. */
+static esp_err_t delta_parse_control(void)
+{
+    uint32_t produced = state->stats.written + state->out_length;
+    state->diff_left = delta_get_u32(state->control);
+    state->extra_left = delta_get_u32(state->control + 4);
+    state->seek = (int32_t)delta_get_u32(state->control + 8);
+    state->in_record = true;
+    ARG_CHECK(state->diff_left <= state->stats.target_size - produced &&
+              state->extra_left <= state->stats.target_size - produced - state->diff_left, "record overruns the image");
+    ARG_CHECK(state->diff_left <= state->stats.source_size - state->source_pos, "record overruns the source");
+    return ESP_OK;
+}
+
+static esp_err_t delta_end_record(void)
+{
+    int64_t source_pos = (int64_t)state->source_pos + state->seek;
+    ARG_CHECK(source_pos >= 0 && source_pos <= state->stats.source_size, "seek out of the source");
+    state->source_pos = source_pos;
+    state->in_record = false;
+    return ESP_OK;
+}
+
+/* Runs the inflated body through the records. Source bytes are read straight into the output buffer and the diff is
+ * added in place, so a record costs no memory beyond the buffer whatever its length. */
+static esp_err_t delta_consume(const uint8_t *data, size_t length)
+{
+    esp_err_t err = ESP_OK;
+    while (length > 0 && err == ESP_OK) {
+        size_t n;
+        uint8_t *out = state->out + state->out_length;
+        if (!state->in_record) {
+            n = MIN(length, DELTA_CONTROL_SIZE - state->control_length);
+            memcpy(state->control + state->control_length, data, n);
+            state->control_length += n;
+            if (state->control_length == DELTA_CONTROL_SIZE) {
+                state->control_length = 0;
+                err = delta_parse_control();
+            }
+        } else if (state->diff_left > 0) {
+            n = MIN(MIN(length, state->diff_left), DELTA_OUT_SIZE - state->out_length);
+            err = state->io.read(state->io.arg, state->source_pos, out, n);
+            for (size_t i = 0; i < n; i++) {
+                out[i] += data[i];
+            }
+            state->out_length += n;
+            state->source_pos += n;
+            state->diff_left -= n;
+        } else {
+            n = MIN(MIN(length, state->extra_left), DELTA_OUT_SIZE - state->out_length);
+            memcpy(out, data, n);
+            state->out_length += n;
+            state->extra_left -= n;
+        }
+        data += n;
+        length -= n;
+
+        if (err == ESP_OK && state->out_length == DELTA_OUT_SIZE) {
+            err = delta_flush();
+        }
+        if (err == ESP_OK && state->in_record && state->diff_left == 0 && state->extra_left == 0) {
+            err = delta_end_record();
+        }
+    }
+    return err;
+}
+
+esp_err_t delta_write(const uint8_t *data, size_t length)
+{
+    ARG_CHECK(state != NULL, "no patch in progress");
+    ARG_CHECK(data != NULL || length == 0, ERR_PARAM_NULL);
+
+    state->stats.patch_size += length;
+    if (state->stage == DELTA_STAGE_HEADER) {
+        size_t n = MIN(length, DELTA_HEADER_SIZE - state->header_length);
+        memcpy(state->header + state->header_length, data, n);
+        state->header_length += n;
+        data += n;
+        length -= n;
+        if (state->header_length < DELTA_HEADER_SIZE) {
+            return ESP_OK;
+        }
+        esp_err_t err = delta_parse_header();
+        if (err != ESP_OK) {
+            return err;
+        }
+        state->stage = DELTA_STAGE_BODY;
+    }
+
+    /* The window wraps, tinfl_decompress fills it up to its end and starts over at the beginning. */
+    while (state->stage == DELTA_STAGE_BODY) {
+        size_t in_bytes = length;
+        size_t out_bytes = DELTA_WINDOW_SIZE - state->window_pos;
+        tinfl_status status = tinfl_decompress(&state->inflator, data, &in_bytes, state->window,
+                                               state->window + state->window_pos, &out_bytes,
+                                               TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+        data += in_bytes;
+        length -= in_bytes;
+
+        esp_err_t err = delta_consume(state->window + state->window_pos, out_bytes);
+        state->window_pos = (state->window_pos + out_bytes) & (DELTA_WINDOW_SIZE - 1);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (status < TINFL_STATUS_DONE) {
+            ESP_LOGE(TAG, "Corrupt patch body: %d", status);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        if (status == TINFL_STATUS_DONE) {
+            state->stage = DELTA_STAGE_DONE;
+            err = delta_flush();
+            if (err != ESP_OK) {
+                return err;
+            }
+        } else if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+            return ESP_OK;
+        }
+    }
+    ARG_CHECK(length == 0, "data after the end of the patch");
+    return ESP_OK;
+}
+
+esp_err_t delta_end(void)
+{
+    ARG_CHECK(state != NULL, "no patch in progress");
+
+    esp_err_t err = ESP_OK;
+    if (state->stage != DELTA_STAGE_DONE || state->stats.written != state->stats.target_size ||
+        state->control_length != 0) {
+        err = ESP_ERR_INVALID_SIZE;
+        ESP_LOGE(TAG, "Truncated patch, %u of %u bytes written", state->stats.written, state->stats.target_size);
+    }
+
+    if (err == ESP_OK) {
+        uint8_t digest[DELTA_SHA256_SIZE];
+        mbedtls_sha256_finish(&state->sha, digest);
+        if (memcmp(digest, state->expected_sha256, DELTA_SHA256_SIZE) != 0) {
+            ESP_LOGE(TAG, "Patched image hash mismatch");
+            err = ESP_ERR_INVALID_CRC;
+        }
+    }
+    delta_abort();
+    return err;
+}
+
+void delta_abort(void)
+{
+    if (state == NULL) {
+        return;
+    }
+    mbedtls_sha256_free(&state->sha);
+    free(state);
+    state = NULL;
+}
+
+void delta_get_stats(delta_stats_t *out)
+{
+    if (state != NULL) {
+        *out = state->stats;
+    } else {
+        memset(out, 0, sizeof(*out));
+    }
+}
+
+esp_err_t delta_begin(const delta_io_t *io, const uint8_t *expected_sha256)
+{
+    ARG_CHECK(io != NULL && io->read != NULL && io->write != NULL, ERR_PARAM_NULL);
+    if (state != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    state = calloc(1, sizeof(delta_state_t));
+    if (state == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    state->io = *io;
+    if (expected_sha256 != NULL) {
+        state->has_expected = true;
+        memcpy(state->expected_sha256, expected_sha256, DELTA_SHA256_SIZE);
+    }
+    tinfl_init(&state->inflator);
+    mbedtls_sha256_init(&state->sha);
+    mbedtls_sha256_starts(&state->sha, 0);
+    return ESP_OK;
+}
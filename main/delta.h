@@ -0,0 +1,46 @@
+#ifndef HYDROPONICS_DELTA_H
+#define HYDROPONICS_DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define DELTA_MAGIC "HDP1"
+#define DELTA_HEADER_SIZE 80   // (int) Magic, source size, target size, source and target SHA-256, flags
+#define DELTA_WINDOW_BITS 12   // (int) Deflate window of the patch body, tools/delta_ota.py compresses with the same
+#define DELTA_SHA256_SIZE 32
+
+/* Reads "length" bytes of the image the patch applies to, starting at "offset". */
+typedef esp_err_t (*delta_read_t)(void *arg, size_t offset, void *out, size_t length);
+
+/* Appends the next "length" bytes of the patched image. */
+typedef esp_err_t (*delta_write_t)(void *arg, const void *data, size_t length);
+
+typedef struct {
+    delta_read_t read;
+    delta_write_t write;
+    void *arg;
+} delta_io_t;
+
+typedef struct {
+    uint32_t patch_size;  // Patch bytes consumed so far
+    uint32_t source_size;
+    uint32_t target_size;
+    uint32_t written;     // Patched image bytes written so far
+} delta_stats_t;
+
+/* Allocates the patcher, expected_sha256 is the SHA-256 the patched image must have, NULL takes the patch header's. */
+esp_err_t delta_begin(const delta_io_t *io, const uint8_t *expected_sha256);
+
+/* Applies the next chunk of the patch as it arrives, any split of the patch into chunks gives the same image. */
+esp_err_t delta_write(const uint8_t *data, size_t length);
+
+/* Checks that the whole image was produced with the expected hash and frees the patcher, even on error. */
+esp_err_t delta_end(void);
+
+void delta_abort(void);
+
+void delta_get_stats(delta_stats_t *out);
+
+#endif // HYDROPONICS_DELTA_H
@@ -1,18 +1,19 @@
+#include <stdarg.h>
 #include <stdio.h>
 
 #include "esp_log.h"
 
 #include "error.h"
 
+#define ARG_LOG_BUFFER_SIZE 160 // (int) Longest argument error message, longer ones are truncated
+
+/* Formats into a stack buffer, so reporting an error never allocates. */
 void arg_loge(const char *tag, const char *fmt, ...)
 {
+    char buf[ARG_LOG_BUFFER_SIZE];
     va_list va;
     va_start(va, fmt);
-    char *buf = NULL;
-    int len = vasprintf(&buf, fmt, va);
-    if (buf != NULL) {
-        ESP_LOGE(tag, "%.*s", len, buf);
-        free(buf);
-    }
+    vsnprintf(buf, sizeof(buf), fmt, va);
     va_end(va);
+    ESP_LOGE(tag, "%s", buf);
 }
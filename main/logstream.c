@@ -0,0 +1,224 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "cJSON.h"
+
+#include "context.h"
+#include "error.h"
+#include "logstream.h"
+#include "mqtt.h"
+#include "placement.h"
+#include "tlog.h"
+
+#define LOGSTREAM_BUFFER_SIZE 2048  // (int) Bytes of log lines batched between two publishes
+#define LOGSTREAM_LINE_SIZE 192     // (int) Longest streamed line, longer ones are truncated
+#define LOGSTREAM_HEADER_SIZE 64    // (int) Room for the counters line in front of a batch
+#define LOGSTREAM_FLUSH_PERIOD 10   // (int) Publish period in seconds
+#define LOGSTREAM_RATE 256          // (int) Sustained streaming rate in bytes per second
+#define LOGSTREAM_BURST 2048        // (int) Token bucket depth in bytes
+
+static const char *TAG = "logstream";
+
+static const char *level_names[] = {
+    [ESP_LOG_NONE] = "off",
+    [ESP_LOG_ERROR] = "error",
+    [ESP_LOG_WARN] = "warn",
+    [ESP_LOG_INFO] = "info",
+    [ESP_LOG_DEBUG] = "debug",
+    [ESP_LOG_VERBOSE] = "verbose",
+};
+
+static vprintf_like_t uart_vprintf;
+static TaskHandle_t logstream_task_handle;
+
+static portMUX_TYPE logstream_spinlock = portMUX_INITIALIZER_UNLOCKED;
+static volatile esp_log_level_t stream_level = ESP_LOG_WARN;
+static char buffer[LOGSTREAM_BUFFER_SIZE];
+static size_t buffer_length = 0;
+static char outgoing[LOGSTREAM_HEADER_SIZE + LOGSTREAM_BUFFER_SIZE];
+
+/* Token bucket in bytes, refilled from the elapsed time whenever a line is offered. */
+static int32_t tokens = LOGSTREAM_BURST;
+static int64_t refilled_at = 0;
+
+static struct {
+    uint32_t rate_limited; // Lines over the token bucket
+    uint32_t overflowed;   // Lines which did not fit the batch buffer
+} drops;
+
+/* ESP_LOG format strings start with the level letter, possibly behind a color sequence. */
+static esp_log_level_t logstream_level_of(const char *fmt)
+{
+    if (fmt[0] == '\033') {
+        const char *end = strchr(fmt, 'm');
+        fmt = end != NULL ? end + 1 : fmt;
+    }
+    switch (fmt[0]) {
+    case 'E':
+        return ESP_LOG_ERROR;
+    case 'W':
+        return ESP_LOG_WARN;
+    case 'D':
+        return ESP_LOG_DEBUG;
+    case 'V':
+        return ESP_LOG_VERBOSE;
+    default:
+        return ESP_LOG_INFO;
+    }
+}
+
+/* Copies 'src' without the color sequences, returns the new length. */
+static size_t logstream_strip_colors(char *dst, const char *src, size_t length)
+{
+    size_t out = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (src[i] == '\033') {
+            while (i < length && src[i] != 'm') {
+                i++;
+            }
+            continue;
+        }
+        dst[out++] = src[i];
+    }
+    return out;
+}
+
+static int logstream_vprintf(const char *fmt, va_list va)
+{
+    /* Only lines at or above the streaming level are formatted a second time, on the caller's stack. */
+    if (stream_level != ESP_LOG_NONE && logstream_level_of(fmt) <= stream_level) {
+        char line[LOGSTREAM_LINE_SIZE];
+        va_list copy;
+        va_copy(copy, va);
+        int formatted = vsnprintf(line, sizeof(line), fmt, copy);
+        va_end(copy);
+        size_t length = formatted < 0 ? 0 : MIN((size_t)formatted, sizeof(line) - 1);
+        length = logstream_strip_colors(line, line, length);
+
+        bool flush = false;
+        int64_t now = esp_timer_get_time();
+        portENTER_CRITICAL(&logstream_spinlock);
+        /* Only the time turned into whole tokens is consumed, lines closer together than a token still add up. */
+        int64_t credit = (now - refilled_at) * LOGSTREAM_RATE / 1000000;
+        if (tokens + credit >= LOGSTREAM_BURST) {
+            tokens = LOGSTREAM_BURST;
+            refilled_at = now;
+        } else {
+            tokens += credit;
+            refilled_at += credit * 1000000 / LOGSTREAM_RATE;
+        }
+        if (tokens < (int32_t)length) {
+            drops.rate_limited++;
+        } else if (buffer_length + length > sizeof(buffer)) {
+            drops.overflowed++;
+        } else {
+            tokens -= length;
+            memcpy(&buffer[buffer_length], line, length);
+            buffer_length += length;
+            flush = buffer_length > sizeof(buffer) / 2;
+        }
+        portEXIT_CRITICAL(&logstream_spinlock);
+
+        if (flush && logstream_task_handle != NULL) {
+            xTaskNotifyGive(logstream_task_handle);
+        }
+    }
+    return uart_vprintf(fmt, va);
+}
+
+/* Ships the batch on the logs topic. While disconnected the batch stays, new lines are counted as overflowed once it is
+ * full. At most one batch goes out per period, so a burst of diagnostics cannot crowd out the telemetry. */
+static void logstream_task(void *arg)
+{
+    context_t *context = (context_t *)arg;
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOGSTREAM_FLUSH_PERIOD * 1000));
+
+        portENTER_CRITICAL(&logstream_spinlock);
+        bool pending = buffer_length > 0 || drops.rate_limited > 0 || drops.overflowed > 0;
+        portEXIT_CRITICAL(&logstream_spinlock);
+        if (!pending || (xEventGroupGetBits(context->event_group) & CONTEXT_EVENT_IOT) == 0) {
+            continue;
+        }
+
+        portENTER_CRITICAL(&logstream_spinlock);
+        uint32_t rate_limited = drops.rate_limited;
+        uint32_t overflowed = drops.overflowed;
+        size_t length = buffer_length;
+        memcpy(&outgoing[LOGSTREAM_HEADER_SIZE], buffer, length);
+        buffer_length = 0;
+        drops.rate_limited = 0;
+        drops.overflowed = 0;
+        portEXIT_CRITICAL(&logstream_spinlock);
+
+        /* The counters line is placed right in front of the batch, so the batch is not copied twice. */
+        char header[LOGSTREAM_HEADER_SIZE];
+        int header_length = snprintf(header, sizeof(header), "-- dropped: rate %u, overflow %u --\n", rate_limited,
+                                     overflowed);
+        char *start = &outgoing[LOGSTREAM_HEADER_SIZE - header_length];
+        memcpy(start, header, header_length);
+        length += header_length;
+
+        if (mqtt_publish_logs(start, length) != ESP_OK) {
+            TLOGW(TAG, "Dropped a batch of %d bytes", length);
+        }
+        vTaskDelay(pdMS_TO_TICKS(LOGSTREAM_FLUSH_PERIOD * 1000));
+    }
+}
+
+static int logstream_parse_level(const char *name)
+{
+    for (int i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Handles {"stream":"info","levels":{"wifi":"debug","*":"warn"}}. "stream" is the lowest level shipped over MQTT,
+ * "levels" sets the per tag log levels. */
+esp_err_t logstream_configure(const cJSON *json)
+{
+    const cJSON *stream = cJSON_GetObjectItem(json, "stream");
+    const cJSON *levels = cJSON_GetObjectItem(json, "levels");
+    ARG_CHECK(stream == NULL || cJSON_IsString(stream), "stream must be a level name");
+    ARG_CHECK(levels == NULL || cJSON_IsObject(levels), "levels must map tags to level names");
+
+    /* Validate everything first, so the update applies completely or not at all. */
+    int level = stream != NULL ? logstream_parse_level(stream->valuestring) : stream_level;
+    ARG_CHECK(level >= 0, "unknown level %s", stream->valuestring);
+    const cJSON *item;
+    cJSON_ArrayForEach(item, levels) {
+        ARG_CHECK(cJSON_IsString(item) && logstream_parse_level(item->valuestring) >= 0, "invalid level for %s",
+                  item->string);
+    }
+
+    stream_level = level;
+    cJSON_ArrayForEach(item, levels) {
+        esp_log_level_set(item->string, logstream_parse_level(item->valuestring));
+    }
+    ESP_LOGI(TAG, "Streaming %s and above", level_names[stream_level]);
+    return ESP_OK;
+}
+
+esp_err_t logstream_init(context_t *context)
+{
+    ARG_CHECK(context != NULL, ERR_PARAM_NULL);
+
+    refilled_at = esp_timer_get_time();
+    xTaskCreatePinnedToCore(logstream_task, "logstream", 2560, context, placement_priority(PLACEMENT_TASK_LOGSTREAM),
+                            &logstream_task_handle, placement_core(PLACEMENT_TASK_LOGSTREAM));
+    uart_vprintf = esp_log_set_vprintf(logstream_vprintf);
+    return ESP_OK;
+}
@@ -0,0 +1,14 @@
+#ifndef HYDROPONICS_LOGSTREAM_H
+#define HYDROPONICS_LOGSTREAM_H
+
+#include "esp_err.h"
+
+#include "cJSON.h"
+
+#include "context.h"
+
+esp_err_t logstream_configure(const cJSON *json);
+
+esp_err_t logstream_init(context_t *context);
+
+#endif // HYDROPONICS_LOGSTREAM_H
@@ -1,13 +1,25 @@
 #include "esp_event.h"
 
+#include "actuator.h"
+#include "boot.h"
+#include "calibration.h"
+#include "checkpoint.h"
+#include "command.h"
 #include "context.h"
 #include "cycle.h"
+#include "logstream.h"
 #include "mqtt.h"
 #include "ntp.h"
 #include "ph.h"
+#include "power.h"
+#include "recipe.h"
+#include "roam.h"
+#include "schedule.h"
+#include "settings.h"
 #include "storage.h"
 #include "tank.h"
 #include "tds.h"
+#include "tlog.h"
 #include "temperature.h"
 #include "wifi.h"
 
@@ -16,14 +28,49 @@ static context_t *context;
 void app_main(void)
 {
     context = context_create();
+    ESP_ERROR_CHECK(tlog_init(context));
+    ESP_ERROR_CHECK(logstream_init(context));
     ESP_ERROR_CHECK(storage_init(context));
+    boot_mark_stage("storage");
+    ESP_ERROR_CHECK(settings_init(context));
+    boot_mark_stage("settings");
+    ntp_load_timezone();
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    ESP_ERROR_CHECK(wifi_init(context));
-    ESP_ERROR_CHECK(ntp_init(context));
-    ESP_ERROR_CHECK(mqtt_init(context));
+    boot_mark_stage("event loop");
+    ESP_ERROR_CHECK(checkpoint_init(context));
+    boot_mark_stage("checkpoint");
+    ESP_ERROR_CHECK(power_init(context));
+    boot_mark_stage("power");
+    ESP_ERROR_CHECK(actuator_init(context));
+    boot_mark_stage("actuator");
+
+    /* Start acquisition and local control first, they do not depend on the network. */
+    ESP_ERROR_CHECK(tank_init(context));
+    boot_mark_stage("tank");
     ESP_ERROR_CHECK(temperature_init(context));
+    boot_mark_stage("temperature");
+    ESP_ERROR_CHECK(calibration_init(context));
+    boot_mark_stage("calibration");
     ESP_ERROR_CHECK(tds_init(context));
+    boot_mark_stage("tds");
     ESP_ERROR_CHECK(ph_init(context));
-    ESP_ERROR_CHECK(tank_init(context));
+    boot_mark_stage("ph");
+    ESP_ERROR_CHECK(schedule_init(context));
+    boot_mark_stage("schedule");
+    ESP_ERROR_CHECK(recipe_init(context));
+    boot_mark_stage("recipe");
     ESP_ERROR_CHECK(cycle_init(context));
-}
\ No newline at end of file
+    boot_mark_stage("cycle");
+
+    /* Network bring-up continues in the background. */
+    ESP_ERROR_CHECK(wifi_init(context));
+    boot_mark_stage("wifi");
+    ESP_ERROR_CHECK(roam_init(context));
+    boot_mark_stage("roam");
+    ESP_ERROR_CHECK(ntp_init(context));
+    boot_mark_stage("ntp");
+    ESP_ERROR_CHECK(command_init(context));
+    boot_mark_stage("command");
+    ESP_ERROR_CHECK(mqtt_init(context));
+    boot_mark_stage("mqtt");
+}
@@ -1,24 +1,29 @@
 #include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
 #include <time.h>
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 
 #include "esp_err.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
-
-#include "cJSON.h"
+#include "esp_timer.h"
 
 #include <iotc.h>
 #include <iotc_jwt.h>
 #include <iotc_types.h>
 
+#include "boot.h"
+#include "command.h"
 #include "context.h"
 #include "error.h"
 #include "mqtt.h"
-#include "storage.h"
-#include "tank.h"
+#include "ota.h"
+#include "placement.h"
+#include "power.h"
 
 #define DEVICE_PATH "projects/%s/locations/%s/registries/%s/devices/%s"
 #define SUBSCRIBE_TOPIC_WILDCARD_COMMAND "/devices/%s/commands/#"
@@ -26,8 +31,13 @@
 #define SUBSCRIBE_TOPIC_CONFIG "/devices/%s/config"
 #define PUBLISH_TOPIC_EVENT "/devices/%s/events"
 #define PUBLISH_TOPIC_STATE "/devices/%s/state"
+#define PUBLISH_TOPIC_LOGS "/devices/%s/events/logs"
+#define PUBLISH_TOPIC_BENCH "/devices/%s/events/bench"
 #define TASK_REPEAT_FOREVER 1
 
+#define JWT_REFRESH_MARGIN_SEC (3600 * 2) // (int) Mint the next JWT when the current one expires within this window
+#define JWT_MIN_VALIDITY_SEC 600          // (int) Minimum remaining validity for a pre-minted JWT to be used
+
 #define EVENT_DATA "{"                      \
                    "\"initialized\":%s,"    \
                    "\"elapsedDays\":%d,"    \
@@ -36,11 +46,15 @@
                    "\"temperature\":%.01f," \
                    "\"humidity\":%.01f,"    \
                    "\"tankLevel\":%.02f"    \
+                   "%s"                     \
                    "}"
 
-#define COMMAND_START_CYCLE 0
-#define COMMAND_END_CYCLE 1
-#define COMMAND_SET_CONSTANT 2
+#define EVENT_DATA_RESERVOIR "{"                   \
+                             "\"tdsValue\":%.02f," \
+                             "\"phValue\":%.02f,"  \
+                             "\"tankLevel\":%.02f" \
+                             "}"
+#define EVENT_DATA_RESERVOIR_LENGTH 72 // (int) Room for one formatted EVENT_DATA_RESERVOIR and its separator
 
 static const char *TAG = "mqtt";
 
@@ -54,9 +68,24 @@ static char *subscribe_topic_command;
 static char *subscribe_topic_config;
 static char *publish_topic_event;
 static char *publish_topic_state;
+static char *publish_topic_logs;
+static char *publish_topic_bench;
 
 static char jwt[IOTC_JWT_SIZE] = {0};
+static char jwt_minted[IOTC_JWT_SIZE] = {0};
+static time_t jwt_minted_expires_at = 0;
+static SemaphoreHandle_t jwt_mutex;
+static bool tls_locked = false;
 static const uint32_t jwt_expiration_sec = 3600 * 24; // 24 hours.
+
+/* Time to reconnect, split by whether the JWT was pre-minted (index 1) or signed inline (index 0). */
+static struct {
+    int64_t disconnected_at;
+    bool jwt_cached;
+    int count[2];
+    int64_t total_ms[2];
+} reconnect;
+
 extern const uint8_t EC_PV_KEY_START[] asm("_binary_ec_private_pem_start");
 
 static const iotc_crypto_key_data_t PRIVATE_KEY_DATA = {
@@ -65,22 +94,32 @@ static const iotc_crypto_key_data_t PRIVATE_KEY_DATA = {
     .crypto_key_union.key_pem.key = (char *)EC_PV_KEY_START,
 };
 
+/* Keeps the CPU at full speed from a connect request until the handshake has completed or failed. */
+static void mqtt_tls_lock(bool lock)
+{
+    if (lock != tls_locked) {
+        tls_locked = lock;
+        lock ? power_acquire(POWER_LOCK_TLS) : power_release(POWER_LOCK_TLS);
+    }
+}
+
 static void mqtt_dispatch_connected(bool connected)
 {
     ESP_ERROR_CHECK(context_set_iot_connected(context, connected));
 }
 
 /* Generate the client authentication JWT, which will serve as the MQTT password. */
-static void mqtt_create_jwt_token(void)
+static void mqtt_create_jwt_token(char *token, time_t *expires_at)
 {
     size_t bytes_written = 0;
-    iotc_state_t err = iotc_create_iotcore_jwt(CONFIG_GIOT_PROJECT_ID, jwt_expiration_sec, &PRIVATE_KEY_DATA, jwt,
+    time_t now = time(NULL);
+    iotc_state_t err = iotc_create_iotcore_jwt(CONFIG_GIOT_PROJECT_ID, jwt_expiration_sec, &PRIVATE_KEY_DATA, token,
                                                IOTC_JWT_SIZE, &bytes_written);
     if (err != IOTC_STATE_OK) {
         ESP_LOGE(TAG, "Failed to create a jwt token, error: %d", err);
         ESP_ERROR_CHECK(ESP_ERR_INVALID_STATE);
     }
-    time_t now = time(NULL);
+    *expires_at = now + jwt_expiration_sec;
     struct tm t = {0};
     localtime_r(&now, &t);
     char buf[64] = {0};
@@ -88,37 +127,104 @@ static void mqtt_create_jwt_token(void)
     ESP_LOGI(TAG, "Jwt Token created at %s", buf);
 }
 
-static esp_err_t mqtt_handle_command(const uint8_t *payload)
+/* Copy the pre-minted JWT into 'jwt' for the next connection attempt. Falls back to signing a new token inline when
+ * the background job has not produced a token that is still valid. Returns true when the pre-minted token was used. */
+static bool mqtt_acquire_jwt_token(void)
 {
-    cJSON *cmd = cJSON_Parse((const char *)payload);
-    int type = cJSON_GetObjectItem(cmd, "cmdType")->valueint;
-    int64_t start_time = (int64_t)time(NULL);
-    switch (type) {
-    case COMMAND_START_CYCLE:
-        ESP_ERROR_CHECK(context_set_cycle(context, start_time));
-        ESP_ERROR_CHECK(storage_set_i64("cycle_start_tm", start_time));
-        break;
-    case COMMAND_END_CYCLE:
-        vTaskDelete(context->cycle.task_handle);
-        vTaskDelete(context->sensors.tds.task_handle);
-        vTaskDelete(context->sensors.ph.task_handle);
-        vTaskDelete(context->sensors.tank.task_handle);
-        context->cycle.initialized = false;
-        context->cycle.elapsed_days = 0;
-        ESP_ERROR_CHECK(storage_set_i64("cycle_start_tm", 0));
-        xTaskCreate(tank_drain_task, "tank_drain", 4096, context, 10, NULL);
-        break;
-    case COMMAND_SET_CONSTANT:
-        context->sensors.tds.constant = cJSON_GetObjectItem(cmd, "tds")->valueint;
-        context->sensors.ph.constant = cJSON_GetObjectItem(cmd, "ph")->valueint;
-        break;
-    default:
-        ESP_LOGE(TAG, "Invalid command type: %d", type);
+    bool cached = false;
+    xSemaphoreTake(jwt_mutex, portMAX_DELAY);
+    if (jwt_minted_expires_at - time(NULL) > JWT_MIN_VALIDITY_SEC) {
+        memcpy(jwt, jwt_minted, IOTC_JWT_SIZE);
+        cached = true;
+    } else {
+        mqtt_create_jwt_token(jwt_minted, &jwt_minted_expires_at);
+        memcpy(jwt, jwt_minted, IOTC_JWT_SIZE);
     }
+    xSemaphoreGive(jwt_mutex);
+    return cached;
+}
 
-    return ESP_OK;
+/* Keeps a signed JWT ready so that reconnects do not pay for the ES256 signature. */
+static void mqtt_jwt_task(void *arg)
+{
+    ARG_UNUSED(arg);
+
+    xEventGroupWaitBits(context->event_group, CONTEXT_EVENT_TIME, pdFALSE, pdTRUE, portMAX_DELAY);
+
+    char *token = calloc(1, IOTC_JWT_SIZE);
+    ARG_ERROR_CHECK(token != NULL, "out of memory");
+    while (true) {
+        time_t now = time(NULL);
+        if (jwt_minted_expires_at - now <= JWT_REFRESH_MARGIN_SEC) {
+            time_t expires_at = 0;
+            mqtt_create_jwt_token(token, &expires_at);
+            xSemaphoreTake(jwt_mutex, portMAX_DELAY);
+            memcpy(jwt_minted, token, IOTC_JWT_SIZE);
+            jwt_minted_expires_at = expires_at;
+            xSemaphoreGive(jwt_mutex);
+        }
+        time_t next_refresh = jwt_minted_expires_at - JWT_REFRESH_MARGIN_SEC - time(NULL);
+        if (next_refresh < 60) {
+            next_refresh = 60;
+        }
+        vTaskDelay(pdMS_TO_TICKS(next_refresh * 1000));
+    }
 }
 
+static void mqtt_report_reconnect(void)
+{
+    if (reconnect.disconnected_at == 0) {
+        return;
+    }
+    int64_t elapsed_ms = (esp_timer_get_time() - reconnect.disconnected_at) / 1000;
+    int index = reconnect.jwt_cached ? 1 : 0;
+    reconnect.count[index]++;
+    reconnect.total_ms[index] += elapsed_ms;
+    reconnect.disconnected_at = 0;
+    ESP_LOGI(TAG, "Reconnected in %lld ms (jwt %s). Average: pre-minted %lld ms (%d), signed inline %lld ms (%d)",
+             elapsed_ms, reconnect.jwt_cached ? "pre-minted" : "signed inline",
+             reconnect.count[1] ? reconnect.total_ms[1] / reconnect.count[1] : 0, reconnect.count[1],
+             reconnect.count[0] ? reconnect.total_ms[0] / reconnect.count[0] : 0, reconnect.count[0]);
+}
+
+#if CONFIG_HYDROPONICS_MQTT_MEMORY_REPORT
+/* Heap state right before a connection attempt, used to attribute heap usage to the TLS/MQTT connection. */
+static struct {
+    size_t free;
+    size_t minimum_free;
+} heap_before_connect;
+
+static void mqtt_heap_mark(void)
+{
+    heap_before_connect.free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    heap_before_connect.minimum_free = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+}
+
+static void mqtt_heap_report(const char *phase)
+{
+    size_t free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t minimum_free = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    /* The low watermark only moves when the connection goes below the previous one, in which case it is exact. */
+    bool peak_exact = minimum_free < heap_before_connect.minimum_free;
+    ESP_LOGI(TAG, "Heap %s: in use %d bytes, peak %s%d bytes, free %d bytes, largest block %d bytes, stack left %d",
+             phase, heap_before_connect.free - free, peak_exact ? "" : "<= ",
+             heap_before_connect.free - (peak_exact ? minimum_free : heap_before_connect.minimum_free), free,
+             heap_caps_get_largest_free_block(MALLOC_CAP_8BIT), uxTaskGetStackHighWaterMark(NULL));
+}
+
+static void mqtt_heap_report_steady_state(iotc_context_handle_t context_handle, iotc_timed_task_handle_t timed_task,
+                                          void *user_data)
+{
+    ARG_UNUSED(context_handle);
+    ARG_UNUSED(timed_task);
+    ARG_UNUSED(user_data);
+    mqtt_heap_report("steady state");
+}
+#else
+static inline void mqtt_heap_mark(void) {}
+static inline void mqtt_heap_report(const char *phase) {}
+#endif
+
 static void mqtt_subscribe_callback(iotc_context_handle_t in_context_handle, iotc_sub_call_type_t call_type,
                                     const iotc_sub_call_params_t *const params, iotc_state_t state, void *user_data)
 {
@@ -147,8 +253,8 @@ static void mqtt_subscribe_callback(iotc_context_handle_t in_context_handle, iot
         } else if (strcmp(subscribe_topic_config, params->message.topic) == 0) {
             /* Not accepting config for now. */
         } else if (strcmp(subscribe_topic_command, params->message.topic) == 0) {
-            ESP_LOGI(TAG, "Message payload: %s", (char *)payload);
-            ESP_ERROR_CHECK(mqtt_handle_command(payload));
+            ESP_LOGI(TAG, "Message payload: %.*s", (int)payload_size, (const char *)payload);
+            ESP_ERROR_CHECK_WITHOUT_ABORT(command_submit(payload, payload_size));
         } else {
             ESP_LOGW(TAG, "Unknown topic: %s", params->message.topic);
         }
@@ -166,17 +272,34 @@ static void mqtt_publish_telemetry_event(iotc_context_handle_t context_handle, i
     ARG_UNUSED(timed_task);
     ARG_UNUSED(user_data);
 
+    /* With several reservoirs each one reports in "reservoirs", the top level readings stay those of the first. */
+    char reservoirs[CONTEXT_RESERVOIRS * EVENT_DATA_RESERVOIR_LENGTH + 20] = "";
+    if (CONTEXT_RESERVOIRS > 1) {
+        int length = snprintf(reservoirs, sizeof(reservoirs), ",\"reservoirs\":[");
+        for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+            length += snprintf(&reservoirs[length], sizeof(reservoirs) - length, "%s" EVENT_DATA_RESERVOIR,
+                               channel > 0 ? "," : "",
+                               context->sensors.tds.value[channel],
+                               context->sensors.ph.value[channel],
+                               context->sensors.tank.value[channel]);
+            length = MIN(length, sizeof(reservoirs) - 1);
+        }
+        snprintf(&reservoirs[length], sizeof(reservoirs) - length, "]");
+    }
+
     char *msg = NULL;
     asprintf(&msg, EVENT_DATA,
              context->cycle.initialized ? "true" : "false",
              context->cycle.elapsed_days,
-             context->sensors.tds.value,
-             context->sensors.ph.value,
+             context->sensors.tds.value[0],
+             context->sensors.ph.value[0],
              context->sensors.temp,
              context->sensors.humidity,
-             context->sensors.tank.value);
+             context->sensors.tank.value[0],
+             reservoirs);
     // ESP_LOGI(TAG, "Publishing msg \"%s\" to topic \"%s\"", msg, publish_topic_event);
     iotc_publish(context_handle, publish_topic_event, msg, mqtt_qos, NULL, NULL);
+    boot_mark_milestone(BOOT_MILESTONE_PUBLISH);
 
     free(msg);
 }
@@ -191,6 +314,39 @@ esp_err_t mqtt_publish_state(const char *msg)
     return ESP_OK;
 }
 
+/* State of a reservoir's actuator, the first reservoir keeps the plain names, e.g. "PUMP_PH_UP" and "PUMP_PH_UP_1". */
+esp_err_t mqtt_publish_channel_state(const char *state, int channel)
+{
+    if (channel == 0) {
+        return mqtt_publish_state(state);
+    }
+    char msg[32];
+    snprintf(msg, sizeof(msg), "%s_%d", state, channel);
+    return mqtt_publish_state(msg);
+}
+
+/* Best effort publishes, QoS 0 keeps them from holding a retransmission buffer next to the telemetry. */
+static esp_err_t mqtt_publish_data(const char *topic, const char *data, size_t length)
+{
+    if (iotc_is_context_connected(iotc_context) == 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    iotc_state_t err = iotc_publish_data(iotc_context, topic, (const uint8_t *)data, length,
+                                         IOTC_MQTT_QOS_AT_MOST_ONCE, NULL, NULL);
+    return err == IOTC_STATE_OK ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t mqtt_publish_logs(const char *data, size_t length)
+{
+    return mqtt_publish_data(publish_topic_logs, data, length);
+}
+
+/* Benchmark filler load, the cloud functions drop the bench subfolder without storing or logging it. */
+esp_err_t mqtt_publish_bench(const char *data, size_t length)
+{
+    return mqtt_publish_data(publish_topic_bench, data, length);
+}
+
 static void mqtt_connection_state_changed(iotc_context_handle_t in_context_handle, void *data, iotc_state_t state)
 {
     iotc_connection_data_t *conn_data = (iotc_connection_data_t *)data;
@@ -200,6 +356,7 @@ static void mqtt_connection_state_changed(iotc_context_handle_t in_context_handl
      * send/recv messages. */
     case IOTC_CONNECTION_STATE_OPENED:
         ESP_LOGI(TAG, "Connected state: %d", state);
+        mqtt_tls_lock(false);
 
         /* Publish immediately upon connect. 'mqtt_publish_telemetry_event' is defined above and invokes the IoTC
          * API to publish a message. */
@@ -212,19 +369,29 @@ static void mqtt_connection_state_changed(iotc_context_handle_t in_context_handl
         ESP_LOGI(TAG, "Subscribed to topic, error: %d: '%s'", err, subscribe_topic_config);
 
         /* Create a timed task to publish every 'x' seconds. */
-        iotc_time_t refresh_time = 2;
+        iotc_time_t refresh_time = CONFIG_HYDROPONICS_TELEMETRY_INTERVAL;
         delayed_publish_task = iotc_schedule_timed_task(in_context_handle, mqtt_publish_telemetry_event,
                                                         refresh_time, TASK_REPEAT_FOREVER, NULL);
         /* Force publish the first telemetry or else it will only send the telemetry in TASK_REPEAT_SEC. */
         mqtt_publish_telemetry_event(in_context_handle, delayed_publish_task, NULL);
         mqtt_dispatch_connected(true);
+        mqtt_report_reconnect();
+        ota_confirm();
+        mqtt_heap_report("after handshake");
+#if CONFIG_HYDROPONICS_MQTT_MEMORY_REPORT
+        iotc_schedule_timed_task(in_context_handle, mqtt_heap_report_steady_state, 60, /* repeats_forever= */ 0, NULL);
+#endif
         break;
 
     /* IOTC_CONNECTION_STATE_OPEN_FAILED is set when there was a problem when establishing a connection to the
      * server. The reason for the error is contained in the 'state' variable. */
     case IOTC_CONNECTION_STATE_OPEN_FAILED:
         ESP_LOGW(TAG, "Connection error: OPEN_FAILED state: %d", state);
+        mqtt_tls_lock(false);
         mqtt_dispatch_connected(false);
+        if (reconnect.disconnected_at == 0) {
+            reconnect.disconnected_at = esp_timer_get_time();
+        }
         /* Shuts down the event loop and potentially try again. */
         iotc_events_stop();
         break;
@@ -253,8 +420,11 @@ static void mqtt_connection_state_changed(iotc_context_handle_t in_context_handl
             return;
         }
         /* The disconnection was unforeseen. Try to reconnect to the server with previously set configuration and
-         * an updated JWT token. */
-        mqtt_create_jwt_token();
+         * an updated JWT token. The token normally comes pre-minted from 'mqtt_jwt_task'. */
+        reconnect.disconnected_at = esp_timer_get_time();
+        reconnect.jwt_cached = mqtt_acquire_jwt_token();
+        mqtt_heap_mark();
+        mqtt_tls_lock(true);
         iotc_connect(iotc_context, conn_data->username, jwt, conn_data->client_id, conn_data->connection_timeout,
                      conn_data->keepalive_timeout, &mqtt_connection_state_changed);
         break;
@@ -294,7 +464,7 @@ static void mqtt_task(void *arg)
         }
 
         ESP_LOGI(TAG, "Connecting to Google IoT Core");
-        mqtt_create_jwt_token();
+        reconnect.jwt_cached = mqtt_acquire_jwt_token();
 
         char *device_path = NULL;
         asprintf(&device_path, DEVICE_PATH, CONFIG_GIOT_PROJECT_ID, CONFIG_GIOT_LOCATION, CONFIG_GIOT_REGISTRY_ID,
@@ -304,6 +474,8 @@ static void mqtt_task(void *arg)
          * successful connections and unsuccessful connections as well as disconnections. */
         const uint16_t connection_timeout = 0;
         const uint16_t keepalive_timeout = 20;
+        mqtt_heap_mark();
+        mqtt_tls_lock(true);
         err = iotc_connect(iotc_context, NULL, jwt, device_path, connection_timeout, keepalive_timeout,
                            &mqtt_connection_state_changed);
         if (err != IOTC_STATE_OK) {
@@ -321,6 +493,7 @@ static void mqtt_task(void *arg)
          */
         iotc_events_process_blocking();
         ESP_LOGD(TAG, "iotc_events_process_blocking returned. Cleaning up and restarting...");
+        mqtt_tls_lock(false);
         mqtt_dispatch_connected(false);
 
         iotc_delete_context(iotc_context);
@@ -345,7 +518,17 @@ esp_err_t mqtt_init(context_t *ctx)
     asprintf(&subscribe_topic_config, SUBSCRIBE_TOPIC_CONFIG, CONFIG_GIOT_DEVICE_ID);
     asprintf(&publish_topic_event, PUBLISH_TOPIC_EVENT, CONFIG_GIOT_DEVICE_ID);
     asprintf(&publish_topic_state, PUBLISH_TOPIC_STATE, CONFIG_GIOT_DEVICE_ID);
+    asprintf(&publish_topic_logs, PUBLISH_TOPIC_LOGS, CONFIG_GIOT_DEVICE_ID);
+    asprintf(&publish_topic_bench, PUBLISH_TOPIC_BENCH, CONFIG_GIOT_DEVICE_ID);
+
+    jwt_mutex = xSemaphoreCreateMutex();
+    if (jwt_mutex == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
 
-    xTaskCreatePinnedToCore(mqtt_task, "mqtt", 5120, NULL, tskIDLE_PRIORITY + 5, NULL, tskNO_AFFINITY);
+    xTaskCreatePinnedToCore(mqtt_jwt_task, "jwt", 5120, NULL, placement_priority(PLACEMENT_TASK_JWT), NULL,
+                            placement_core(PLACEMENT_TASK_JWT));
+    xTaskCreatePinnedToCore(mqtt_task, "mqtt", CONFIG_HYDROPONICS_MQTT_TASK_STACK_SIZE, NULL,
+                            placement_priority(PLACEMENT_TASK_MQTT), NULL, placement_core(PLACEMENT_TASK_MQTT));
     return ESP_OK;
 }
\ No newline at end of file
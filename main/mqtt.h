@@ -1,12 +1,20 @@
 #ifndef HYDROPONICS_MQTT_H
 #define HYDROPONICS_MQTT_H
 
+#include <stddef.h>
+
 #include "esp_err.h"
 
 #include "context.h"
 
 esp_err_t mqtt_publish_state(const char *msg);
 
+esp_err_t mqtt_publish_channel_state(const char *state, int channel);
+
+esp_err_t mqtt_publish_logs(const char *data, size_t length);
+
+esp_err_t mqtt_publish_bench(const char *data, size_t length);
+
 esp_err_t mqtt_init(context_t *context);
 
 #endif // HYDROPONICS_MQTT_H
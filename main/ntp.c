@@ -1,28 +1,64 @@
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "lwip/apps/sntp.h"
 
 #include "esp_log.h"
+#include "esp_sntp.h"
 
 #include "error.h"
 #include "ntp.h"
+#include "placement.h"
+#include "recipe.h"
+#include "schedule.h"
+#include "storage.h"
+
+#define NTP_TIMEZONE_KEY "timezone"
+#define NTP_TIMEZONE_LENGTH 32
+#define NTP_DEFAULT_TIMEZONE "UCT-7" // Western Indonesia Time
 
 static const char *TAG = "ntp";
 
+static context_t *context;
+
+/* Called on every SNTP sync, a stepped clock moves every wall clock deadline. The time is flagged valid first, the
+ * schedule and the recipe ignore the clock until it is, and the next sync may only come an hour later. */
+static void ntp_time_sync_cb(struct timeval *tv)
+{
+    ARG_UNUSED(tv);
+    ESP_LOGI(TAG, "Time synchronized");
+    context_set_time_updated(context);
+    ESP_ERROR_CHECK_WITHOUT_ABORT(schedule_rearm());
+    ESP_ERROR_CHECK_WITHOUT_ABORT(recipe_update());
+}
+
+/* Applies a POSIX TZ string such as "UCT-7" and keeps it for the next boot. */
+esp_err_t ntp_set_timezone(const char *tz)
+{
+    ARG_CHECK(tz != NULL && strlen(tz) > 0 && strlen(tz) < NTP_TIMEZONE_LENGTH, "invalid timezone");
+
+    char value[NTP_TIMEZONE_LENGTH] = {0};
+    strlcpy(value, tz, sizeof(value));
+    esp_err_t err = storage_set_blob(NTP_TIMEZONE_KEY, value, sizeof(value));
+    if (err != ESP_OK) {
+        return err;
+    }
+    setenv("TZ", value, 1);
+    tzset();
+    ESP_LOGI(TAG, "Set timezone to %s", value);
+    return schedule_rearm();
+}
+
 static void ntp_task(void *arg)
 {
-    context_t *context = (context_t *)arg;
-    ARG_ERROR_CHECK(context != NULL, ERR_PARAM_NULL);
+    ARG_UNUSED(arg);
 
     xEventGroupWaitBits(context->event_group, CONTEXT_EVENT_NETWORK, pdFALSE, pdFALSE, portMAX_DELAY);
 
     ESP_LOGI(TAG, "Initializing SNTP...");
 
-    setenv("TZ", "UCT-7", 1);
-    tzset();
-    ESP_LOGI(TAG, "Set timezone to Western Indonesia Time...");
-
+    sntp_set_time_sync_notification_cb(ntp_time_sync_cb);
     sntp_setoperatingmode(SNTP_OPMODE_POLL);
     sntp_setservername(0, "time.google.com");
     sntp_init();
@@ -43,10 +79,28 @@ static void ntp_task(void *arg)
     vTaskDelete(NULL);
 }
 
-esp_err_t ntp_init(context_t *context)
+/* Applies the stored timezone. Called right after the storage is up, the checkpoint, schedule and cycle restored at
+ * boot all read the local time well before SNTP runs. */
+void ntp_load_timezone(void)
+{
+    char tz[NTP_TIMEZONE_LENGTH] = NTP_DEFAULT_TIMEZONE;
+    size_t length = sizeof(tz);
+    if (storage_get_blob(NTP_TIMEZONE_KEY, tz, &length) != ESP_OK || length != sizeof(tz)) {
+        strlcpy(tz, NTP_DEFAULT_TIMEZONE, sizeof(tz));
+    }
+    tz[sizeof(tz) - 1] = '\0';
+    setenv("TZ", tz, 1);
+    tzset();
+    ESP_LOGI(TAG, "Timezone: %s", tz);
+}
+
+esp_err_t ntp_init(context_t *ctx)
 {
-    ARG_CHECK(context != NULL, ERR_PARAM_NULL);
+    ARG_CHECK(ctx != NULL, ERR_PARAM_NULL);
+
+    context = ctx;
 
-    xTaskCreatePinnedToCore(ntp_task, "ntp", 3072, context, 5, NULL, tskNO_AFFINITY);
+    xTaskCreatePinnedToCore(ntp_task, "ntp", 3072, NULL, placement_priority(PLACEMENT_TASK_NTP), NULL,
+                            placement_core(PLACEMENT_TASK_NTP));
     return ESP_OK;
 }
\ No newline at end of file
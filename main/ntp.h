@@ -5,6 +5,10 @@
 
 #include "context.h"
 
+void ntp_load_timezone(void);
+
+esp_err_t ntp_set_timezone(const char *tz);
+
 esp_err_t ntp_init(context_t *context);
 
 #endif // HYDROPONICS_NTP_H
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_crt_bundle.h"
+#include "esp_err.h"
+#include "esp_http_client.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#include "cJSON.h"
+
+#include "delta.h"
+#include "error.h"
+#include "mqtt.h"
+#include "ota.h"
+#include "placement.h"
+
+#define OTA_URL_LENGTH 256
+#define OTA_READ_SIZE 1024       // (int) Patch bytes read from the connection at a time
+#define OTA_TIMEOUT 30000        // (int) HTTP timeout, in millis
+#define OTA_RESTART_DELAY 3000   // (int) Time left to publish the result before restarting, in millis
+
+#define OTA_RESULT "{\"ota\":{"          \
+                   "\"result\":\"%s\","  \
+                   "\"patchBytes\":%u,"  \
+                   "\"sourceBytes\":%u," \
+                   "\"imageBytes\":%u,"  \
+                   "\"elapsedMs\":%lld"  \
+                   "}}"
+
+typedef struct {
+    char url[OTA_URL_LENGTH];
+    uint8_t sha256[DELTA_SHA256_SIZE];
+} ota_job_t;
+
+/* Passed to the patcher callbacks, the running image is the source and the inactive slot the target. */
+typedef struct {
+    const esp_partition_t *source;
+    esp_ota_handle_t handle;
+} ota_slots_t;
+
+static const char *TAG = "ota";
+
+static ota_job_t job;
+static TaskHandle_t ota_task_handle;
+
+static esp_err_t ota_read_source(void *arg, size_t offset, void *out, size_t length)
+{
+    return esp_partition_read(((ota_slots_t *)arg)->source, offset, out, length);
+}
+
+static esp_err_t ota_write_target(void *arg, const void *data, size_t length)
+{
+    return esp_ota_write(((ota_slots_t *)arg)->handle, data, length);
+}
+
+/* Feeds the patch to the patcher as it is received, nothing beyond one read is buffered. */
+static esp_err_t ota_download(esp_http_client_handle_t client)
+{
+    esp_err_t err = esp_http_client_open(client, 0);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (esp_http_client_fetch_headers(client) < 0 || esp_http_client_get_status_code(client) != 200) {
+        ESP_LOGE(TAG, "Patch download failed, status %d", esp_http_client_get_status_code(client));
+        return ESP_FAIL;
+    }
+
+    char buffer[OTA_READ_SIZE];
+    int length;
+    while ((length = esp_http_client_read(client, buffer, sizeof(buffer))) > 0) {
+        err = delta_write((const uint8_t *)buffer, length);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return length < 0 ? ESP_FAIL : ESP_OK;
+}
+
+static esp_err_t ota_apply(delta_stats_t *stats)
+{
+    ota_slots_t slots = {.source = esp_ota_get_running_partition()};
+    const esp_partition_t *target = esp_ota_get_next_update_partition(NULL);
+    if (target == NULL) {
+        ESP_LOGE(TAG, "No OTA slot to update, is the OTA partition table flashed?");
+        return ESP_ERR_NOT_FOUND;
+    }
+    ESP_LOGI(TAG, "Patching %s into %s from %s", slots.source->label, target->label, job.url);
+
+    /* Sequential writes erase the slot sector by sector as the image grows instead of all of it up front. */
+    esp_err_t err = esp_ota_begin(target, OTA_WITH_SEQUENTIAL_WRITES, &slots.handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    const delta_io_t io = {
+        .read = ota_read_source,
+        .write = ota_write_target,
+        .arg = &slots,
+    };
+    err = delta_begin(&io, job.sha256);
+    if (err != ESP_OK) {
+        esp_ota_abort(slots.handle);
+        return err;
+    }
+
+    const esp_http_client_config_t config = {
+        .url = job.url,
+        .timeout_ms = OTA_TIMEOUT,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    err = client != NULL ? ota_download(client) : ESP_ERR_NO_MEM;
+    if (client != NULL) {
+        esp_http_client_close(client);
+        esp_http_client_cleanup(client);
+    }
+
+    delta_get_stats(stats);
+    if (err == ESP_OK) {
+        err = delta_end();
+    } else {
+        delta_abort();
+    }
+    if (err != ESP_OK) {
+        esp_ota_abort(slots.handle);
+        return err;
+    }
+
+    /* esp_ota_end checks the image header and the hash appended by the build before the slot may boot. */
+    err = esp_ota_end(slots.handle);
+    return err == ESP_OK ? esp_ota_set_boot_partition(target) : err;
+}
+
+/* Runs once per request, the patcher buffers and the HTTP client are freed before the restart. */
+static void ota_task(void *arg)
+{
+    ARG_UNUSED(arg);
+    int64_t started_at = esp_timer_get_time();
+    delta_stats_t stats = {0};
+    esp_err_t err = ota_apply(&stats);
+    int64_t elapsed_ms = (esp_timer_get_time() - started_at) / 1000;
+
+    ESP_LOGI(TAG, "Patch of %u bytes gave %u bytes in %lld ms, err: %s", stats.patch_size, stats.written, elapsed_ms,
+             esp_err_to_name(err));
+    char *msg = NULL;
+    asprintf(&msg, OTA_RESULT, err == ESP_OK ? "ok" : err == ESP_ERR_INVALID_VERSION ? "mismatch" : "error",
+             stats.patch_size, stats.source_size, stats.written, elapsed_ms);
+    if (msg != NULL) {
+        mqtt_publish_state(msg);
+        free(msg);
+    }
+
+    if (err == ESP_OK) {
+        /* The new image boots pending verification, see ota_confirm. */
+        vTaskDelay(pdMS_TO_TICKS(OTA_RESTART_DELAY));
+        esp_restart();
+    }
+    ota_task_handle = NULL;
+    vTaskDelete(NULL);
+}
+
+static bool ota_parse_sha256(const char *hex, uint8_t *out)
+{
+    if (strlen(hex) != 2 * DELTA_SHA256_SIZE || strspn(hex, "0123456789abcdefABCDEF") != 2 * DELTA_SHA256_SIZE) {
+        return false;
+    }
+    for (int i = 0; i < DELTA_SHA256_SIZE; i++) {
+        sscanf(hex + 2 * i, "%2hhx", &out[i]);
+    }
+    return true;
+}
+
+/* An image booted from an update stays pending until it reached the cloud once, the bootloader goes back to the
+ * previous slot if it restarts before. Called on every connection, only the first one after an update matters. */
+void ota_confirm(void)
+{
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+        state == ESP_OTA_IMG_PENDING_VERIFY) {
+        ESP_LOGI(TAG, "Updated image connected, cancelling the rollback");
+        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_ota_mark_app_valid_cancel_rollback());
+    }
+}
+
+/* Handles {"url":"https://...","sha256":"<hex>"}, the url serves a patch made by tools/delta_ota.py against the
+ * running image and sha256 is the hash of the image it builds. The patch is applied in the background into the
+ * inactive slot, the result is reported on the state topic and the device restarts into the new image on success. */
+esp_err_t ota_request(const cJSON *json)
+{
+    const cJSON *url = cJSON_GetObjectItem(json, "url");
+    const cJSON *sha256 = cJSON_GetObjectItem(json, "sha256");
+    ARG_CHECK(cJSON_IsString(url) && strncmp(url->valuestring, "https://", 8) == 0 &&
+              strlen(url->valuestring) < OTA_URL_LENGTH, "an https url is required");
+    ARG_CHECK(cJSON_IsString(sha256), "sha256 of the new image is required");
+    if (ota_task_handle != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    ARG_CHECK(ota_parse_sha256(sha256->valuestring, job.sha256), "invalid sha256");
+    strlcpy(job.url, url->valuestring, sizeof(job.url));
+    /* The TLS handshake of the download runs on this task's stack. */
+    if (xTaskCreatePinnedToCore(ota_task, "ota", 8192, NULL, placement_priority(PLACEMENT_TASK_OTA), &ota_task_handle,
+                                placement_core(PLACEMENT_TASK_OTA)) != pdPASS) {
+        ota_task_handle = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,12 @@
+#ifndef HYDROPONICS_OTA_H
+#define HYDROPONICS_OTA_H
+
+#include "esp_err.h"
+
+#include "cJSON.h"
+
+esp_err_t ota_request(const cJSON *json);
+
+void ota_confirm(void);
+
+#endif // HYDROPONICS_OTA_H
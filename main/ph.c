@@ -1,157 +1,235 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/param.h>
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 
 #include "driver/adc.h"
-#include "driver/gpio.h"
 #include "esp_adc_cal.h"
 #include "esp_log.h"
 #include "esp_timer.h"
 
+#include "actuator.h"
+#include "calibration.h"
+#include "checkpoint.h"
 #include "context.h"
+#include "cycle.h"
 #include "mqtt.h"
 #include "ph.h"
+#include "placement.h"
+#include "power.h"
+#include "settings.h"
+#include "tlog.h"
 
 #define DEFAULT_VREF 1100  // (int) Default reference voltage
 #define PH_NUM_SAMPLES 32  // (int) Number of reading to take for an average
 #define PH_SAMPLE_DELAY 50 // (int) Sample delay in millis
 
-#define PH_NEUTRAL_VOLTAGE 1555
-#define PH_ACID_VOLTAGE 2010
-
-#define PUMP_ON_DURATION 5     // (int) Pump on duration in second
-#define PUMP_DELAY_DURATION 60 // (int) Delay duration between pump dosing in second
-
-#define PH_UP_PUMP_GPIO 18
-#define PH_DOWN_PUMP_GPIO 19
-#define PUMP_GPIO_MASK ((1ULL << PH_UP_PUMP_GPIO) | (1ULL << PH_DOWN_PUMP_GPIO))
-#define PH_ANALOG_GPIO ADC1_CHANNEL_6 // GPIO 34
-
 static const char *TAG = "ph";
 
 static esp_adc_cal_characteristics_t adc1_chars;
 
-static esp_timer_handle_t ph_pump_on_timer;
-static esp_timer_handle_t ph_pump_delay_timer;
+/* Per reservoir tables, a negative ADC channel marks a reservoir without a probe. */
+static int32_t ph_adc_channel[CONTEXT_RESERVOIRS];
+static int64_t pump_off_at[CONTEXT_RESERVOIRS];   // esp_timer time the running dose ends, 0 while no pump runs
+static int64_t pump_ready_at[CONTEXT_RESERVOIRS]; // esp_timer time the next dose is allowed
 
-static bool is_pump_ready = true;
+/* A single timer serves every reservoir, it is armed for the earliest pump which has to stop. */
+static SemaphoreHandle_t ph_pump_mutex;
+static esp_timer_handle_t ph_pump_timer;
 
 static void ph_config_pin(void)
 {
+    settings_t settings;
+    settings_get(&settings);
+
     esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_DEFAULT, DEFAULT_VREF, &adc1_chars);
     ESP_ERROR_CHECK(adc1_config_width(ADC_WIDTH_BIT_DEFAULT));
-    ESP_ERROR_CHECK(adc1_config_channel_atten(PH_ANALOG_GPIO, ADC_ATTEN_DB_11));
 
-    gpio_config_t config = {
-        .intr_type = GPIO_INTR_DISABLE,
-        .mode = GPIO_MODE_OUTPUT,
-        .pin_bit_mask = PUMP_GPIO_MASK,
-        .pull_up_en = 1,
-    };
-    gpio_config(&config);
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        ph_adc_channel[channel] = settings.reservoir.ph_adc[channel];
+        if (ph_adc_channel[channel] >= 0) {
+            ESP_ERROR_CHECK(adc1_config_channel_atten(ph_adc_channel[channel], ADC_ATTEN_DB_11));
+        }
+    }
 }
 
-uint32_t ph_read_voltage(void)
+/* Averages PH_NUM_SAMPLES samples of every connected probe. The probes are sampled in turn within each round, so a
+ * pass takes the same time for any number of reservoirs. */
+void ph_read_voltages(uint32_t *out_voltages)
 {
-    uint32_t running_sample = 0;
+    uint32_t running_sample[CONTEXT_RESERVOIRS] = {0};
     for (int i = 0; i < PH_NUM_SAMPLES; i++) {
-        int adc_sample = adc1_get_raw(PH_ANALOG_GPIO);
-        running_sample = running_sample + adc_sample;
+        power_acquire(POWER_LOCK_ADC);
+        for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+            if (ph_adc_channel[channel] >= 0) {
+                running_sample[channel] += adc1_get_raw(ph_adc_channel[channel]);
+            }
+        }
+        power_release(POWER_LOCK_ADC);
         vTaskDelay(pdMS_TO_TICKS(PH_SAMPLE_DELAY));
     }
-    uint32_t avg_raw = running_sample / PH_NUM_SAMPLES;
-    uint32_t avg_voltage = esp_adc_cal_raw_to_voltage(avg_raw, &adc1_chars);
-    ESP_LOGI(TAG, "raw = %d, voltage = %d", avg_raw, avg_voltage);
-    return avg_voltage;
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        uint32_t avg_raw = running_sample[channel] / PH_NUM_SAMPLES;
+        out_voltages[channel] = esp_adc_cal_raw_to_voltage(avg_raw, &adc1_chars);
+        TLOGI(TAG, "%d: raw = %d, voltage = %d", channel, avg_raw, out_voltages[channel]);
+    }
+}
+
+/* Single calibrated sample, used by the calibration to watch the reading settle. */
+uint32_t ph_sample_voltage(int channel)
+{
+    if (ph_adc_channel[channel] < 0) {
+        return 0;
+    }
+    power_acquire(POWER_LOCK_ADC);
+    int adc_sample = adc1_get_raw(ph_adc_channel[channel]);
+    power_release(POWER_LOCK_ADC);
+    return esp_adc_cal_raw_to_voltage(adc_sample, &adc1_chars);
 }
 
-float ph_get_value(uint32_t voltage)
+float ph_get_value(int channel, uint32_t voltage)
 {
-    float slope = (7 - 4.0) / ((PH_NEUTRAL_VOLTAGE - 1500.0) / 3.0 - (PH_ACID_VOLTAGE - 1500.0) / 3.0);
-    float intercept = 7 - slope * (PH_NEUTRAL_VOLTAGE - 1500.0) / 3.0;
-    float ph = slope * (voltage - 1500.0) / 3.0 + intercept;
+    float ph;
+    if (calibration_apply(CALIBRATION_PROBE_PH, channel, voltage, &ph) == ESP_OK) {
+        return ph;
+    }
+
+    settings_t settings;
+    settings_get(&settings);
+    float neutral = (settings.ph.neutral_voltage - 1500.0) / 3.0;
+    float acid = (settings.ph.acid_voltage - 1500.0) / 3.0;
+    float slope = (7 - 4.0) / (neutral - acid);
+    float intercept = 7 - slope * neutral;
+    ph = slope * (voltage - 1500.0) / 3.0 + intercept;
     return ph;
 }
 
+/* Stops the pumps whose dose is over, then arms the timer for the next one to stop. */
+static void ph_pump_rearm_locked(int64_t now)
+{
+    esp_timer_stop(ph_pump_timer);
+    int64_t next_off = INT64_MAX;
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        if (pump_off_at[channel] == 0) {
+            continue;
+        }
+        if (pump_off_at[channel] <= now) {
+            actuator_set(channel, ACTUATOR_BIT(ACTUATOR_PH_UP_PUMP) | ACTUATOR_BIT(ACTUATOR_PH_DOWN_PUMP), 0);
+            pump_off_at[channel] = 0;
+            ESP_LOGI(TAG, "%d: pump stop", channel);
+        } else {
+            next_off = MIN(next_off, pump_off_at[channel]);
+        }
+    }
+    if (next_off != INT64_MAX) {
+        ESP_ERROR_CHECK(esp_timer_start_once(ph_pump_timer, next_off - now));
+    }
+}
+
+static void ph_dose(int channel, actuator_t pump, const char *state, int64_t pump_on, int64_t pump_delay)
+{
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(ph_pump_mutex, portMAX_DELAY);
+    if (actuator_set(channel, ACTUATOR_BIT(pump), ACTUATOR_BIT(pump)) != ESP_OK) {
+        xSemaphoreGive(ph_pump_mutex);
+        ESP_LOGW(TAG, "%d: pump held back, dosing on the next pass", channel);
+        return;
+    }
+    pump_off_at[channel] = now + pump_on;
+    pump_ready_at[channel] = now + pump_delay;
+    ph_pump_rearm_locked(now);
+    xSemaphoreGive(ph_pump_mutex);
+
+    checkpoint_set_pump_ready_at(CHECKPOINT_PUMP_PH, channel, now + pump_delay);
+    mqtt_publish_channel_state(state, channel);
+}
+
 static void ph_task(void *arg)
 {
     context_t *context = (context_t *)arg;
 
-    /* Waiting for tank level measurement */
-    // xEventGroupWaitBits(context->event_group, CONTEXT_EVENT_TANK, pdFALSE, pdTRUE, portMAX_DELAY);
-    vTaskDelay(pdMS_TO_TICKS(10000));
+    /* Waiting for tank level measurement, dosing is gated on the tank level anyway. */
+    xEventGroupWaitBits(context->event_group, CONTEXT_EVENT_TANK, pdFALSE, pdTRUE, pdMS_TO_TICKS(10000));
 
     while (true) {
-        uint32_t voltage = ph_read_voltage();
-        float value = ph_get_value(voltage);
-        value += (float)(context->sensors.ph.constant / 100.0);
-        ESP_ERROR_CHECK(context_set_ph(context, value));
-        ESP_LOGI(TAG, "value: %.02f", value);
-
-        if (context->cycle.initialized) {
-            if (context->sensors.tank.value >= context->sensors.tank.target_min &&
-                context->sensors.tank.value <= context->sensors.tank.target_max) {
-                if (value < context->sensors.ph.target_min) {
-                    if (is_pump_ready) {
-                        ESP_LOGW(TAG, "ph < %.01f, starting ph up pump...", context->sensors.ph.target_min);
-                        gpio_set_level(PH_UP_PUMP_GPIO, 1);
-                        ESP_ERROR_CHECK(esp_timer_start_once(ph_pump_on_timer, 1000000 * PUMP_ON_DURATION));
-                        ESP_ERROR_CHECK(esp_timer_start_once(ph_pump_delay_timer, 1000000 * PUMP_DELAY_DURATION));
-                        mqtt_publish_state("PUMP_PH_UP");
-                        is_pump_ready = false;
-                    }
-                } else if (value > context->sensors.ph.target_max) {
-                    if (is_pump_ready) {
-                        ESP_LOGW(TAG, "ph > %.01f, starting ph down pump...", context->sensors.ph.target_max);
-                        gpio_set_level(PH_DOWN_PUMP_GPIO, 1);
-                        ESP_ERROR_CHECK(esp_timer_start_once(ph_pump_on_timer, 1000000 * PUMP_ON_DURATION));
-                        ESP_ERROR_CHECK(esp_timer_start_once(ph_pump_delay_timer, 1000000 * PUMP_DELAY_DURATION));
-                        mqtt_publish_state("PUMP_PH_DOWN");
-                        is_pump_ready = false;
-                    }
-                }
-            } else {
-                ESP_LOGW(TAG, "Waiting for tank level to be set");
+        /* The probe sits in a buffer solution while it is calibrated. */
+        if (calibration_is_active(CALIBRATION_PROBE_PH)) {
+            vTaskDelay(pdMS_TO_TICKS(2000));
+            continue;
+        }
+
+        settings_t settings;
+        settings_get(&settings);
+        int64_t pump_on = 1000000LL * settings.ph.pump_on;
+        int64_t pump_delay = 1000000LL * settings.ph.pump_delay;
+
+        uint32_t voltages[CONTEXT_RESERVOIRS];
+        ph_read_voltages(voltages);
+        for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+            if (ph_adc_channel[channel] < 0) {
+                continue;
+            }
+            float value = ph_get_value(channel, voltages[channel]);
+            value += (float)(context->sensors.ph.constant[channel] / 100.0);
+            ESP_ERROR_CHECK(context_set_ph(context, channel, value));
+            TLOGI(TAG, "%d: value: %.02f", channel, value);
+
+            if (cycle_get_state() != CYCLE_STATE_RUNNING || esp_timer_get_time() < pump_ready_at[channel]) {
+                continue;
+            }
+            if (!context_tank_in_range(context, channel)) {
+                TLOGW(TAG, "%d: Waiting for tank level to be set", channel);
+            } else if (value < context->sensors.ph.target_min && actuator_is_connected(ACTUATOR_PH_UP_PUMP, channel)) {
+                ESP_LOGW(TAG, "%d: ph < %.01f, starting ph up pump...", channel, context->sensors.ph.target_min);
+                ph_dose(channel, ACTUATOR_PH_UP_PUMP, "PUMP_PH_UP", pump_on, pump_delay);
+            } else if (value > context->sensors.ph.target_max &&
+                       actuator_is_connected(ACTUATOR_PH_DOWN_PUMP, channel)) {
+                ESP_LOGW(TAG, "%d: ph > %.01f, starting ph down pump...", channel, context->sensors.ph.target_max);
+                ph_dose(channel, ACTUATOR_PH_DOWN_PUMP, "PUMP_PH_DOWN", pump_on, pump_delay);
             }
         }
         vTaskDelay(pdMS_TO_TICKS(2000));
     }
 }
 
-static void pump_on_timer_cb(void *arg)
+static void ph_pump_timer_cb(void *arg)
 {
-    gpio_set_level(PH_UP_PUMP_GPIO, 0);
-    gpio_set_level(PH_DOWN_PUMP_GPIO, 0);
-    ESP_LOGI(TAG, "pump stop");
-}
-
-static void pump_delay_timer_cb(void *arg)
-{
-    is_pump_ready = true;
-    ESP_LOGI(TAG, "pump ready");
+    xSemaphoreTake(ph_pump_mutex, portMAX_DELAY);
+    ph_pump_rearm_locked(esp_timer_get_time());
+    xSemaphoreGive(ph_pump_mutex);
 }
 
 static void ph_create_timer(void)
 {
-    const esp_timer_create_args_t pump_on_timer_args = {
-        .callback = &pump_on_timer_cb,
-        .name = "ph_pump_on_timer",
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&pump_on_timer_args, &ph_pump_on_timer));
-
-    const esp_timer_create_args_t pump_delay_timer_args = {
-        .callback = &pump_delay_timer_cb,
-        .name = "ph_pump_delay_timer",
+    const esp_timer_create_args_t pump_timer_args = {
+        .callback = &ph_pump_timer_cb,
+        .name = "ph_pump_timer",
     };
-    ESP_ERROR_CHECK(esp_timer_create(&pump_delay_timer_args, &ph_pump_delay_timer));
+    ESP_ERROR_CHECK(esp_timer_create(&pump_timer_args, &ph_pump_timer));
 }
 
 esp_err_t ph_init(context_t *context)
 {
+    ph_pump_mutex = xSemaphoreCreateMutex();
+    if (ph_pump_mutex == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
     ph_config_pin();
     ph_create_timer();
-    xTaskCreatePinnedToCore(ph_task, "ph", 4096, context, 6, &context->sensors.ph.task_handle, tskNO_AFFINITY);
+
+    /* Keep honouring the dosing lockout from before a warm restart. */
+    int64_t now = esp_timer_get_time();
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        int64_t lockout = checkpoint_get_pump_lockout(CHECKPOINT_PUMP_PH, channel);
+        if (lockout > 0) {
+            pump_ready_at[channel] = now + lockout;
+            checkpoint_set_pump_ready_at(CHECKPOINT_PUMP_PH, channel, now + lockout);
+        }
+    }
+    xTaskCreatePinnedToCore(ph_task, "ph", 4096, context, placement_priority(PLACEMENT_TASK_PH),
+                            &context->sensors.ph.task_handle, placement_core(PLACEMENT_TASK_PH));
     return ESP_OK;
 }
@@ -1,13 +1,17 @@
 #ifndef HYDROPONICS_PH_H
 #define HYDROPONICS_PH_H
 
+#include <stdint.h>
+
 #include "esp_err.h"
 
 #include "context.h"
 
-uint32_t ph_read_voltage(void);
+void ph_read_voltages(uint32_t *out_voltages);
+
+uint32_t ph_sample_voltage(int channel);
 
-float ph_get_value(uint32_t voltage);
+float ph_get_value(int channel, uint32_t voltage);
 
 esp_err_t ph_init(context_t *context);
 
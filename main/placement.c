@@ -0,0 +1,92 @@
+#include "freertos/FreeRTOS.h"
+
+#include "placement.h"
+
+#if CONFIG_HYDROPONICS_TASK_PLACEMENT_SPLIT
+#define PLACEMENT_CORE_NETWORK CONFIG_HYDROPONICS_NETWORK_CORE
+#else
+#define PLACEMENT_CORE_NETWORK 0
+#endif
+#define PLACEMENT_CORE_CONTROL (1 - PLACEMENT_CORE_NETWORK)
+
+/* The Wi-Fi driver and lwIP tasks are placed by sdkconfig (ESP32_WIFI_TASK_CORE_ID, LWIP_TCPIP_TASK_AFFINITY), the
+ * network core has to match them. Esp_timer callbacks, i.e. the pump timers, run on the core which started the
+ * scheduler. */
+static const placement_t placements[PLACEMENT_LAYOUT_MAX][PLACEMENT_TASK_MAX] = {
+    [PLACEMENT_LAYOUT_UNPINNED] = {
+        [PLACEMENT_TASK_WIFI] = {configMAX_PRIORITIES - 7, tskNO_AFFINITY},
+        [PLACEMENT_TASK_ROAM] = {2, tskNO_AFFINITY},
+        [PLACEMENT_TASK_SMARTCONFIG] = {3, tskNO_AFFINITY},
+        [PLACEMENT_TASK_NTP] = {5, tskNO_AFFINITY},
+        [PLACEMENT_TASK_MQTT] = {tskIDLE_PRIORITY + 5, tskNO_AFFINITY},
+        [PLACEMENT_TASK_JWT] = {tskIDLE_PRIORITY + 1, tskNO_AFFINITY},
+        [PLACEMENT_TASK_LOGSTREAM] = {tskIDLE_PRIORITY + 1, tskNO_AFFINITY},
+        [PLACEMENT_TASK_OTA] = {tskIDLE_PRIORITY + 1, tskNO_AFFINITY},
+        [PLACEMENT_TASK_TEMPERATURE] = {11, tskNO_AFFINITY},
+        [PLACEMENT_TASK_TANK] = {5, tskNO_AFFINITY},
+        [PLACEMENT_TASK_PH] = {6, tskNO_AFFINITY},
+        [PLACEMENT_TASK_TDS] = {5, tskNO_AFFINITY},
+        [PLACEMENT_TASK_CALIBRATION] = {6, tskNO_AFFINITY},
+        [PLACEMENT_TASK_COMMAND] = {7, tskNO_AFFINITY},
+        [PLACEMENT_TASK_CYCLE] = {3, tskNO_AFFINITY},
+        [PLACEMENT_TASK_TLOG] = {tskIDLE_PRIORITY + 1, tskNO_AFFINITY},
+        [PLACEMENT_TASK_POWER] = {tskIDLE_PRIORITY + 1, tskNO_AFFINITY},
+        [PLACEMENT_TASK_STORAGE] = {tskIDLE_PRIORITY + 1, tskNO_AFFINITY},
+    },
+    /* With the cores split the priorities only order tasks sharing a core. On the control core the bit-banged and
+     * echo timed sensors come first, then the commands driving the actuators, then the averaging probe loops. */
+    [PLACEMENT_LAYOUT_SPLIT] = {
+        [PLACEMENT_TASK_WIFI] = {configMAX_PRIORITIES - 7, PLACEMENT_CORE_NETWORK},
+        [PLACEMENT_TASK_ROAM] = {2, PLACEMENT_CORE_NETWORK},
+        [PLACEMENT_TASK_SMARTCONFIG] = {3, PLACEMENT_CORE_NETWORK},
+        [PLACEMENT_TASK_NTP] = {4, PLACEMENT_CORE_NETWORK},
+        [PLACEMENT_TASK_MQTT] = {tskIDLE_PRIORITY + 5, PLACEMENT_CORE_NETWORK},
+        [PLACEMENT_TASK_JWT] = {tskIDLE_PRIORITY + 1, PLACEMENT_CORE_NETWORK},
+        [PLACEMENT_TASK_LOGSTREAM] = {tskIDLE_PRIORITY + 1, PLACEMENT_CORE_NETWORK},
+        [PLACEMENT_TASK_OTA] = {tskIDLE_PRIORITY + 1, PLACEMENT_CORE_NETWORK},
+        [PLACEMENT_TASK_TEMPERATURE] = {11, PLACEMENT_CORE_CONTROL},
+        [PLACEMENT_TASK_TANK] = {10, PLACEMENT_CORE_CONTROL},
+        [PLACEMENT_TASK_PH] = {6, PLACEMENT_CORE_CONTROL},
+        [PLACEMENT_TASK_TDS] = {6, PLACEMENT_CORE_CONTROL},
+        [PLACEMENT_TASK_CALIBRATION] = {5, PLACEMENT_CORE_CONTROL},
+        [PLACEMENT_TASK_COMMAND] = {8, PLACEMENT_CORE_CONTROL},
+        [PLACEMENT_TASK_CYCLE] = {3, PLACEMENT_CORE_CONTROL},
+        [PLACEMENT_TASK_TLOG] = {tskIDLE_PRIORITY + 1, tskNO_AFFINITY},
+        [PLACEMENT_TASK_POWER] = {tskIDLE_PRIORITY + 1, tskNO_AFFINITY},
+        [PLACEMENT_TASK_STORAGE] = {tskIDLE_PRIORITY + 1, tskNO_AFFINITY},
+    },
+};
+
+static const char *layout_names[PLACEMENT_LAYOUT_MAX] = {
+    [PLACEMENT_LAYOUT_UNPINNED] = "unpinned",
+    [PLACEMENT_LAYOUT_SPLIT] = "split",
+};
+
+placement_layout_t placement_layout(void)
+{
+#if CONFIG_HYDROPONICS_TASK_PLACEMENT_SPLIT
+    return PLACEMENT_LAYOUT_SPLIT;
+#else
+    return PLACEMENT_LAYOUT_UNPINNED;
+#endif
+}
+
+const char *placement_layout_name(placement_layout_t layout)
+{
+    return layout_names[layout];
+}
+
+const placement_t *placement_get(placement_layout_t layout, placement_task_t task)
+{
+    return &placements[layout][task];
+}
+
+UBaseType_t placement_priority(placement_task_t task)
+{
+    return placements[placement_layout()][task].priority;
+}
+
+BaseType_t placement_core(placement_task_t task)
+{
+    return placements[placement_layout()][task].core;
+}
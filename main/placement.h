@@ -0,0 +1,53 @@
+#ifndef HYDROPONICS_PLACEMENT_H
+#define HYDROPONICS_PLACEMENT_H
+
+#include "freertos/FreeRTOS.h"
+
+typedef enum {
+    PLACEMENT_LAYOUT_UNPINNED, // Every task may run on either core, the priorities the tasks always had
+    PLACEMENT_LAYOUT_SPLIT,    // Networking on one core, acquisition and control on the other
+    PLACEMENT_LAYOUT_MAX,
+} placement_layout_t;
+
+typedef enum {
+    /* Networking */
+    PLACEMENT_TASK_WIFI,
+    PLACEMENT_TASK_ROAM,
+    PLACEMENT_TASK_SMARTCONFIG,
+    PLACEMENT_TASK_NTP,
+    PLACEMENT_TASK_MQTT,
+    PLACEMENT_TASK_JWT,
+    PLACEMENT_TASK_LOGSTREAM,
+    PLACEMENT_TASK_OTA,
+    /* Acquisition and control */
+    PLACEMENT_TASK_TEMPERATURE,
+    PLACEMENT_TASK_TANK,
+    PLACEMENT_TASK_PH,
+    PLACEMENT_TASK_TDS,
+    PLACEMENT_TASK_CALIBRATION,
+    PLACEMENT_TASK_COMMAND,
+    PLACEMENT_TASK_CYCLE,
+    /* Housekeeping, runs wherever there is idle time */
+    PLACEMENT_TASK_TLOG,
+    PLACEMENT_TASK_POWER,
+    PLACEMENT_TASK_STORAGE,
+    PLACEMENT_TASK_MAX,
+} placement_task_t;
+
+typedef struct {
+    UBaseType_t priority;
+    BaseType_t core; // tskNO_AFFINITY lets the scheduler pick either core
+} placement_t;
+
+placement_layout_t placement_layout(void);
+
+const char *placement_layout_name(placement_layout_t layout);
+
+/* Placement of a task in the given layout, placement_priority and placement_core use the configured one. */
+const placement_t *placement_get(placement_layout_t layout, placement_task_t task);
+
+UBaseType_t placement_priority(placement_task_t task);
+
+BaseType_t placement_core(placement_task_t task);
+
+#endif // HYDROPONICS_PLACEMENT_H
@@ -0,0 +1,207 @@
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+
+#include "context.h"
+#include "error.h"
+#include "mqtt.h"
+#include "placement.h"
+#include "power.h"
+
+#define POWER_REPORT_INTERVAL 60 // (int) Power report period in seconds
+#define POWER_MIN_FREQ_MHZ 40    // (int) CPU frequency when no lock is held, the XTAL frequency
+#define POWER_BEACON_MS 102.4    // (float) Default beacon interval of an AP
+
+/* Supply current from the ESP32 datasheet, used to estimate the average when no meter is attached. Radio RX/TX bursts
+ * are not modelled, so the estimate is a lower bound. */
+#define POWER_CURRENT_MAX_FREQ 50.0 // (float) Modem sleep at maximum CPU frequency, in mA
+#define POWER_CURRENT_MIN_FREQ 20.0 // (float) Modem sleep at minimum CPU frequency, in mA
+#define POWER_CURRENT_SLEEP 0.8     // (float) Light sleep, in mA
+
+#define POWER_REPORT "{"                        \
+                     "\"power\":{"              \
+                     "\"mode\":\"%s\","         \
+                     "\"lockAcquisitions\":%u," \
+                     "\"awakeMs\":%lld,"        \
+                     "\"adcMs\":%lld,"          \
+                     "\"timingMs\":%lld,"       \
+                     "\"tlsMs\":%lld,"          \
+                     "\"avgCurrentMa\":%.2f"    \
+                     "}}"
+
+#if CONFIG_HYDROPONICS_POWER_LIGHT_SLEEP
+#define POWER_MODE "light_sleep"
+#define POWER_CURRENT_IDLE POWER_CURRENT_SLEEP
+#define POWER_MIN_FREQ POWER_MIN_FREQ_MHZ
+#define POWER_LIGHT_SLEEP true
+#elif CONFIG_HYDROPONICS_POWER_DFS
+#define POWER_MODE "dfs"
+#define POWER_CURRENT_IDLE POWER_CURRENT_MIN_FREQ
+#define POWER_MIN_FREQ POWER_MIN_FREQ_MHZ
+#define POWER_LIGHT_SLEEP false
+#else
+#define POWER_MODE "performance"
+#define POWER_CURRENT_IDLE POWER_CURRENT_MAX_FREQ
+#define POWER_MIN_FREQ CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ
+#define POWER_LIGHT_SLEEP false
+#endif
+
+typedef struct {
+    int depth;
+    int64_t acquired_at;
+    int64_t held_us;
+#if CONFIG_PM_ENABLE
+    esp_pm_lock_handle_t handle;
+#endif
+} power_lock_state_t;
+
+static const char *TAG = "power";
+
+static portMUX_TYPE power_spinlock = portMUX_INITIALIZER_UNLOCKED;
+static power_lock_state_t locks[POWER_LOCK_MAX];
+
+/* Time any lock was held and the number of times the first lock was taken. With light sleep enabled each acquisition
+ * keeps the CPU awake for acquisition or TLS work, it is not a count of wake-ups: the timer and beacon wake-ups are not
+ * seen here, and an acquisition may come while the CPU is awake for something else. */
+static int held_locks = 0;
+static int64_t awake_since = 0;
+static int64_t awake_us = 0;
+static uint32_t acquisitions = 0;
+
+void power_acquire(power_lock_t lock)
+{
+#if CONFIG_PM_ENABLE
+    esp_pm_lock_acquire(locks[lock].handle);
+#endif
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&power_spinlock);
+    if (locks[lock].depth++ == 0) {
+        locks[lock].acquired_at = now;
+    }
+    if (held_locks++ == 0) {
+        awake_since = now;
+        acquisitions++;
+    }
+    portEXIT_CRITICAL(&power_spinlock);
+}
+
+void power_release(power_lock_t lock)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&power_spinlock);
+    if (--locks[lock].depth == 0) {
+        locks[lock].held_us += now - locks[lock].acquired_at;
+    }
+    if (--held_locks == 0) {
+        awake_us += now - awake_since;
+    }
+    portEXIT_CRITICAL(&power_spinlock);
+#if CONFIG_PM_ENABLE
+    esp_pm_lock_release(locks[lock].handle);
+#endif
+}
+
+wifi_ps_type_t power_wifi_ps_type(void)
+{
+#if CONFIG_HYDROPONICS_POWER_LIGHT_SLEEP
+    return WIFI_PS_MAX_MODEM;
+#elif CONFIG_HYDROPONICS_POWER_DFS
+    return WIFI_PS_MIN_MODEM;
+#else
+    return WIFI_PS_NONE;
+#endif
+}
+
+/* Beacons the station may sleep through in max modem sleep. The radio wakes once per telemetry period, which is also
+ * when the device transmits, so commands are picked up with at most one telemetry period of delay. */
+uint16_t power_listen_interval(void)
+{
+    return (uint16_t)(CONFIG_HYDROPONICS_TELEMETRY_INTERVAL * 1000 / POWER_BEACON_MS);
+}
+
+static void power_task(void *arg)
+{
+    ARG_UNUSED(arg);
+    int64_t window_start = esp_timer_get_time();
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(POWER_REPORT_INTERVAL * 1000));
+
+        int64_t now = esp_timer_get_time();
+        int64_t held[POWER_LOCK_MAX];
+        portENTER_CRITICAL(&power_spinlock);
+        for (int i = 0; i < POWER_LOCK_MAX; i++) {
+            if (locks[i].depth > 0) {
+                locks[i].held_us += now - locks[i].acquired_at;
+                locks[i].acquired_at = now;
+            }
+            held[i] = locks[i].held_us;
+            locks[i].held_us = 0;
+        }
+        if (held_locks > 0) {
+            awake_us += now - awake_since;
+            awake_since = now;
+        }
+        int64_t awake = awake_us;
+        uint32_t window_acquisitions = acquisitions;
+        awake_us = 0;
+        acquisitions = 0;
+        portEXIT_CRITICAL(&power_spinlock);
+
+        int64_t window = now - window_start;
+        window_start = now;
+        double current = (awake * POWER_CURRENT_MAX_FREQ + (window - awake) * POWER_CURRENT_IDLE) / window;
+        ESP_LOGI(TAG, "%s: %u lock acquisitions, awake %lld ms of %lld ms, estimated %.2f mA", POWER_MODE,
+                 window_acquisitions, awake / 1000, window / 1000, current);
+
+        char *msg = NULL;
+        asprintf(&msg, POWER_REPORT, POWER_MODE, window_acquisitions, awake / 1000, held[POWER_LOCK_ADC] / 1000,
+                 held[POWER_LOCK_TIMING] / 1000, held[POWER_LOCK_TLS] / 1000, current);
+        if (msg != NULL) {
+            mqtt_publish_state(msg);
+            free(msg);
+        }
+#if CONFIG_PM_PROFILING
+        esp_pm_dump_locks(stdout);
+#endif
+    }
+}
+
+esp_err_t power_init(context_t *context)
+{
+    ARG_UNUSED(context);
+
+#if CONFIG_PM_ENABLE
+    static const esp_pm_lock_type_t lock_types[POWER_LOCK_MAX] = {
+        [POWER_LOCK_ADC] = ESP_PM_APB_FREQ_MAX,
+        [POWER_LOCK_TIMING] = ESP_PM_CPU_FREQ_MAX,
+        [POWER_LOCK_TLS] = ESP_PM_CPU_FREQ_MAX,
+    };
+    static const char *lock_names[POWER_LOCK_MAX] = {
+        [POWER_LOCK_ADC] = "adc",
+        [POWER_LOCK_TIMING] = "timing",
+        [POWER_LOCK_TLS] = "tls",
+    };
+    for (int i = 0; i < POWER_LOCK_MAX; i++) {
+        ESP_ERROR_CHECK(esp_pm_lock_create(lock_types[i], 0, lock_names[i], &locks[i].handle));
+    }
+
+    esp_pm_config_esp32_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = POWER_MIN_FREQ,
+        .light_sleep_enable = POWER_LIGHT_SLEEP,
+    };
+    ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
+#endif
+    ESP_LOGI(TAG, "Power mode: %s", POWER_MODE);
+
+    xTaskCreatePinnedToCore(power_task, "power", 3072, NULL, placement_priority(PLACEMENT_TASK_POWER), NULL,
+                            placement_core(PLACEMENT_TASK_POWER));
+    return ESP_OK;
+}
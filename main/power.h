@@ -0,0 +1,28 @@
+#ifndef HYDROPONICS_POWER_H
+#define HYDROPONICS_POWER_H
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_wifi.h"
+
+#include "context.h"
+
+typedef enum {
+    POWER_LOCK_ADC,    // ADC conversions need the APB clock at its maximum
+    POWER_LOCK_TIMING, // Bit-banged sensor protocols need a stable CPU clock and no light sleep
+    POWER_LOCK_TLS,    // TLS handshakes are CPU bound, run them at full speed
+    POWER_LOCK_MAX,
+} power_lock_t;
+
+void power_acquire(power_lock_t lock);
+
+void power_release(power_lock_t lock);
+
+wifi_ps_type_t power_wifi_ps_type(void);
+
+uint16_t power_listen_interval(void);
+
+esp_err_t power_init(context_t *context);
+
+#endif // HYDROPONICS_POWER_H
@@ -0,0 +1,273 @@
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "cJSON.h"
+
+#include "context.h"
+#include "error.h"
+#include "recipe.h"
+#include "schedule.h"
+#include "settings.h"
+#include "storage.h"
+
+#define RECIPE_KEY "recipe"
+#define RECIPE_MAX_STAGES 8
+#define RECIPE_DAY_SEC (24 * 3600)
+
+#define RECIPE_RANGE_IS_SET(r) ((r).min < (r).max)
+
+typedef struct {
+    uint32_t count;
+    bool interpolate; // Blend the targets day by day towards the next stage
+    recipe_stage_t stages[RECIPE_MAX_STAGES];
+} recipe_t;
+
+static const char *TAG = "recipe";
+
+/* The stage ladder the cycle used before recipes could be pushed, lights on from 06:00 to 18:00. */
+static const recipe_t recipe_default = {
+    .count = 4,
+    .interpolate = false,
+    .stages = {
+        {.day = 1, .light_on = 6 * 60, .light_duration = 12 * 60, .tds = {575, 625}},
+        {.day = 8, .light_on = 6 * 60, .light_duration = 12 * 60, .tds = {675, 725}},
+        {.day = 15, .light_on = 6 * 60, .light_duration = 12 * 60, .tds = {775, 825}},
+        {.day = 22, .light_on = 6 * 60, .light_duration = 12 * 60, .tds = {875, 925}},
+    },
+};
+
+static context_t *context;
+
+static portMUX_TYPE recipe_spinlock = portMUX_INITIALIZER_UNLOCKED;
+static recipe_t recipe;
+static recipe_stage_t current_stage;
+static int current_index = -1;
+
+static esp_timer_handle_t recipe_timer;
+static int grow_light = -1;
+
+static recipe_range_t recipe_lerp(recipe_range_t from, recipe_range_t to, float t)
+{
+    if (!RECIPE_RANGE_IS_SET(from) || !RECIPE_RANGE_IS_SET(to)) {
+        return from;
+    }
+    recipe_range_t range = {
+        .min = from.min + (to.min - from.min) * t,
+        .max = from.max + (to.max - from.max) * t,
+    };
+    return range;
+}
+
+/* Applies the targets of 'stage', an empty range takes the target from the settings. The settings hold no TDS target,
+ * an empty TDS range leaves none. */
+static void recipe_apply_targets(const recipe_stage_t *stage)
+{
+    settings_t settings;
+    settings_get(&settings);
+    recipe_range_t ph = {settings.ph.target_min, settings.ph.target_max};
+    recipe_range_t tds = {0, 0};
+    recipe_range_t tank = {settings.tank.target_min, settings.tank.target_max};
+    if (RECIPE_RANGE_IS_SET(stage->ph)) {
+        ph = stage->ph;
+    }
+    if (RECIPE_RANGE_IS_SET(stage->tds)) {
+        tds = stage->tds;
+    }
+    if (RECIPE_RANGE_IS_SET(stage->tank)) {
+        tank = stage->tank;
+    }
+    ESP_ERROR_CHECK_WITHOUT_ABORT(context_set_target_tds(context, tds.min, tds.max));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(context_set_target_ph(context, ph.min, ph.max));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(context_set_target_tank(context, tank.min, tank.max));
+}
+
+/* Targets for the given cycle day, returns the index of the stage the day falls in. */
+static int recipe_evaluate(const recipe_t *value, int day, recipe_stage_t *out_stage)
+{
+    int i = 0;
+    while (i < value->count - 1 && day >= value->stages[i + 1].day) {
+        i++;
+    }
+    *out_stage = value->stages[i];
+    if (value->interpolate && i < value->count - 1) {
+        const recipe_stage_t *next = &value->stages[i + 1];
+        float t = (float)(day - out_stage->day) / (next->day - out_stage->day);
+        out_stage->ph = recipe_lerp(out_stage->ph, next->ph, t);
+        out_stage->tds = recipe_lerp(out_stage->tds, next->tds, t);
+        out_stage->tank = recipe_lerp(out_stage->tank, next->tank, t);
+    }
+    return i;
+}
+
+/* Applies the targets for the current day and arms the timer for the next boundary. Stages only change on a day
+ * boundary of the cycle, so that is the next instant anything can change, both with and without interpolation. */
+esp_err_t recipe_update(void)
+{
+    EventBits_t bits = xEventGroupGetBits(context->event_group);
+    if (!(bits & CONTEXT_EVENT_TIME) || !context->cycle.initialized) {
+        return ESP_OK;
+    }
+
+    time_t now = time(NULL);
+    int64_t elapsed = (int64_t)now - context->cycle.start_time;
+    int day = elapsed < 0 ? 1 : (int)(elapsed / RECIPE_DAY_SEC) + 1;
+
+    recipe_stage_t stage;
+    portENTER_CRITICAL(&recipe_spinlock);
+    int index = recipe_evaluate(&recipe, day, &stage);
+    current_stage = stage;
+    portEXIT_CRITICAL(&recipe_spinlock);
+
+    context->cycle.elapsed_days = day;
+    recipe_apply_targets(&stage);
+    ESP_ERROR_CHECK_WITHOUT_ABORT(schedule_set(grow_light, stage.light_on, stage.light_duration));
+    if (index != current_index) {
+        ESP_LOGI(TAG, "Day %d, entering stage %d (from day %d)", day, index + 1, stage.day);
+        current_index = index;
+    } else {
+        ESP_LOGI(TAG, "Day %d of stage %d", day, index + 1);
+    }
+
+    int64_t next_boundary = context->cycle.start_time + (int64_t)day * RECIPE_DAY_SEC;
+    esp_timer_stop(recipe_timer);
+    return esp_timer_start_once(recipe_timer, (next_boundary - now) * 1000000LL);
+}
+
+/* Ends the recipe, the targets go back to the settings. */
+esp_err_t recipe_stop(void)
+{
+    const recipe_stage_t none = {0};
+    current_index = -1;
+    recipe_apply_targets(&none);
+    ESP_ERROR_CHECK_WITHOUT_ABORT(schedule_clear(grow_light));
+    esp_err_t err = esp_timer_stop(recipe_timer);
+    return err == ESP_ERR_INVALID_STATE ? ESP_OK : err;
+}
+
+void recipe_get_stage(recipe_stage_t *out_stage)
+{
+    portENTER_CRITICAL(&recipe_spinlock);
+    *out_stage = current_stage;
+    portEXIT_CRITICAL(&recipe_spinlock);
+}
+
+static void recipe_timer_cb(void *arg)
+{
+    ARG_UNUSED(arg);
+    /* Wall clock and esp_timer drift apart, a boundary reached a little early is simply re-armed for the rest. */
+    ESP_ERROR_CHECK_WITHOUT_ABORT(recipe_update());
+}
+
+static esp_err_t recipe_validate(const recipe_t *value)
+{
+    ARG_CHECK(value->count > 0 && value->count <= RECIPE_MAX_STAGES, "recipe needs 1 to %d stages", RECIPE_MAX_STAGES);
+    ARG_CHECK(value->stages[0].day == 1, "first stage must start on day 1");
+    for (int i = 0; i < value->count; i++) {
+        const recipe_stage_t *stage = &value->stages[i];
+        ARG_CHECK(i == 0 || stage->day > value->stages[i - 1].day, "stage %d does not start after stage %d", i + 1, i);
+        ARG_CHECK(stage->light_on < 24 * 60 && stage->light_duration <= 24 * 60, "stage %d photoperiod", i + 1);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t recipe_parse_range(const cJSON *json, const char *name, recipe_range_t *out_range)
+{
+    const cJSON *range = cJSON_GetObjectItem(json, name);
+    if (range == NULL) {
+        return ESP_OK;
+    }
+    ARG_CHECK(cJSON_IsArray(range) && cJSON_GetArraySize(range) == 2, "%s must be [min, max]", name);
+    const cJSON *min = cJSON_GetArrayItem(range, 0);
+    const cJSON *max = cJSON_GetArrayItem(range, 1);
+    ARG_CHECK(cJSON_IsNumber(min) && cJSON_IsNumber(max) && min->valuedouble < max->valuedouble,
+              "%s must be [min, max]", name);
+    out_range->min = (float)min->valuedouble;
+    out_range->max = (float)max->valuedouble;
+    return ESP_OK;
+}
+
+/* Replaces the recipe, e.g. {"interpolate":false,"stages":[{"day":1,"tds":[575,625],"ph":[5.5,6.5],
+ * "light":[360,720]}]}, where "light" is [on minute of the day, duration in minutes]. */
+esp_err_t recipe_set(const cJSON *json)
+{
+    const cJSON *stages = cJSON_GetObjectItem(json, "stages");
+    ARG_CHECK(cJSON_IsArray(stages), "stages are required");
+
+    recipe_t next = {
+        .count = cJSON_GetArraySize(stages),
+        .interpolate = cJSON_IsTrue(cJSON_GetObjectItem(json, "interpolate")),
+    };
+    ARG_CHECK(next.count <= RECIPE_MAX_STAGES, "recipe needs 1 to %d stages", RECIPE_MAX_STAGES);
+    for (int i = 0; i < next.count; i++) {
+        const cJSON *item = cJSON_GetArrayItem(stages, i);
+        recipe_stage_t *stage = &next.stages[i];
+        const cJSON *day = cJSON_GetObjectItem(item, "day");
+        ARG_CHECK(cJSON_IsNumber(day) && day->valueint > 0, "stage %d needs a day", i + 1);
+        stage->day = day->valueint;
+
+        const cJSON *light = cJSON_GetObjectItem(item, "light");
+        if (light != NULL) {
+            ARG_CHECK(cJSON_IsArray(light) && cJSON_GetArraySize(light) == 2, "light must be [on, duration]");
+            ARG_CHECK(cJSON_GetArrayItem(light, 0)->valueint >= 0 && cJSON_GetArrayItem(light, 1)->valueint >= 0,
+                      "light must be [on, duration]");
+            stage->light_on = cJSON_GetArrayItem(light, 0)->valueint;
+            stage->light_duration = cJSON_GetArrayItem(light, 1)->valueint;
+        }
+        esp_err_t err = recipe_parse_range(item, "ph", &stage->ph);
+        err = err == ESP_OK ? recipe_parse_range(item, "tds", &stage->tds) : err;
+        err = err == ESP_OK ? recipe_parse_range(item, "tank", &stage->tank) : err;
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    esp_err_t err = recipe_validate(&next);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = storage_set_blob(RECIPE_KEY, &next, sizeof(next));
+    err = err == ESP_OK ? storage_commit() : err;
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    portENTER_CRITICAL(&recipe_spinlock);
+    recipe = next;
+    portEXIT_CRITICAL(&recipe_spinlock);
+    ESP_LOGI(TAG, "Recipe updated, %d stage(s)", next.count);
+    current_index = -1;
+    return recipe_update();
+}
+
+esp_err_t recipe_init(context_t *ctx)
+{
+    ARG_CHECK(ctx != NULL, ERR_PARAM_NULL);
+
+    context = ctx;
+    size_t length = sizeof(recipe);
+    esp_err_t err = storage_get_blob(RECIPE_KEY, &recipe, &length);
+    if (err != ESP_OK || length != sizeof(recipe) || recipe_validate(&recipe) != ESP_OK) {
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
+            ESP_LOGW(TAG, "Stored recipe is unusable, using the default. err: %s", esp_err_to_name(err));
+        }
+        recipe = recipe_default;
+    }
+    current_stage = recipe.stages[0];
+
+    settings_t settings;
+    settings_get(&settings);
+    grow_light = schedule_register("grow_light", settings.gpio.grow_light);
+
+    const esp_timer_create_args_t recipe_timer_args = {
+        .callback = &recipe_timer_cb,
+        .name = "recipe_timer",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&recipe_timer_args, &recipe_timer));
+    return ESP_OK;
+}
@@ -0,0 +1,38 @@
+#ifndef HYDROPONICS_RECIPE_H
+#define HYDROPONICS_RECIPE_H
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#include "cJSON.h"
+
+#include "context.h"
+
+typedef struct {
+    float min;
+    float max;
+} recipe_range_t;
+
+/* A stage lasts from its first day until the next stage starts. An empty range (min == max) uses the target from the
+ * settings, for TDS which has none in the settings it leaves the TDS without target. */
+typedef struct {
+    uint16_t day;            // First day of the stage, the cycle starts on day 1
+    uint16_t light_on;       // Minute of the day the grow light turns on
+    uint16_t light_duration; // Photoperiod, in minutes
+    recipe_range_t ph;
+    recipe_range_t tds;
+    recipe_range_t tank;
+} recipe_stage_t;
+
+void recipe_get_stage(recipe_stage_t *out_stage);
+
+esp_err_t recipe_update(void);
+
+esp_err_t recipe_stop(void);
+
+esp_err_t recipe_set(const cJSON *json);
+
+esp_err_t recipe_init(context_t *context);
+
+#endif // HYDROPONICS_RECIPE_H
@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_wifi.h"
+#if CONFIG_WPA_11KV_SUPPORT
+#include "esp_rrm.h"
+#include "esp_wnm.h"
+#endif
+
+#include "context.h"
+#include "error.h"
+#include "placement.h"
+#include "roam.h"
+#include "wifi.h"
+
+#define ROAM_CHECK_INTERVAL 5000   // (int) RSSI sampling period in millis
+#define ROAM_RSSI_THRESHOLD (-72)  // (int) Look for a better AP below this smoothed RSSI in dBm
+#define ROAM_RSSI_HYSTERESIS 6     // (int) Smoothed RSSI must recover this much above the threshold to re-arm
+#define ROAM_MIN_GAIN 8            // (int) A candidate AP must be at least this much stronger in dB
+#define ROAM_RESCAN_INTERVAL 120   // (int) Delay between candidate scans while the link stays weak, in seconds
+#define ROAM_MAX_AP_RECORDS 16
+#define ROAM_NEIGHBOR_REPORT_TIMEOUT 1000
+
+static const char *TAG = "roam";
+
+static context_t *context;
+static TaskHandle_t roam_task_handle;
+
+/* Channels advertised by the AP in its 802.11k neighbor report, one bit per channel. */
+static volatile uint32_t neighbor_channels;
+
+#if CONFIG_WPA_11KV_SUPPORT
+static void roam_neighbor_report_cb(void *ctx, const uint8_t *report, size_t report_len)
+{
+    ARG_UNUSED(ctx);
+    uint32_t channels = 0;
+    /* Neighbor report elements: id (52), length, BSSID (6), BSSID info (4), operating class, channel, PHY type. */
+    for (size_t pos = 0; report != NULL && pos + 2 <= report_len; pos += 2 + report[pos + 1]) {
+        if (report[pos] == 52 && report[pos + 1] >= 13 && pos + 2 + report[pos + 1] <= report_len) {
+            uint8_t channel = report[pos + 2 + 11];
+            if (channel > 0 && channel < 32) {
+                channels |= BIT(channel);
+            }
+        }
+    }
+    neighbor_channels = channels;
+    xTaskNotifyGive(roam_task_handle);
+}
+#endif
+
+static uint32_t roam_candidate_channels(void)
+{
+#if CONFIG_WPA_11KV_SUPPORT
+    if (esp_rrm_is_rrm_supported_connection()) {
+        neighbor_channels = 0;
+        if (esp_rrm_send_neighbor_rep_request(roam_neighbor_report_cb, NULL) == 0 &&
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ROAM_NEIGHBOR_REPORT_TIMEOUT)) > 0) {
+            return neighbor_channels;
+        }
+    }
+#endif
+    return 0;
+}
+
+static uint16_t roam_scan(uint8_t channel, wifi_ap_record_t *records, uint16_t max_records)
+{
+    wifi_scan_config_t scan_config = {
+        .channel = channel,
+    };
+    if (esp_wifi_scan_start(&scan_config, true) != ESP_OK) {
+        return 0;
+    }
+    uint16_t count = max_records;
+    if (esp_wifi_scan_get_ap_records(&count, records) != ESP_OK) {
+        return 0;
+    }
+    return count;
+}
+
+/* Finds the strongest AP of any provisioned network which beats the current link by ROAM_MIN_GAIN and moves to it. */
+static void roam_find_better_ap(int rssi)
+{
+#if CONFIG_WPA_11KV_SUPPORT
+    if (esp_wnm_is_btm_supported_connection() &&
+        esp_wnm_send_bss_transition_mgmt_query(REASON_FRAME_LOSS, NULL, 0) == 0) {
+        /* The supplicant follows the AP's BSS transition request by itself. */
+        ESP_LOGI(TAG, "Requested a BSS transition from the AP");
+        return;
+    }
+#endif
+    wifi_network_t networks[WIFI_MAX_NETWORKS];
+    size_t network_count = wifi_get_networks(networks, WIFI_MAX_NETWORKS);
+    wifi_ap_record_t current;
+    wifi_ap_record_t *records = calloc(ROAM_MAX_AP_RECORDS, sizeof(wifi_ap_record_t));
+    if (network_count == 0 || records == NULL || esp_wifi_sta_get_ap_info(&current) != ESP_OK) {
+        free(records);
+        return;
+    }
+
+    uint32_t channels = roam_candidate_channels();
+    const wifi_ap_record_t *best = NULL;
+    const wifi_network_t *best_network = NULL;
+    for (uint8_t channel = channels ? 1 : 0; channel < 32; channel++) {
+        if (channels && !(channels & BIT(channel))) {
+            continue;
+        }
+        uint16_t count = roam_scan(channel, records, ROAM_MAX_AP_RECORDS);
+        for (uint16_t i = 0; i < count; i++) {
+            const wifi_ap_record_t *record = &records[i];
+            if (memcmp(record->bssid, current.bssid, sizeof(record->bssid)) == 0 ||
+                record->rssi < rssi + ROAM_MIN_GAIN || (best != NULL && record->rssi <= best->rssi)) {
+                continue;
+            }
+            for (size_t n = 0; n < network_count; n++) {
+                const char *ssid = (const char *)networks[n].ssid;
+                if (strncmp((const char *)record->ssid, ssid, sizeof(networks[n].ssid)) == 0) {
+                    best = record;
+                    best_network = &networks[n];
+                    break;
+                }
+            }
+        }
+        if (best != NULL || channels == 0) {
+            /* A full scan covers every channel at once, a neighbor channel hit is good enough. */
+            break;
+        }
+    }
+
+    if (best != NULL) {
+        ESP_LOGI(TAG, "Found %s " MACSTR " at %d dBm (current %d dBm)", (const char *)best->ssid,
+                 MAC2STR(best->bssid), best->rssi, rssi);
+        ESP_ERROR_CHECK_WITHOUT_ABORT(wifi_roam(best_network, best->bssid, best->primary));
+    } else {
+        ESP_LOGI(TAG, "No better AP than the current one (%d dBm)", rssi);
+    }
+    free(records);
+}
+
+static void roam_task(void *arg)
+{
+    ARG_UNUSED(arg);
+
+    int rssi = 0;
+    bool tracking = false;
+    bool armed = true;
+    TickType_t last_scan = 0;
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(ROAM_CHECK_INTERVAL));
+        xEventGroupWaitBits(context->event_group, CONTEXT_EVENT_NETWORK, pdFALSE, pdTRUE, portMAX_DELAY);
+
+        int8_t sample;
+        if (wifi_get_ap_rssi(&sample) != ESP_OK) {
+            tracking = false;
+            continue;
+        }
+        /* Exponential moving average with a weight of 1/4 for the new sample. */
+        rssi = tracking ? rssi + (sample - rssi) / 4 : sample;
+        tracking = true;
+
+        if (rssi > ROAM_RSSI_THRESHOLD + ROAM_RSSI_HYSTERESIS) {
+            armed = true;
+            continue;
+        }
+        if (rssi >= ROAM_RSSI_THRESHOLD) {
+            continue;
+        }
+        if (!armed && xTaskGetTickCount() - last_scan < pdMS_TO_TICKS(ROAM_RESCAN_INTERVAL * 1000)) {
+            continue;
+        }
+        ESP_LOGW(TAG, "Weak link: %d dBm, looking for a better AP", rssi);
+        armed = false;
+        last_scan = xTaskGetTickCount();
+        roam_find_better_ap(rssi);
+        tracking = false;
+    }
+}
+
+esp_err_t roam_init(context_t *ctx)
+{
+    ARG_CHECK(ctx != NULL, ERR_PARAM_NULL);
+
+    context = ctx;
+    xTaskCreatePinnedToCore(roam_task, "roam", 3072, NULL, placement_priority(PLACEMENT_TASK_ROAM), &roam_task_handle,
+                            placement_core(PLACEMENT_TASK_ROAM));
+    return ESP_OK;
+}
@@ -0,0 +1,10 @@
+#ifndef HYDROPONICS_ROAM_H
+#define HYDROPONICS_ROAM_H
+
+#include "esp_err.h"
+
+#include "context.h"
+
+esp_err_t roam_init(context_t *context);
+
+#endif // HYDROPONICS_ROAM_H
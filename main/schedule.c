@@ -0,0 +1,159 @@
+#include <stdbool.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "driver/gpio.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "context.h"
+#include "error.h"
+#include "schedule.h"
+
+#define SCHEDULE_MAX_OUTPUTS 4
+#define SCHEDULE_DAY_SEC (24 * 3600)
+
+/* Daily on/off window of an output in local time, the window may wrap around midnight. */
+typedef struct {
+    const char *name;
+    gpio_num_t gpio;
+    bool enabled;
+    bool state;
+    uint16_t on_minute;
+    uint16_t duration; // in minutes, 0 keeps the output off and 24 * 60 keeps it on
+} schedule_output_t;
+
+static const char *TAG = "schedule";
+
+static context_t *context;
+
+static schedule_output_t outputs[SCHEDULE_MAX_OUTPUTS];
+static int output_count = 0;
+static SemaphoreHandle_t schedule_mutex;
+static esp_timer_handle_t schedule_timer;
+
+/* Registers an output driven by the scheduler, returns its handle or -1 when there is no room left. */
+int schedule_register(const char *name, gpio_num_t gpio)
+{
+    xSemaphoreTake(schedule_mutex, portMAX_DELAY);
+    int output = output_count < SCHEDULE_MAX_OUTPUTS ? output_count++ : -1;
+    if (output >= 0) {
+        outputs[output] = (schedule_output_t){.name = name, .gpio = gpio};
+        gpio_config_t config = {
+            .intr_type = GPIO_INTR_DISABLE,
+            .mode = GPIO_MODE_OUTPUT,
+            .pin_bit_mask = (1ULL << gpio),
+            .pull_up_en = 1,
+        };
+        gpio_config(&config);
+        gpio_set_level(gpio, 0);
+    }
+    xSemaphoreGive(schedule_mutex);
+    return output;
+}
+
+/* Brings every output to the state it should have now, then arms the single timer for the closest upcoming edge. */
+static esp_err_t schedule_rearm_locked(void)
+{
+    esp_timer_stop(schedule_timer);
+    if (!(xEventGroupGetBits(context->event_group) & CONTEXT_EVENT_TIME)) {
+        return ESP_OK;
+    }
+
+    struct timeval tv;
+    struct tm timeinfo;
+    gettimeofday(&tv, NULL);
+    localtime_r(&tv.tv_sec, &timeinfo);
+    int now = timeinfo.tm_hour * 3600 + timeinfo.tm_min * 60 + timeinfo.tm_sec;
+
+    int next_edge = SCHEDULE_DAY_SEC + 1;
+    for (int i = 0; i < output_count; i++) {
+        schedule_output_t *output = &outputs[i];
+        if (!output->enabled) {
+            continue;
+        }
+        int on = output->on_minute * 60;
+        int off = (on + output->duration * 60) % SCHEDULE_DAY_SEC;
+        bool state = (now - on + SCHEDULE_DAY_SEC) % SCHEDULE_DAY_SEC < output->duration * 60;
+        if (state != output->state) {
+            output->state = state;
+            gpio_set_level(output->gpio, state);
+            ESP_LOGI(TAG, "%s %s at %02d:%02d:%02d", output->name, state ? "on" : "off", timeinfo.tm_hour,
+                     timeinfo.tm_min, timeinfo.tm_sec);
+        }
+        if (output->duration == 0 || output->duration >= 24 * 60) {
+            continue;
+        }
+        int until_on = (on - now + SCHEDULE_DAY_SEC - 1) % SCHEDULE_DAY_SEC + 1;
+        int until_off = (off - now + SCHEDULE_DAY_SEC - 1) % SCHEDULE_DAY_SEC + 1;
+        next_edge = MIN(next_edge, MIN(until_on, until_off));
+    }
+    if (next_edge > SCHEDULE_DAY_SEC) {
+        return ESP_OK;
+    }
+    /* Edges fall on whole seconds, the timer does not fire again until then. */
+    return esp_timer_start_once(schedule_timer, next_edge * 1000000LL - tv.tv_usec);
+}
+
+esp_err_t schedule_rearm(void)
+{
+    xSemaphoreTake(schedule_mutex, portMAX_DELAY);
+    esp_err_t err = schedule_rearm_locked();
+    xSemaphoreGive(schedule_mutex);
+    return err;
+}
+
+esp_err_t schedule_set(int output, uint16_t on_minute, uint16_t duration)
+{
+    ARG_CHECK(output >= 0 && output < output_count, "invalid output %d", output);
+    ARG_CHECK(on_minute < 24 * 60 && duration <= 24 * 60, "invalid window");
+
+    xSemaphoreTake(schedule_mutex, portMAX_DELAY);
+    outputs[output].enabled = true;
+    outputs[output].on_minute = on_minute;
+    outputs[output].duration = duration;
+    esp_err_t err = schedule_rearm_locked();
+    xSemaphoreGive(schedule_mutex);
+    return err;
+}
+
+esp_err_t schedule_clear(int output)
+{
+    ARG_CHECK(output >= 0 && output < output_count, "invalid output %d", output);
+
+    xSemaphoreTake(schedule_mutex, portMAX_DELAY);
+    outputs[output].enabled = false;
+    outputs[output].state = false;
+    gpio_set_level(outputs[output].gpio, 0);
+    esp_err_t err = schedule_rearm_locked();
+    xSemaphoreGive(schedule_mutex);
+    return err;
+}
+
+static void schedule_timer_cb(void *arg)
+{
+    ARG_UNUSED(arg);
+    ESP_ERROR_CHECK_WITHOUT_ABORT(schedule_rearm());
+}
+
+esp_err_t schedule_init(context_t *ctx)
+{
+    ARG_CHECK(ctx != NULL, ERR_PARAM_NULL);
+
+    context = ctx;
+    schedule_mutex = xSemaphoreCreateMutex();
+    if (schedule_mutex == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    const esp_timer_create_args_t schedule_timer_args = {
+        .callback = &schedule_timer_cb,
+        .name = "schedule_timer",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&schedule_timer_args, &schedule_timer));
+    return ESP_OK;
+}
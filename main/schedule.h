@@ -0,0 +1,21 @@
+#ifndef HYDROPONICS_SCHEDULE_H
+#define HYDROPONICS_SCHEDULE_H
+
+#include <stdint.h>
+
+#include "driver/gpio.h"
+#include "esp_err.h"
+
+#include "context.h"
+
+int schedule_register(const char *name, gpio_num_t gpio);
+
+esp_err_t schedule_set(int output, uint16_t on_minute, uint16_t duration);
+
+esp_err_t schedule_clear(int output);
+
+esp_err_t schedule_rearm(void);
+
+esp_err_t schedule_init(context_t *context);
+
+#endif // HYDROPONICS_SCHEDULE_H
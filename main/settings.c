@@ -0,0 +1,338 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "driver/adc.h"
+#include "driver/gpio.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+
+#include "cJSON.h"
+
+#include "context.h"
+#include "error.h"
+#include "settings.h"
+#include "storage.h"
+
+#define SETTINGS_KEY "settings"
+#define SETTINGS_MAGIC 0x48594453 // "HYDS"
+#define SETTINGS_VERSION 2
+
+_Static_assert(CONTEXT_RESERVOIRS <= SETTINGS_MAX_RESERVOIRS, "more reservoirs than stored settings slots");
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t length; // Size of the settings following the header
+    uint32_t crc;    // CRC32 of the settings following the header
+} settings_header_t;
+
+typedef struct {
+    settings_header_t header;
+    settings_t settings;
+} settings_blob_t;
+
+typedef enum {
+    SETTINGS_FIELD_FLOAT,
+    SETTINGS_FIELD_INT,
+} settings_field_type_t;
+
+typedef struct {
+    const char *group;
+    const char *name;
+    settings_field_type_t type;
+    size_t offset;
+} settings_field_t;
+
+static const char *TAG = "settings";
+
+static const settings_t settings_defaults = {
+    .ph = {
+        .target_min = 5.5,
+        .target_max = 6.5,
+        .neutral_voltage = 1555,
+        .acid_voltage = 2010,
+        .pump_on = 5,
+        .pump_delay = 60,
+    },
+    .tds = {
+        .vref = 2.28,
+        .pump_on = 5,
+        .pump_delay = 20,
+    },
+    .tank = {
+        .target_min = 20,
+        .target_max = 24,
+    },
+    .gpio = {
+        .ph_up_pump = 18,
+        .ph_down_pump = 19,
+        .tds_a_pump = 16,
+        .tds_b_pump = 17,
+        .tank_pump = 5,
+        .source_valve = 22,
+        .drain_valve = 23,
+        .grow_light = 21,
+        .ultrasonic_trigger = 2,
+        .ultrasonic_echo = 15,
+        .dht = 26,
+    },
+    .reservoir = {
+        .ph_adc = {ADC1_CHANNEL_6, -1, -1, -1},  // GPIO 34
+        .tds_adc = {ADC1_CHANNEL_0, -1, -1, -1}, // GPIO 36
+        .ph_up_pump = {18, -1, -1, -1},
+        .ph_down_pump = {19, -1, -1, -1},
+        .tds_a_pump = {16, -1, -1, -1},
+        .tds_b_pump = {17, -1, -1, -1},
+        .tank_pump = {5, -1, -1, -1},
+        .source_valve = {22, -1, -1, -1},
+        .drain_valve = {23, -1, -1, -1},
+        .ultrasonic_trigger = {2, -1, -1, -1},
+        .ultrasonic_echo = {15, -1, -1, -1},
+    },
+};
+
+/* JSON names of the fields accepted by settings_update, e.g. {"ph":{"min":5.8,"pumpDelay":90}}. */
+static const settings_field_t settings_fields[] = {
+    {"ph", "min", SETTINGS_FIELD_FLOAT, offsetof(settings_t, ph.target_min)},
+    {"ph", "max", SETTINGS_FIELD_FLOAT, offsetof(settings_t, ph.target_max)},
+    {"ph", "neutralVoltage", SETTINGS_FIELD_INT, offsetof(settings_t, ph.neutral_voltage)},
+    {"ph", "acidVoltage", SETTINGS_FIELD_INT, offsetof(settings_t, ph.acid_voltage)},
+    {"ph", "pumpOn", SETTINGS_FIELD_INT, offsetof(settings_t, ph.pump_on)},
+    {"ph", "pumpDelay", SETTINGS_FIELD_INT, offsetof(settings_t, ph.pump_delay)},
+    {"tds", "vref", SETTINGS_FIELD_FLOAT, offsetof(settings_t, tds.vref)},
+    {"tds", "pumpOn", SETTINGS_FIELD_INT, offsetof(settings_t, tds.pump_on)},
+    {"tds", "pumpDelay", SETTINGS_FIELD_INT, offsetof(settings_t, tds.pump_delay)},
+    {"tank", "min", SETTINGS_FIELD_FLOAT, offsetof(settings_t, tank.target_min)},
+    {"tank", "max", SETTINGS_FIELD_FLOAT, offsetof(settings_t, tank.target_max)},
+    {"gpio", "phUpPump", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.ph_up_pump[0])},
+    {"gpio", "phDownPump", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.ph_down_pump[0])},
+    {"gpio", "tdsAPump", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.tds_a_pump[0])},
+    {"gpio", "tdsBPump", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.tds_b_pump[0])},
+    {"gpio", "tankPump", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.tank_pump[0])},
+    {"gpio", "sourceValve", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.source_valve[0])},
+    {"gpio", "drainValve", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.drain_valve[0])},
+    {"gpio", "growLight", SETTINGS_FIELD_INT, offsetof(settings_t, gpio.grow_light)},
+    {"gpio", "ultrasonicTrigger", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.ultrasonic_trigger[0])},
+    {"gpio", "ultrasonicEcho", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.ultrasonic_echo[0])},
+    {"gpio", "dht", SETTINGS_FIELD_INT, offsetof(settings_t, gpio.dht)},
+};
+
+/* Fields of the entries in {"reservoirs":[{"phAdc":7,"phUpPump":25},...]}, the offsets are those of entry 0. The "gpio"
+ * names above address the first reservoir. */
+static const settings_field_t settings_reservoir_fields[] = {
+    {"reservoirs", "phAdc", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.ph_adc)},
+    {"reservoirs", "tdsAdc", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.tds_adc)},
+    {"reservoirs", "phUpPump", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.ph_up_pump)},
+    {"reservoirs", "phDownPump", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.ph_down_pump)},
+    {"reservoirs", "tdsAPump", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.tds_a_pump)},
+    {"reservoirs", "tdsBPump", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.tds_b_pump)},
+    {"reservoirs", "tankPump", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.tank_pump)},
+    {"reservoirs", "sourceValve", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.source_valve)},
+    {"reservoirs", "drainValve", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.drain_valve)},
+    {"reservoirs", "ultrasonicTrigger", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.ultrasonic_trigger)},
+    {"reservoirs", "ultrasonicEcho", SETTINGS_FIELD_INT, offsetof(settings_t, reservoir.ultrasonic_echo)},
+};
+
+static context_t *context;
+
+static portMUX_TYPE settings_spinlock = portMUX_INITIALIZER_UNLOCKED;
+static settings_t settings;
+
+static esp_err_t settings_validate(const settings_t *value)
+{
+    ARG_CHECK(value->ph.target_min < value->ph.target_max, "ph target range is invalid");
+    ARG_CHECK(value->ph.neutral_voltage != value->ph.acid_voltage, "ph calibration voltages must differ");
+    ARG_CHECK(value->ph.pump_on > 0 && value->ph.pump_on < value->ph.pump_delay, "ph pump durations are invalid");
+    ARG_CHECK(value->tds.vref > 0, "tds vref must be positive");
+    ARG_CHECK(value->tds.pump_on > 0 && value->tds.pump_on < value->tds.pump_delay, "tds pump durations are invalid");
+    ARG_CHECK(value->tank.target_min < value->tank.target_max, "tank target range is invalid");
+
+    /* Every pin but the echo input is driven, GPIO 34 to 39 are input only. */
+    const int32_t *pins = (const int32_t *)&value->gpio;
+    for (int i = 0; i < sizeof(value->gpio) / sizeof(int32_t); i++) {
+        bool input = &pins[i] == &value->gpio.ultrasonic_echo;
+        ARG_CHECK(input ? GPIO_IS_VALID_GPIO(pins[i]) : GPIO_IS_VALID_OUTPUT_GPIO(pins[i]), "invalid gpio %d", pins[i]);
+    }
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        int32_t ph_adc = value->reservoir.ph_adc[channel];
+        int32_t tds_adc = value->reservoir.tds_adc[channel];
+        ARG_CHECK(ph_adc >= -1 && ph_adc < ADC1_CHANNEL_MAX, "invalid ph adc channel %d", ph_adc);
+        ARG_CHECK(tds_adc >= -1 && tds_adc < ADC1_CHANNEL_MAX, "invalid tds adc channel %d", tds_adc);
+        /* The ADC fields lead the table, every pin table follows them and all but the echo pins are outputs. */
+        for (int i = 2; i < sizeof(value->reservoir) / sizeof(value->reservoir.ph_adc); i++) {
+            const int32_t *pin = &((const int32_t *)&value->reservoir)[i * SETTINGS_MAX_RESERVOIRS + channel];
+            bool input = pin == &value->reservoir.ultrasonic_echo[channel];
+            ARG_CHECK(*pin == GPIO_NUM_NC || (input ? GPIO_IS_VALID_GPIO(*pin) : GPIO_IS_VALID_OUTPUT_GPIO(*pin)),
+                      "invalid gpio %d for reservoir %d", *pin, channel);
+        }
+    }
+    return ESP_OK;
+}
+
+static void settings_apply(const settings_t *value)
+{
+    context_set_target_ph(context, value->ph.target_min, value->ph.target_max);
+    context_set_target_tank(context, value->tank.target_min, value->tank.target_max);
+}
+
+/* Loads the stored settings over 'out_settings', which holds the defaults for fields the stored version lacks. */
+static esp_err_t settings_load(settings_t *out_settings, uint16_t *out_version)
+{
+    size_t length = 0;
+    esp_err_t err = storage_get_blob(SETTINGS_KEY, NULL, &length);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (length < sizeof(settings_header_t)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    uint8_t *blob = malloc(length);
+    if (blob == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    err = storage_get_blob(SETTINGS_KEY, blob, &length);
+    if (err == ESP_OK) {
+        settings_header_t header;
+        memcpy(&header, blob, sizeof(header));
+        const uint8_t *payload = blob + sizeof(header);
+        if (header.magic != SETTINGS_MAGIC || header.length != length - sizeof(header)) {
+            err = ESP_ERR_INVALID_SIZE;
+        } else if (header.crc != esp_rom_crc32_le(0, payload, header.length)) {
+            err = ESP_ERR_INVALID_CRC;
+        } else {
+            memcpy(out_settings, payload, MIN(header.length, sizeof(settings_t)));
+            *out_version = header.version;
+        }
+    }
+    free(blob);
+    return err;
+}
+
+/* Version 1 kept the pins of the only reservoir in 'gpio'. */
+static void settings_migrate(settings_t *value, uint16_t version)
+{
+    if (version < 2) {
+        value->reservoir.ph_up_pump[0] = value->gpio.ph_up_pump;
+        value->reservoir.ph_down_pump[0] = value->gpio.ph_down_pump;
+        value->reservoir.tds_a_pump[0] = value->gpio.tds_a_pump;
+        value->reservoir.tds_b_pump[0] = value->gpio.tds_b_pump;
+        value->reservoir.tank_pump[0] = value->gpio.tank_pump;
+        value->reservoir.source_valve[0] = value->gpio.source_valve;
+        value->reservoir.drain_valve[0] = value->gpio.drain_valve;
+        value->reservoir.ultrasonic_trigger[0] = value->gpio.ultrasonic_trigger;
+        value->reservoir.ultrasonic_echo[0] = value->gpio.ultrasonic_echo;
+    }
+}
+
+static esp_err_t settings_save(const settings_t *value)
+{
+    settings_blob_t blob = {
+        .header = {
+            .magic = SETTINGS_MAGIC,
+            .version = SETTINGS_VERSION,
+            .length = sizeof(settings_t),
+            .crc = esp_rom_crc32_le(0, (const uint8_t *)value, sizeof(settings_t)),
+        },
+        .settings = *value,
+    };
+    esp_err_t err = storage_set_blob(SETTINGS_KEY, &blob, sizeof(blob));
+    return err == ESP_OK ? storage_commit() : err;
+}
+
+void settings_get(settings_t *out_settings)
+{
+    portENTER_CRITICAL(&settings_spinlock);
+    *out_settings = settings;
+    portEXIT_CRITICAL(&settings_spinlock);
+}
+
+/* Applies a partial update atomically, either every field in 'json' is taken or none is. GPIO assignments are only
+ * read by the drivers at boot, new ones are persisted and take effect after a restart. */
+esp_err_t settings_update(const cJSON *json)
+{
+    ARG_CHECK(json != NULL, ERR_PARAM_NULL);
+
+    settings_t next;
+    settings_get(&next);
+    for (int i = 0; i < sizeof(settings_fields) / sizeof(settings_fields[0]); i++) {
+        const settings_field_t *field = &settings_fields[i];
+        const cJSON *item = cJSON_GetObjectItem(cJSON_GetObjectItem(json, field->group), field->name);
+        if (item == NULL) {
+            continue;
+        }
+        ARG_CHECK(cJSON_IsNumber(item), "%s.%s must be a number", field->group, field->name);
+        if (field->type == SETTINGS_FIELD_FLOAT) {
+            *(float *)((uint8_t *)&next + field->offset) = (float)item->valuedouble;
+        } else {
+            *(int32_t *)((uint8_t *)&next + field->offset) = (int32_t)item->valueint;
+        }
+    }
+    const cJSON *reservoirs = cJSON_GetObjectItem(json, "reservoirs");
+    ARG_CHECK(reservoirs == NULL || cJSON_IsArray(reservoirs), "reservoirs must be an array");
+    ARG_CHECK(cJSON_GetArraySize(reservoirs) <= CONTEXT_RESERVOIRS, "only %d reservoir(s) configured",
+              CONTEXT_RESERVOIRS);
+    for (int channel = 0; channel < cJSON_GetArraySize(reservoirs); channel++) {
+        const cJSON *reservoir = cJSON_GetArrayItem(reservoirs, channel);
+        for (int i = 0; i < sizeof(settings_reservoir_fields) / sizeof(settings_reservoir_fields[0]); i++) {
+            const settings_field_t *field = &settings_reservoir_fields[i];
+            const cJSON *item = cJSON_GetObjectItem(reservoir, field->name);
+            if (item == NULL) {
+                continue;
+            }
+            ARG_CHECK(cJSON_IsNumber(item), "reservoirs[%d].%s must be a number", channel, field->name);
+            ((int32_t *)((uint8_t *)&next + field->offset))[channel] = (int32_t)item->valueint;
+        }
+    }
+
+    esp_err_t err = settings_validate(&next);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = settings_save(&next);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    portENTER_CRITICAL(&settings_spinlock);
+    next.gpio = settings.gpio;
+    next.reservoir = settings.reservoir;
+    settings = next;
+    portEXIT_CRITICAL(&settings_spinlock);
+    settings_apply(&next);
+    ESP_LOGI(TAG, "Settings updated");
+    return ESP_OK;
+}
+
+esp_err_t settings_init(context_t *ctx)
+{
+    ARG_CHECK(ctx != NULL, ERR_PARAM_NULL);
+
+    context = ctx;
+    settings = settings_defaults;
+    uint16_t version = 0;
+    esp_err_t err = settings_load(&settings, &version);
+    if (err == ESP_OK) {
+        settings_migrate(&settings, version);
+    }
+    if (err == ESP_OK && settings_validate(&settings) != ESP_OK) {
+        err = ESP_ERR_INVALID_STATE;
+    }
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGI(TAG, "No stored settings, using defaults");
+    } else if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Stored settings are unusable, using defaults. err: %s", esp_err_to_name(err));
+        settings = settings_defaults;
+    } else if (version != SETTINGS_VERSION) {
+        ESP_LOGI(TAG, "Migrating settings from version %d to %d", version, SETTINGS_VERSION);
+        ESP_ERROR_CHECK_WITHOUT_ABORT(settings_save(&settings));
+    }
+    settings_apply(&settings);
+    return ESP_OK;
+}
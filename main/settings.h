@@ -0,0 +1,70 @@
+#ifndef HYDROPONICS_SETTINGS_H
+#define HYDROPONICS_SETTINGS_H
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#include "cJSON.h"
+
+#include "context.h"
+
+#define SETTINGS_MAX_RESERVOIRS 4 // (int) Reservoir slots in the stored layout, independent of the configured count
+
+/* Device tunables, persisted as a single blob. New fields must only ever be appended, older blobs are migrated by
+ * keeping their prefix and taking the defaults for the rest. */
+typedef struct {
+    struct {
+        float target_min;
+        float target_max;
+        int32_t neutral_voltage; // Probe voltage in pH 7 buffer, in mV
+        int32_t acid_voltage;    // Probe voltage in pH 4 buffer, in mV
+        int32_t pump_on;         // Dosing pump on duration, in seconds
+        int32_t pump_delay;      // Delay between dosings, in seconds
+    } ph;
+    struct {
+        float vref; // ADC reference voltage, in V
+        int32_t pump_on;
+        int32_t pump_delay;
+    } tds;
+    struct {
+        float target_min; // Tank level, in cm
+        float target_max;
+    } tank;
+    struct {
+        int32_t ph_up_pump;
+        int32_t ph_down_pump;
+        int32_t tds_a_pump;
+        int32_t tds_b_pump;
+        int32_t tank_pump;
+        int32_t source_valve;
+        int32_t drain_valve;
+        int32_t grow_light;
+        int32_t ultrasonic_trigger;
+        int32_t ultrasonic_echo;
+        int32_t dht;
+    } gpio;
+    /* Per reservoir assignments, appended in version 2. Entry 0 takes over the reservoir pins in 'gpio', which are
+     * only read to migrate older blobs. -1 marks an input or output which is not connected. */
+    struct {
+        int32_t ph_adc[SETTINGS_MAX_RESERVOIRS];  // ADC1 channel of the pH probe
+        int32_t tds_adc[SETTINGS_MAX_RESERVOIRS]; // ADC1 channel of the TDS probe
+        int32_t ph_up_pump[SETTINGS_MAX_RESERVOIRS];
+        int32_t ph_down_pump[SETTINGS_MAX_RESERVOIRS];
+        int32_t tds_a_pump[SETTINGS_MAX_RESERVOIRS];
+        int32_t tds_b_pump[SETTINGS_MAX_RESERVOIRS];
+        int32_t tank_pump[SETTINGS_MAX_RESERVOIRS];
+        int32_t source_valve[SETTINGS_MAX_RESERVOIRS];
+        int32_t drain_valve[SETTINGS_MAX_RESERVOIRS];
+        int32_t ultrasonic_trigger[SETTINGS_MAX_RESERVOIRS];
+        int32_t ultrasonic_echo[SETTINGS_MAX_RESERVOIRS];
+    } reservoir;
+} settings_t;
+
+esp_err_t settings_init(context_t *context);
+
+void settings_get(settings_t *out_settings);
+
+esp_err_t settings_update(const cJSON *json);
+
+#endif // HYDROPONICS_SETTINGS_H
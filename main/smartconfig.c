@@ -13,6 +13,7 @@
 
 #include "context.h"
 #include "error.h"
+#include "placement.h"
 #include "smartconfig.h"
 
 static const int GOT_SSID_BIT = BIT0;
@@ -77,6 +78,8 @@ esp_err_t smartconfig_init(context_t *context)
 {
     ARG_CHECK(context != NULL, ERR_PARAM_NULL);
 
-    xTaskCreatePinnedToCore(smartconfig_task, "smartconfig", 4096, context, 3, NULL, tskNO_AFFINITY);
+    xTaskCreatePinnedToCore(smartconfig_task, "smartconfig", 4096, context,
+                            placement_priority(PLACEMENT_TASK_SMARTCONFIG), NULL,
+                            placement_core(PLACEMENT_TASK_SMARTCONFIG));
     return ESP_OK;
 }
\ No newline at end of file
@@ -1,15 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
 #include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 
 #include "context.h"
 #include "error.h"
+#include "placement.h"
 #include "storage.h"
 
+#define STORAGE_MAX_ENTRIES 16
+#define STORAGE_KEY_LENGTH 16      // NVS key length including the terminator
+#define STORAGE_COMMIT_DELAY 5000  // (int) Delay between the first pending write and the commit, in millis
+
+_Static_assert(STORAGE_MAX_ENTRIES <= 32, "the commit tracks the written entries in a 32 bit mask");
+
+typedef enum {
+    STORAGE_TYPE_I64,
+    STORAGE_TYPE_BLOB,
+} storage_type_t;
+
+/* RAM copy of a NVS value. Writes only mark the entry dirty, dirty entries are written and committed together. */
+typedef struct {
+    char key[STORAGE_KEY_LENGTH];
+    storage_type_t type;
+    bool dirty;
+    union {
+        int64_t i64;
+        struct {
+            void *data;
+            size_t length;
+        } blob;
+    } value;
+} storage_entry_t;
+
 static const char *TAG = "storage";
 
 static nvs_handle_t handle;
 
+static storage_entry_t entries[STORAGE_MAX_ENTRIES];
+static int entry_count = 0;
+static SemaphoreHandle_t storage_mutex;
+static esp_timer_handle_t commit_timer;
+static TaskHandle_t commit_task_handle;
+static storage_stats_t stats;
+
+static storage_entry_t *storage_find(const char *key, storage_type_t type)
+{
+    for (int i = 0; i < entry_count; i++) {
+        if (entries[i].type == type && strncmp(entries[i].key, key, STORAGE_KEY_LENGTH) == 0) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+static storage_entry_t *storage_add(const char *key, storage_type_t type)
+{
+    if (entry_count == STORAGE_MAX_ENTRIES) {
+        return NULL;
+    }
+    storage_entry_t *entry = &entries[entry_count++];
+    memset(entry, 0, sizeof(storage_entry_t));
+    strlcpy(entry->key, key, sizeof(entry->key));
+    entry->type = type;
+    return entry;
+}
+
+static esp_err_t storage_write_entry(const storage_entry_t *entry)
+{
+    stats.nvs_writes++;
+    if (entry->type == STORAGE_TYPE_I64) {
+        return nvs_set_i64(handle, entry->key, entry->value.i64);
+    }
+    return nvs_set_blob(handle, entry->key, entry->value.blob.data, entry->value.blob.length);
+}
+
+/* Must be called with the storage mutex held. */
+static void storage_schedule_commit(void)
+{
+    if (!esp_timer_is_active(commit_timer)) {
+        ESP_ERROR_CHECK(esp_timer_start_once(commit_timer, STORAGE_COMMIT_DELAY * 1000));
+    }
+}
+
+esp_err_t storage_commit(void)
+{
+    esp_err_t err = ESP_OK;
+    int written = 0;
+    uint32_t written_mask = 0;
+    xSemaphoreTake(storage_mutex, portMAX_DELAY);
+    for (int i = 0; i < entry_count && err == ESP_OK; i++) {
+        if (entries[i].dirty) {
+            err = storage_write_entry(&entries[i]);
+            entries[i].dirty = err != ESP_OK;
+            if (err == ESP_OK) {
+                written_mask |= 1U << i;
+                written++;
+            }
+        }
+    }
+    if (written > 0 && err == ESP_OK) {
+        err = nvs_commit(handle);
+        if (err == ESP_OK) {
+            stats.commits++;
+            ESP_LOGI(TAG, "Committed %d key(s), %u writes, %u NVS writes, %u commits", written, stats.writes,
+                     stats.nvs_writes, stats.commits);
+        }
+    }
+    if (err != ESP_OK) {
+        /* Uncommitted values may be lost on a reset, the retry writes them again. Entries left dirty would otherwise
+         * wait for the next write. */
+        for (int i = 0; i < entry_count; i++) {
+            entries[i].dirty |= (written_mask & (1U << i)) != 0;
+        }
+        storage_schedule_commit();
+    }
+    xSemaphoreGive(storage_mutex);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Commit failed, retrying in %d ms. err: %s", STORAGE_COMMIT_DELAY, esp_err_to_name(err));
+    }
+    return err;
+}
+
+/* NVS page writes and garbage collection can take tens of millis, the commit must not hold up the other esp_timer
+ * callbacks such as the pump timers. The timer only wakes this task. */
+static void storage_commit_task(void *arg)
+{
+    ARG_UNUSED(arg);
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        storage_commit();
+    }
+}
+
+static void storage_commit_timer_cb(void *arg)
+{
+    ARG_UNUSED(arg);
+    xTaskNotifyGive(commit_task_handle);
+}
+
 esp_err_t storage_init(context_t *context)
 {
     ARG_UNUSED(context);
@@ -22,17 +159,159 @@ esp_err_t storage_init(context_t *context)
     }
     ESP_ERROR_CHECK(err);
     ESP_ERROR_CHECK(nvs_open("storage", NVS_READWRITE, &handle));
+
+    storage_mutex = xSemaphoreCreateMutex();
+    if (storage_mutex == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    const esp_timer_create_args_t commit_timer_args = {
+        .callback = &storage_commit_timer_cb,
+        .name = "storage_commit_timer",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&commit_timer_args, &commit_timer));
+
+    xTaskCreatePinnedToCore(storage_commit_task, "storage", 3072, NULL, placement_priority(PLACEMENT_TASK_STORAGE),
+                            &commit_task_handle, placement_core(PLACEMENT_TASK_STORAGE));
+    if (commit_task_handle == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
     return ESP_OK;
 }
 
 esp_err_t storage_set_i64(const char *key, int64_t value)
 {
-    esp_err_t err = nvs_set_i64(handle, key, value);
-    return err = ESP_OK ? nvs_commit(handle) : err;
+    ARG_CHECK(key != NULL, ERR_PARAM_NULL);
+
+    esp_err_t err = ESP_OK;
+    xSemaphoreTake(storage_mutex, portMAX_DELAY);
+    stats.writes++;
+    storage_entry_t *entry = storage_find(key, STORAGE_TYPE_I64);
+    if (entry == NULL) {
+        entry = storage_add(key, STORAGE_TYPE_I64);
+        if (entry != NULL) {
+            entry->dirty = true;
+        }
+    }
+    if (entry == NULL) {
+        /* Cache is full, write through. */
+        stats.nvs_writes++;
+        stats.commits++;
+        err = nvs_set_i64(handle, key, value);
+        err = err == ESP_OK ? nvs_commit(handle) : err;
+    } else if (entry->dirty || entry->value.i64 != value) {
+        entry->value.i64 = value;
+        entry->dirty = true;
+        storage_schedule_commit();
+    }
+    xSemaphoreGive(storage_mutex);
+    return err;
 }
 
+/* A missing key is not an error, 'out_value' is left untouched in that case. */
 esp_err_t storage_get_i64(const char *key, int64_t *out_value)
 {
-    esp_err_t err = nvs_get_i64(handle, key, out_value);
-    return err = ESP_ERR_NOT_FOUND ? ESP_OK : err;
+    ARG_CHECK(key != NULL && out_value != NULL, ERR_PARAM_NULL);
+
+    esp_err_t err = ESP_OK;
+    xSemaphoreTake(storage_mutex, portMAX_DELAY);
+    storage_entry_t *entry = storage_find(key, STORAGE_TYPE_I64);
+    if (entry != NULL) {
+        *out_value = entry->value.i64;
+    } else {
+        err = nvs_get_i64(handle, key, out_value);
+        if (err == ESP_OK && (entry = storage_add(key, STORAGE_TYPE_I64)) != NULL) {
+            entry->value.i64 = *out_value;
+        }
+    }
+    xSemaphoreGive(storage_mutex);
+    return err == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : err;
+}
+
+esp_err_t storage_set_blob(const char *key, const void *value, size_t length)
+{
+    ARG_CHECK(key != NULL && value != NULL, ERR_PARAM_NULL);
+
+    esp_err_t err = ESP_OK;
+    xSemaphoreTake(storage_mutex, portMAX_DELAY);
+    stats.writes++;
+    storage_entry_t *entry = storage_find(key, STORAGE_TYPE_BLOB);
+    if (entry == NULL) {
+        entry = storage_add(key, STORAGE_TYPE_BLOB);
+        if (entry != NULL) {
+            entry->dirty = true;
+        }
+    }
+    if (entry == NULL) {
+        /* Cache is full, write through. */
+        stats.nvs_writes++;
+        stats.commits++;
+        err = nvs_set_blob(handle, key, value, length);
+        err = err == ESP_OK ? nvs_commit(handle) : err;
+    } else if (entry->dirty || entry->value.blob.length != length || memcmp(entry->value.blob.data, value, length)) {
+        void *data = realloc(entry->value.blob.data, length);
+        if (data == NULL) {
+            err = ESP_ERR_NO_MEM;
+        } else {
+            memcpy(data, value, length);
+            entry->value.blob.data = data;
+            entry->value.blob.length = length;
+            entry->dirty = true;
+            storage_schedule_commit();
+        }
+    }
+    xSemaphoreGive(storage_mutex);
+    return err;
+}
+
+/* Same contract as nvs_get_blob: '*length' is the buffer size on input and the blob size on output. */
+esp_err_t storage_get_blob(const char *key, void *out_value, size_t *length)
+{
+    ARG_CHECK(key != NULL && length != NULL, ERR_PARAM_NULL);
+
+    esp_err_t err = ESP_OK;
+    xSemaphoreTake(storage_mutex, portMAX_DELAY);
+    storage_entry_t *entry = storage_find(key, STORAGE_TYPE_BLOB);
+    if (entry == NULL) {
+        size_t stored_length = 0;
+        err = nvs_get_blob(handle, key, NULL, &stored_length);
+        void *data = err == ESP_OK ? malloc(stored_length) : NULL;
+        if (err == ESP_OK && data == NULL) {
+            err = ESP_ERR_NO_MEM;
+        }
+        if (err == ESP_OK) {
+            err = nvs_get_blob(handle, key, data, &stored_length);
+        }
+        if (err == ESP_OK && (entry = storage_add(key, STORAGE_TYPE_BLOB)) != NULL) {
+            entry->value.blob.data = data;
+            entry->value.blob.length = stored_length;
+        } else if (err == ESP_OK) {
+            /* Cache is full, hand out the value without keeping it. */
+            if (out_value != NULL && *length < stored_length) {
+                err = ESP_ERR_NVS_INVALID_LENGTH;
+            } else if (out_value != NULL) {
+                memcpy(out_value, data, stored_length);
+            }
+            *length = stored_length;
+            free(data);
+        } else {
+            free(data);
+        }
+    }
+    if (entry != NULL) {
+        if (out_value != NULL && *length < entry->value.blob.length) {
+            err = ESP_ERR_NVS_INVALID_LENGTH;
+        } else if (out_value != NULL) {
+            memcpy(out_value, entry->value.blob.data, entry->value.blob.length);
+        }
+        *length = entry->value.blob.length;
+    }
+    xSemaphoreGive(storage_mutex);
+    return err;
+}
+
+void storage_get_stats(storage_stats_t *out_stats)
+{
+    xSemaphoreTake(storage_mutex, portMAX_DELAY);
+    *out_stats = stats;
+    xSemaphoreGive(storage_mutex);
 }
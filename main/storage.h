@@ -1,14 +1,31 @@
 #ifndef HYDROPONICS_STORAGE_H
 #define HYDROPONICS_STORAGE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "esp_err.h"
 
 #include "context.h"
 
+typedef struct {
+    uint32_t writes;     // Values written through the storage API
+    uint32_t nvs_writes; // Values actually written to NVS
+    uint32_t commits;    // NVS commits
+} storage_stats_t;
+
 esp_err_t storage_init(context_t *context);
 
 esp_err_t storage_set_i64(const char *key, int64_t value);
 
 esp_err_t storage_get_i64(const char *key, int64_t *out_value);
 
+esp_err_t storage_set_blob(const char *key, const void *value, size_t length);
+
+esp_err_t storage_get_blob(const char *key, void *out_value, size_t *length);
+
+esp_err_t storage_commit(void);
+
+void storage_get_stats(storage_stats_t *out_stats);
+
 #endif // HYDROPONICS_STORAGE_H
@@ -5,128 +5,192 @@
 
 #include "esp_err.h"
 #include "esp_log.h"
-#include "esp_system.h"
 #include "esp_timer.h"
 
 #include "ultrasonic.h"
 
+#include "actuator.h"
 #include "context.h"
+#include "cycle.h"
 #include "error.h"
+#include "placement.h"
+#include "power.h"
+#include "settings.h"
 #include "tank.h"
-
-#define TRIGGER_GPIO 2
-#define ECHO_GPIO 15
-
-#define SOURCE_VALVE_GPIO 22
-#define DRAIN_VALVE_GPIO 23
-#define TANK_PUMP_GPIO 5
-#define TANK_GPIO_MASK ((1ULL << TANK_PUMP_GPIO) | (1ULL << SOURCE_VALVE_GPIO) | (1ULL << DRAIN_VALVE_GPIO))
+#include "tlog.h"
 
 #define TANK_HEIGHT_CM 27.5
 #define MAX_DISTANCE 5
 #define NO_OF_SAMPLES 10
+#define TANK_DRAINED_CM 18     // (float) Level under which a tank counts as drained
+#define TANK_PERIOD 5000       // (int) Control pass period, in millis
+#define TANK_FAST_PERIOD 1000  // (int) Control pass period while filling or draining, in millis
+#define TANK_DRAIN_TIMEOUT 900 // (int) Time the tanks have to drain before the cycle gives up, in seconds
+
+#define TANK_OUTPUTS \
+    (ACTUATOR_BIT(ACTUATOR_TANK_PUMP) | ACTUATOR_BIT(ACTUATOR_SOURCE_VALVE) | ACTUATOR_BIT(ACTUATOR_DRAIN_VALVE))
 
 static const char *TAG = "tank";
 
-static ultrasonic_sensor_t hcsr04;
+/* GPIO_NUM_NC marks a reservoir without a level sensor. */
+static ultrasonic_sensor_t hcsr04[CONTEXT_RESERVOIRS];
 
-void tank_drain_task(void *arg)
+static bool tank_has_sensor(int channel)
 {
-    context_t *context = (context_t *)arg;
-
-    ESP_ERROR_CHECK(gpio_set_level(TANK_PUMP_GPIO, 0));
-    ESP_ERROR_CHECK(gpio_set_level(SOURCE_VALVE_GPIO, 0));
+    return hcsr04[channel].trigger_pin != GPIO_NUM_NC && hcsr04[channel].echo_pin != GPIO_NUM_NC;
+}
 
-    while (true) {
-        esp_err_t err;
-        float distance;
-        float running_sample = 0;
-        for (int i = 0; i < NO_OF_SAMPLES; i++) {
-            err = ultrasonic_measure(&hcsr04, MAX_DISTANCE, &distance);
-            if (err != ESP_OK) {
+/* Measures the level of every reservoir with a sensor, the sensors are triggered in turn within each round.
+ * 'out_valid' tells which levels were measured. */
+static void tank_measure(context_t *context, bool *out_valid)
+{
+    float running_sample[CONTEXT_RESERVOIRS] = {0};
+    int samples[CONTEXT_RESERVOIRS] = {0};
+    esp_err_t err[CONTEXT_RESERVOIRS] = {ESP_OK};
+    for (int i = 0; i < NO_OF_SAMPLES; i++) {
+        for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+            if (!tank_has_sensor(channel)) {
                 continue;
             }
-            running_sample += distance;
-            vTaskDelay(pdMS_TO_TICKS(200));
-        }
-        if (err == ESP_OK) {
-            float average = TANK_HEIGHT_CM - (running_sample * 100 / NO_OF_SAMPLES);
-            ESP_ERROR_CHECK(context_set_tank(context, average));
-            ESP_LOGI(TAG, "Tank level = %.02f cm", average);
-            if (average >= 18) {
-                ESP_ERROR_CHECK(gpio_set_level(DRAIN_VALVE_GPIO, 1));
-            } else {
-                ESP_LOGI(TAG, "Drain complete");
-                ESP_ERROR_CHECK(gpio_set_level(DRAIN_VALVE_GPIO, 0));
-                ESP_LOGI(TAG, "Restarting in 5 seconds...");
-                vTaskDelay(pdMS_TO_TICKS(5000));
-                esp_restart();
+            float distance;
+            power_acquire(POWER_LOCK_TIMING);
+            err[channel] = ultrasonic_measure(&hcsr04[channel], MAX_DISTANCE, &distance);
+            power_release(POWER_LOCK_TIMING);
+            if (err[channel] == ESP_OK) {
+                running_sample[channel] += distance;
+                samples[channel]++;
             }
+        }
+        vTaskDelay(pdMS_TO_TICKS(200));
+    }
+
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        out_valid[channel] = tank_has_sensor(channel) && err[channel] == ESP_OK;
+        if (!tank_has_sensor(channel)) {
+            continue;
+        }
+        if (err[channel] != ESP_OK) {
+            ESP_LOGE(TAG, "%d: Tank level measure failed, error 0x%X", channel, err[channel]);
+            continue;
+        }
+        float average = TANK_HEIGHT_CM - (running_sample[channel] * 100 / samples[channel]);
+        ESP_ERROR_CHECK(context_set_tank(context, channel, average));
+        TLOGI(TAG, "%d: Tank level = %.02f cm", channel, average);
+    }
+}
+
+/* Empties the tanks, returns true once every tank is drained and its outputs are closed. */
+static bool tank_drain(context_t *context, const bool *valid)
+{
+    bool drained = true;
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        if (!valid[channel]) {
+            /* Stop filling, but keep the drain valve as it is until the level is known again. */
+            actuator_set(channel, ACTUATOR_BIT(ACTUATOR_TANK_PUMP) | ACTUATOR_BIT(ACTUATOR_SOURCE_VALVE), 0);
+            drained &= !tank_has_sensor(channel);
+        } else if (context->sensors.tank.value[channel] >= TANK_DRAINED_CM) {
+            actuator_set(channel, TANK_OUTPUTS, ACTUATOR_BIT(ACTUATOR_DRAIN_VALVE));
+            drained = false;
         } else {
-            ESP_LOGE(TAG, "Tank level measure failed, error 0x%X", err);
+            /* A valve within its minimum on time closes on a later pass. */
+            drained &= actuator_set(channel, TANK_OUTPUTS, 0) == ESP_OK;
         }
-        vTaskDelay(pdMS_TO_TICKS(1000));
     }
+    return drained;
 }
 
+/* Keeps the tanks between their targets, returns true when every tank is at least at its minimum level. */
+static bool tank_regulate(context_t *context, const bool *valid)
+{
+    bool filled = true;
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        if (!valid[channel]) {
+            continue;
+        }
+        float level = context->sensors.tank.value[channel];
+        uint32_t levels = ACTUATOR_BIT(ACTUATOR_TANK_PUMP);
+        if (level < context->sensors.tank.target_min) {
+            levels = ACTUATOR_BIT(ACTUATOR_SOURCE_VALVE);
+            filled = false;
+        } else if (level > context->sensors.tank.target_max) {
+            levels = ACTUATOR_BIT(ACTUATOR_DRAIN_VALVE);
+        }
+        /* Only changed outputs are written. Changes held back by a minimum on or off time or an interlock are
+         * retried on the next pass. */
+        if (actuator_set(channel, TANK_OUTPUTS, levels) != ESP_OK) {
+            ESP_LOGD(TAG, "%d: outputs held back", channel);
+        }
+    }
+    return filled;
+}
+
+/* Applies the cycle state to the tank outputs, the tank task is the control job acknowledging cycle transitions. */
 static void tank_task(void *arg)
 {
     context_t *context = (context_t *)arg;
-
-    /* Waiting for cycle to be started */
-    // xEventGroupWaitBits(context->event_group, CONTEXT_EVENT_CYCLE, pdFALSE, pdTRUE, portMAX_DELAY);
+    bool valid[CONTEXT_RESERVOIRS];
+    int64_t draining_since = 0; // esp_timer time of the first draining pass, 0 when not draining
+    tank_measure(context, valid);
 
     while (true) {
-        esp_err_t err;
-        float distance;
-        float running_sample = 0;
-        for (int i = 0; i < NO_OF_SAMPLES; i++) {
-            err = ultrasonic_measure(&hcsr04, MAX_DISTANCE, &distance);
-            if (err != ESP_OK) {
-                continue;
+        cycle_state_t state = cycle_get_state();
+        switch (state) {
+        case CYCLE_STATE_IDLE:
+            for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+                actuator_set(channel, TANK_OUTPUTS, 0);
             }
-            running_sample += distance;
-            vTaskDelay(pdMS_TO_TICKS(200));
-        }
-        if (err == ESP_OK) {
-            float average = TANK_HEIGHT_CM - (running_sample * 100 / NO_OF_SAMPLES);
-            ESP_ERROR_CHECK(context_set_tank(context, average));
-            ESP_LOGI(TAG, "Tank level = %.02f cm", average);
-            if (context->cycle.initialized) {
-                if (average < context->sensors.tank.target_min) {
-                    ESP_ERROR_CHECK(gpio_set_level(TANK_PUMP_GPIO, 0));
-                    ESP_ERROR_CHECK(gpio_set_level(SOURCE_VALVE_GPIO, 1));
-                    ESP_ERROR_CHECK(gpio_set_level(DRAIN_VALVE_GPIO, 0));
-                } else if (average > context->sensors.tank.target_max) {
-                    ESP_ERROR_CHECK(gpio_set_level(TANK_PUMP_GPIO, 0));
-                    ESP_ERROR_CHECK(gpio_set_level(SOURCE_VALVE_GPIO, 0));
-                    ESP_ERROR_CHECK(gpio_set_level(DRAIN_VALVE_GPIO, 1));
-                } else {
-                    ESP_ERROR_CHECK(gpio_set_level(TANK_PUMP_GPIO, 1));
-                    ESP_ERROR_CHECK(gpio_set_level(SOURCE_VALVE_GPIO, 0));
-                    ESP_ERROR_CHECK(gpio_set_level(DRAIN_VALVE_GPIO, 0));
+            break;
+        case CYCLE_STATE_FILLING:
+            if (tank_regulate(context, valid)) {
+                cycle_filled();
+            }
+            break;
+        case CYCLE_STATE_RUNNING:
+            tank_regulate(context, valid);
+            break;
+        case CYCLE_STATE_DRAINING:
+            if (draining_since == 0) {
+                draining_since = esp_timer_get_time();
+            }
+            if (tank_drain(context, valid)) {
+                cycle_drained();
+            } else if (esp_timer_get_time() - draining_since > TANK_DRAIN_TIMEOUT * 1000000LL) {
+                /* Outputs held back by their minimum on time are closed by the idle passes. */
+                for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+                    actuator_set(channel, TANK_OUTPUTS, 0);
                 }
+                cycle_drain_failed();
             }
-        } else {
-            ESP_LOGE(TAG, "Tank level measure failed, error 0x%X", err);
+            break;
+        default:
+            break;
+        }
+        cycle_acknowledge(state);
+        if (state != CYCLE_STATE_DRAINING) {
+            draining_since = 0;
+        }
+
+        /* A cycle transition wakes the task early, it is applied with the last levels before measuring again. */
+        bool settling = state == CYCLE_STATE_FILLING || state == CYCLE_STATE_DRAINING;
+        TickType_t delay = pdMS_TO_TICKS(settling ? TANK_FAST_PERIOD : TANK_PERIOD);
+        if (ulTaskNotifyTake(pdTRUE, delay) == 0) {
+            tank_measure(context, valid);
         }
-        vTaskDelay(pdMS_TO_TICKS(5000));
     }
 }
 
 void driver_init(void)
 {
-    hcsr04.trigger_pin = TRIGGER_GPIO;
-    hcsr04.echo_pin = ECHO_GPIO;
-    ultrasonic_init(&hcsr04);
-
-    gpio_config_t config = {
-        .intr_type = GPIO_INTR_DISABLE,
-        .mode = GPIO_MODE_OUTPUT,
-        .pin_bit_mask = TANK_GPIO_MASK,
-        .pull_up_en = 1,
-    };
-    gpio_config(&config);
+    settings_t settings;
+    settings_get(&settings);
+
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        hcsr04[channel].trigger_pin = settings.reservoir.ultrasonic_trigger[channel];
+        hcsr04[channel].echo_pin = settings.reservoir.ultrasonic_echo[channel];
+        if (tank_has_sensor(channel)) {
+            ultrasonic_init(&hcsr04[channel]);
+        }
+    }
 }
 
 esp_err_t tank_init(context_t *context)
@@ -135,6 +199,7 @@ esp_err_t tank_init(context_t *context)
 
     driver_init();
 
-    xTaskCreatePinnedToCore(tank_task, "tank", 4096, context, 5, &context->sensors.tank.task_handle, tskNO_AFFINITY);
+    xTaskCreatePinnedToCore(tank_task, "tank", 4096, context, placement_priority(PLACEMENT_TASK_TANK),
+                            &context->sensors.tank.task_handle, placement_core(PLACEMENT_TASK_TANK));
     return ESP_OK;
 }
@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/param.h>
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 
 #include "esp_log.h"
@@ -9,70 +11,102 @@
 #include "esp_system.h"
 
 #include "driver/adc.h"
-#include "driver/gpio.h"
 #include "esp_adc_cal.h"
 #include "esp_timer.h"
 
+#include "actuator.h"
+#include "calibration.h"
+#include "checkpoint.h"
 #include "context.h"
+#include "cycle.h"
 #include "mqtt.h"
+#include "placement.h"
+#include "power.h"
+#include "settings.h"
 #include "tds.h"
+#include "tlog.h"
 
 #define DEFAULT_VREF 1100
 
 #define TDS_NUM_SAMPLES 32   // (int) Number of reading to take for an average
 #define TDS_SAMPLE_DELAY 50  // (int) Sample period (delay between samples == sample period / number of readings)
 #define TDS_TEMPERATURE 25.0 // (float) Temperature of water (we should measure this with a sensor to get an accurate reading)
-#define TDS_VREF 2.28        // (float) Voltage reference for ADC. We should measure the actual value of each ESP32
-
-#define TDS_ANALOG_GPIO ADC1_CHANNEL_0 // GPIO 36
-
-#define TDS_A_PUMP_GPIO 16
-#define TDS_B_PUMP_GPIO 17
-#define PUMP_GPIO_MASK ((1ULL << TDS_A_PUMP_GPIO) | (1ULL << TDS_B_PUMP_GPIO))
 
 static const char *TAG = "tds";
 
 static esp_adc_cal_characteristics_t adc1_chars;
 
-static esp_timer_handle_t tds_pump_on_timer;
-static esp_timer_handle_t tds_pump_delay_timer;
+#define TDS_PUMPS (ACTUATOR_BIT(ACTUATOR_TDS_A_PUMP) | ACTUATOR_BIT(ACTUATOR_TDS_B_PUMP))
+
+/* Per reservoir tables, a negative ADC channel marks a reservoir without a probe. */
+static int32_t tds_adc_channel[CONTEXT_RESERVOIRS];
+static int64_t pump_off_at[CONTEXT_RESERVOIRS];   // esp_timer time the running dose ends, 0 while no pump runs
+static int64_t pump_ready_at[CONTEXT_RESERVOIRS]; // esp_timer time the next dose is allowed
 
-static bool is_pump_ready = true;
+/* A single timer serves every reservoir, it is armed for the earliest pump which has to stop. */
+static SemaphoreHandle_t tds_pump_mutex;
+static esp_timer_handle_t tds_pump_timer;
 
 static void tds_config_pin()
 {
+    settings_t settings;
+    settings_get(&settings);
+
     esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_DEFAULT, DEFAULT_VREF, &adc1_chars);
     ESP_ERROR_CHECK(adc1_config_width(ADC_WIDTH_BIT_DEFAULT));
-    ESP_ERROR_CHECK(adc1_config_channel_atten(TDS_ANALOG_GPIO, ADC_ATTEN_DB_11));
 
-    gpio_config_t config = {
-        .intr_type = GPIO_INTR_DISABLE,
-        .mode = GPIO_MODE_OUTPUT,
-        .pin_bit_mask = PUMP_GPIO_MASK,
-        .pull_up_en = 1,
-    };
-    gpio_config(&config);
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        tds_adc_channel[channel] = settings.reservoir.tds_adc[channel];
+        if (tds_adc_channel[channel] >= 0) {
+            ESP_ERROR_CHECK(adc1_config_channel_atten(tds_adc_channel[channel], ADC_ATTEN_DB_11));
+        }
+    }
+}
+
+/* Nutrients A and B are always dosed together, a reservoir doses only with both pumps connected. */
+static bool tds_has_pumps(int channel)
+{
+    return actuator_is_connected(ACTUATOR_TDS_A_PUMP, channel) && actuator_is_connected(ACTUATOR_TDS_B_PUMP, channel);
 }
 
-static float tds_read(int elapsed_days)
+/* Averages TDS_NUM_SAMPLES raw samples of every connected probe, sampling the probes in turn within each round. */
+static void tds_read(float *out_raw)
 {
-    uint32_t runningSampleValue = 0;
+    uint32_t running_sample[CONTEXT_RESERVOIRS] = {0};
     for (int i = 0; i < TDS_NUM_SAMPLES; i++) {
-        int analogSample = adc1_get_raw(TDS_ANALOG_GPIO);
-        runningSampleValue = runningSampleValue + analogSample;
+        power_acquire(POWER_LOCK_ADC);
+        for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+            if (tds_adc_channel[channel] >= 0) {
+                running_sample[channel] += adc1_get_raw(tds_adc_channel[channel]);
+            }
+        }
+        power_release(POWER_LOCK_ADC);
         vTaskDelay(pdMS_TO_TICKS(TDS_SAMPLE_DELAY));
     }
 
-    float tdsAverage = runningSampleValue / TDS_NUM_SAMPLES;
-    uint32_t adcVoltage = esp_adc_cal_raw_to_voltage(tdsAverage, &adc1_chars);
-    ESP_LOGI(TAG, "raw = %.f, voltage = %d", tdsAverage, adcVoltage);
-    return tdsAverage;
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        out_raw[channel] = running_sample[channel] / TDS_NUM_SAMPLES;
+        uint32_t adcVoltage = esp_adc_cal_raw_to_voltage(out_raw[channel], &adc1_chars);
+        TLOGI(TAG, "%d: raw = %.f, voltage = %d", channel, out_raw[channel], adcVoltage);
+    }
+}
+
+/* Single calibrated sample, used by the calibration to watch the reading settle. */
+uint32_t tds_sample_voltage(int channel)
+{
+    if (tds_adc_channel[channel] < 0) {
+        return 0;
+    }
+    power_acquire(POWER_LOCK_ADC);
+    int adc_sample = adc1_get_raw(tds_adc_channel[channel]);
+    power_release(POWER_LOCK_ADC);
+    return esp_adc_cal_raw_to_voltage(adc_sample, &adc1_chars);
 }
 
-static float tds_convert_to_ppm(float analogReading)
+static float tds_convert_to_ppm(float analogReading, float vref)
 {
     float adcCompensation = 1 + (1 / 3.9);                                 // 1/3.9 (11dB) attenuation.
-    float vPerDiv = (TDS_VREF / 4096) * adcCompensation;                   // Calculate the volts per division using the VREF taking account of the chosen attenuation value.
+    float vPerDiv = (vref / 4096) * adcCompensation;                       // Calculate the volts per division using the VREF taking account of the chosen attenuation value.
     float averageVoltage = analogReading * vPerDiv;                        // Convert the ADC reading into volts
     float compensationCoefficient = 1.0 + 0.02 * (TDS_TEMPERATURE - 25.0); // temperature compensation formula: fFinalResult(25^C) = fFinalResult(current)/(1.0+0.02*(fTP-25.0));
     float compensationVolatge = averageVoltage / compensationCoefficient;  // temperature compensation
@@ -81,79 +115,136 @@ static float tds_convert_to_ppm(float analogReading)
                       (857.39 * compensationVolatge)) *
                      0.48; // convert voltage value to tds value
 
-    ESP_LOGI(TAG, "averageVoltage = %f", averageVoltage);
+    TLOGD(TAG, "averageVoltage = %f", averageVoltage);
     return tdsValue;
 }
 
+/* Stops the pumps whose dose is over, then arms the timer for the next one to stop. */
+static void tds_pump_rearm_locked(int64_t now)
+{
+    esp_timer_stop(tds_pump_timer);
+    int64_t next_off = INT64_MAX;
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        if (pump_off_at[channel] == 0) {
+            continue;
+        }
+        if (pump_off_at[channel] <= now) {
+            actuator_set(channel, TDS_PUMPS, 0);
+            pump_off_at[channel] = 0;
+            ESP_LOGI(TAG, "%d: pump stop", channel);
+        } else {
+            next_off = MIN(next_off, pump_off_at[channel]);
+        }
+    }
+    if (next_off != INT64_MAX) {
+        ESP_ERROR_CHECK(esp_timer_start_once(tds_pump_timer, next_off - now));
+    }
+}
+
+static void tds_dose(int channel, int64_t pump_on, int64_t pump_delay)
+{
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(tds_pump_mutex, portMAX_DELAY);
+    if (actuator_set(channel, TDS_PUMPS, TDS_PUMPS) != ESP_OK) {
+        /* Never leave one of the two running alone. */
+        actuator_set(channel, TDS_PUMPS, 0);
+        xSemaphoreGive(tds_pump_mutex);
+        ESP_LOGW(TAG, "%d: pumps held back, dosing on the next pass", channel);
+        return;
+    }
+    pump_off_at[channel] = now + pump_on;
+    pump_ready_at[channel] = now + pump_delay;
+    tds_pump_rearm_locked(now);
+    xSemaphoreGive(tds_pump_mutex);
+
+    checkpoint_set_pump_ready_at(CHECKPOINT_PUMP_TDS, channel, now + pump_delay);
+    mqtt_publish_channel_state("PUMP_TDS_A_B", channel);
+}
+
 static void tds_task(void *arg)
 {
     context_t *context = (context_t *)arg;
 
-    /* Waiting for tank level measurement */
-    // xEventGroupWaitBits(context->event_group, CONTEXT_EVENT_TANK, pdFALSE, pdTRUE, portMAX_DELAY);
-    vTaskDelay(pdMS_TO_TICKS(10000));
+    /* Waiting for tank level measurement, dosing is gated on the tank level anyway. */
+    xEventGroupWaitBits(context->event_group, CONTEXT_EVENT_TANK, pdFALSE, pdTRUE, pdMS_TO_TICKS(10000));
 
     while (true) {
-        float sensorReading = tds_read(context->cycle.elapsed_days);
-        float tdsResult = tds_convert_to_ppm(sensorReading);
-        tdsResult += context->sensors.tds.constant;
-        ESP_ERROR_CHECK(context_set_tds(context, tdsResult));
-        ESP_LOGE(TAG, "value: %.02f ppm", tdsResult);
-
-        if (context->cycle.initialized) {
-            if (context->sensors.tank.value >= context->sensors.tank.target_min &&
-                context->sensors.tank.value <= context->sensors.tank.target_max) {
-                if (tdsResult < context->sensors.tds.target_min) {
-                    if (is_pump_ready) {
-                        ESP_LOGW(TAG, "TDS < %.02f, starting TDS A and B pump...", context->sensors.tds.target_min);
-                        gpio_set_level(TDS_A_PUMP_GPIO, 1);
-                        gpio_set_level(TDS_B_PUMP_GPIO, 1);
-                        ESP_ERROR_CHECK(esp_timer_start_once(tds_pump_on_timer, 1000000 * 5));
-                        ESP_ERROR_CHECK(esp_timer_start_once(tds_pump_delay_timer, 1000000 * 20));
-                        mqtt_publish_state("PUMP_TDS_A_B");
-                        is_pump_ready = false;
-                    }
-                }
-            } else {
-                ESP_LOGW(TAG, "Waiting for tank level to be set");
+        /* The probe sits in a calibration solution while it is calibrated. */
+        if (calibration_is_active(CALIBRATION_PROBE_TDS)) {
+            vTaskDelay(pdMS_TO_TICKS(2000));
+            continue;
+        }
+
+        settings_t settings;
+        settings_get(&settings);
+        int64_t pump_on = 1000000LL * settings.tds.pump_on;
+        int64_t pump_delay = 1000000LL * settings.tds.pump_delay;
+
+        float sensorReadings[CONTEXT_RESERVOIRS];
+        tds_read(sensorReadings);
+        for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+            if (tds_adc_channel[channel] < 0) {
+                continue;
+            }
+            float tdsResult;
+            uint32_t voltage = esp_adc_cal_raw_to_voltage(sensorReadings[channel], &adc1_chars);
+            if (calibration_apply(CALIBRATION_PROBE_TDS, channel, voltage, &tdsResult) != ESP_OK) {
+                tdsResult = tds_convert_to_ppm(sensorReadings[channel], settings.tds.vref);
+            }
+            tdsResult += context->sensors.tds.constant[channel];
+            ESP_ERROR_CHECK(context_set_tds(context, channel, tdsResult));
+            TLOGI(TAG, "%d: value: %.02f ppm", channel, tdsResult);
+
+            if (cycle_get_state() != CYCLE_STATE_RUNNING || esp_timer_get_time() < pump_ready_at[channel]) {
+                continue;
+            }
+            if (!context_tank_in_range(context, channel)) {
+                TLOGW(TAG, "%d: Waiting for tank level to be set", channel);
+            } else if (tdsResult < context->sensors.tds.target_min && tds_has_pumps(channel)) {
+                ESP_LOGW(TAG, "%d: TDS < %.02f, starting TDS A and B pump...", channel,
+                         context->sensors.tds.target_min);
+                tds_dose(channel, pump_on, pump_delay);
             }
         }
         vTaskDelay(pdMS_TO_TICKS(2000));
     }
 }
 
-static void pump_on_timer_cb(void *arg)
-{
-    gpio_set_level(TDS_A_PUMP_GPIO, 0);
-    gpio_set_level(TDS_B_PUMP_GPIO, 0);
-    ESP_LOGI(TAG, "pump stop");
-}
-
-static void pump_delay_timer_cb(void *arg)
+static void tds_pump_timer_cb(void *arg)
 {
-    is_pump_ready = true;
-    ESP_LOGI(TAG, "pump ready");
+    xSemaphoreTake(tds_pump_mutex, portMAX_DELAY);
+    tds_pump_rearm_locked(esp_timer_get_time());
+    xSemaphoreGive(tds_pump_mutex);
 }
 
 static void tds_init_timer(void)
 {
-    const esp_timer_create_args_t pump_on_timer_args = {
-        .callback = &pump_on_timer_cb,
-        .name = "tds_pump_on_timer",
+    const esp_timer_create_args_t pump_timer_args = {
+        .callback = &tds_pump_timer_cb,
+        .name = "tds_pump_timer",
     };
-    ESP_ERROR_CHECK(esp_timer_create(&pump_on_timer_args, &tds_pump_on_timer));
-
-    const esp_timer_create_args_t pump_delay_timer_args = {
-        .callback = &pump_delay_timer_cb,
-        .name = "tds_pump_delay_timer",
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&pump_delay_timer_args, &tds_pump_delay_timer));
+    ESP_ERROR_CHECK(esp_timer_create(&pump_timer_args, &tds_pump_timer));
 }
 
 esp_err_t tds_init(context_t *context)
 {
+    tds_pump_mutex = xSemaphoreCreateMutex();
+    if (tds_pump_mutex == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
     tds_config_pin();
     tds_init_timer();
-    xTaskCreatePinnedToCore(tds_task, "tds", 4096, context, 5, &context->sensors.tds.task_handle, tskNO_AFFINITY);
+
+    /* Keep honouring the dosing lockout from before a warm restart. */
+    int64_t now = esp_timer_get_time();
+    for (int channel = 0; channel < CONTEXT_RESERVOIRS; channel++) {
+        int64_t lockout = checkpoint_get_pump_lockout(CHECKPOINT_PUMP_TDS, channel);
+        if (lockout > 0) {
+            pump_ready_at[channel] = now + lockout;
+            checkpoint_set_pump_ready_at(CHECKPOINT_PUMP_TDS, channel, now + lockout);
+        }
+    }
+    xTaskCreatePinnedToCore(tds_task, "tds", 4096, context, placement_priority(PLACEMENT_TASK_TDS),
+                            &context->sensors.tds.task_handle, placement_core(PLACEMENT_TASK_TDS));
     return ESP_OK;
 }
@@ -1,10 +1,14 @@
 #ifndef HYDROPONICS_TDS_H
 #define HYDROPONICS_TDS_H
 
+#include <stdint.h>
+
 #include "esp_err.h"
 
 #include "context.h"
 
+uint32_t tds_sample_voltage(int channel);
+
 esp_err_t tds_init(context_t *context);
 
-#endif // HYDROPONICS_PH_H
+#endif // HYDROPONICS_TDS_H
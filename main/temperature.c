@@ -9,9 +9,11 @@
 
 #include "context.h"
 #include "error.h"
+#include "placement.h"
+#include "power.h"
+#include "settings.h"
 #include "temperature.h"
-
-#define DHT22_DATA_GPIO 26
+#include "tlog.h"
 
 static const char *TAG = "temperature";
 
@@ -20,13 +22,19 @@ static void temperature_task(void *arg)
     context_t *context = (context_t *)arg;
     ARG_ERROR_CHECK(context != NULL, ERR_PARAM_NULL);
 
+    settings_t settings;
+    settings_get(&settings);
+    gpio_num_t dht_gpio = settings.gpio.dht;
+
     esp_err_t err;
     float temperature, humidity;
     while (true) {
-        err = dht_read_float_data(DHT_TYPE_AM2301, DHT22_DATA_GPIO, &humidity, &temperature);
+        power_acquire(POWER_LOCK_TIMING);
+        err = dht_read_float_data(DHT_TYPE_AM2301, dht_gpio, &humidity, &temperature);
+        power_release(POWER_LOCK_TIMING);
         if (err == ESP_OK) {
             context_set_temp_humidity(context, temperature, humidity);
-            ESP_LOGI(TAG, "Temperature: %.1fC Humidity: %.1f%%", temperature, humidity);
+            TLOGI(TAG, "Temperature: %.1fC Humidity: %.1f%%", temperature, humidity);
         } else {
             ESP_LOGE(TAG, "Temperature humidity measure failed, error 0x%X", err);
         }
@@ -38,6 +46,8 @@ esp_err_t temperature_init(context_t *context)
 {
     ARG_CHECK(context != NULL, ERR_PARAM_NULL);
 
-    xTaskCreatePinnedToCore(temperature_task, "temperature", 2048, context, 11, NULL, tskNO_AFFINITY);
+    xTaskCreatePinnedToCore(temperature_task, "temperature", 2048, context,
+                            placement_priority(PLACEMENT_TASK_TEMPERATURE), NULL,
+                            placement_core(PLACEMENT_TASK_TEMPERATURE));
     return ESP_OK;
 }
@@ -0,0 +1,180 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "context.h"
+#include "error.h"
+#include "placement.h"
+#include "tlog.h"
+
+#define TLOG_RING_SIZE 128     // (int) Number of records, must be a power of two
+#define TLOG_MAX_ARGS 4        // (int) Argument words per record
+#define TLOG_DRAIN_PERIOD 1000 // (int) Drain period in millis
+#define TLOG_LINE_RECORDS 8    // (int) Records per output line
+
+#define TLOG_LINE_PREFIX "TLOG:"
+
+/* One 32 byte slot of the ring. 'seq' is written last, it holds the producer's ticket + 1 once the record is complete,
+ * which lets the drain tell a finished record from one that is still being written or was already overwritten. */
+typedef struct {
+    uint32_t fmt;  // Address of the format string
+    uint32_t tag;  // Address of the tag
+    uint32_t meta; // Level in the top 4 bits, esp_log_timestamp() in the rest
+    uint32_t args[TLOG_MAX_ARGS];
+    volatile uint32_t seq;
+} tlog_record_t;
+
+_Static_assert((TLOG_RING_SIZE & (TLOG_RING_SIZE - 1)) == 0, "TLOG_RING_SIZE must be a power of two");
+
+static const char *TAG = "tlog";
+
+static tlog_record_t ring[TLOG_RING_SIZE];
+static uint32_t head = 0;
+static uint32_t tail = 0;
+static uint32_t dropped = 0;
+
+/* Lock-free for any number of producers on both cores: a slot is claimed with an atomic increment and published by
+ * the release store of its sequence number. The arguments are stored raw, the format is only scanned for their
+ * types, which is much cheaper than formatting and keeps the UART out of the control path. */
+void tlog_write(esp_log_level_t level, const char *tag, const char *fmt, ...)
+{
+    uint32_t ticket = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+    tlog_record_t *record = &ring[ticket & (TLOG_RING_SIZE - 1)];
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->fmt = (uint32_t)(uintptr_t)fmt;
+    record->tag = (uint32_t)(uintptr_t)tag;
+    record->meta = ((uint32_t)level << 28) | (esp_log_timestamp() & 0x0fffffff);
+
+    va_list va;
+    va_start(va, fmt);
+    int n = 0;
+    for (const char *p = strchr(fmt, '%'); p != NULL && n < TLOG_MAX_ARGS; p = strchr(p, '%')) {
+        p++;
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+        /* Skip flags, width, precision and length up to the conversion, noting 64-bit integers. */
+        int longs = 0;
+        while (*p != '\0' && strchr("-+ #0123456789.lhzjt", *p) != NULL) {
+            longs += *p++ == 'l';
+        }
+        if (*p == '\0') {
+            break;
+        }
+        if (strchr("fFeEgG", *p) != NULL) {
+            float value = (float)va_arg(va, double);
+            memcpy(&record->args[n++], &value, sizeof(value));
+        } else if (longs == 2) {
+            uint64_t value = va_arg(va, uint64_t);
+            record->args[n++] = (uint32_t)value;
+            if (n < TLOG_MAX_ARGS) {
+                record->args[n++] = (uint32_t)(value >> 32);
+            }
+        } else if (*p == 's' || *p == 'p') {
+            record->args[n++] = (uint32_t)(uintptr_t)va_arg(va, void *);
+        } else {
+            record->args[n++] = va_arg(va, uint32_t);
+        }
+    }
+    va_end(va);
+
+    __atomic_store_n(&record->seq, ticket + 1, __ATOMIC_RELEASE);
+}
+
+static char line[sizeof(TLOG_LINE_PREFIX) + TLOG_LINE_RECORDS * offsetof(tlog_record_t, seq) * 2 + 1];
+
+static size_t tlog_hex_record(char *out, const tlog_record_t *record)
+{
+    static const char digits[] = "0123456789abcdef";
+    const uint8_t *bytes = (const uint8_t *)record;
+    for (int i = 0; i < offsetof(tlog_record_t, seq); i++) {
+        *out++ = digits[bytes[i] >> 4];
+        *out++ = digits[bytes[i] & 0x0f];
+    }
+    return offsetof(tlog_record_t, seq) * 2;
+}
+
+/* Copies out the records which are complete, as hex lines for the host decoder. */
+static void tlog_drain(void)
+{
+    int in_line = 0;
+    size_t length = 0;
+    while (true) {
+        uint32_t claimed = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        if (claimed - tail > TLOG_RING_SIZE) {
+            dropped += claimed - tail - TLOG_RING_SIZE;
+            tail = claimed - TLOG_RING_SIZE;
+        }
+        if (tail == claimed) {
+            break;
+        }
+
+        const tlog_record_t *slot = &ring[tail & (TLOG_RING_SIZE - 1)];
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq != tail + 1) {
+            if ((int32_t)(seq - tail - 1) > 0) {
+                /* The producers lapped the drain, the slot already holds a newer record. */
+                dropped++;
+                tail++;
+                continue;
+            }
+            break; // Still being written
+        }
+        tlog_record_t copy = *slot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+            dropped++;
+            tail++;
+            continue;
+        }
+        tail++;
+
+        if (in_line == 0) {
+            length = strlcpy(line, TLOG_LINE_PREFIX, sizeof(line));
+        }
+        length += tlog_hex_record(&line[length], &copy);
+        if (++in_line == TLOG_LINE_RECORDS) {
+            line[length] = '\0';
+            puts(line);
+            in_line = 0;
+        }
+    }
+    if (in_line > 0) {
+        line[length] = '\0';
+        puts(line);
+    }
+    if (dropped > 0) {
+        ESP_LOGW(TAG, "%u records dropped", dropped);
+        dropped = 0;
+    }
+}
+
+static void tlog_task(void *arg)
+{
+    ARG_UNUSED(arg);
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(TLOG_DRAIN_PERIOD));
+        tlog_drain();
+    }
+}
+
+esp_err_t tlog_init(context_t *context)
+{
+    ARG_UNUSED(context);
+
+#if CONFIG_HYDROPONICS_TLOG
+    xTaskCreatePinnedToCore(tlog_task, "tlog", 2560, NULL, placement_priority(PLACEMENT_TASK_TLOG), NULL,
+                            placement_core(PLACEMENT_TASK_TLOG));
+#endif
+    return ESP_OK;
+}
@@ -0,0 +1,34 @@
+#ifndef HYDROPONICS_TLOG_H
+#define HYDROPONICS_TLOG_H
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "context.h"
+
+/* Tokenized logging for the control loops. Instead of formatting on the device, a record holding the address of the
+ * format string and the raw arguments is queued, and tools/tlog_decode.py formats it on the host using the ELF. The
+ * format string must be a literal, "%s" arguments must point to string literals, and at most four 32-bit argument
+ * words are kept (floats take one word, 64-bit integers two). */
+#if CONFIG_HYDROPONICS_TLOG
+#define TLOG_LEVEL(level, tag, fmt, ...)                      \
+    do {                                                      \
+        if (LOG_LOCAL_LEVEL >= (level)) {                     \
+            tlog_write((level), (tag), (fmt), ##__VA_ARGS__); \
+        }                                                     \
+    } while (0)
+
+#define TLOGW(tag, fmt, ...) TLOG_LEVEL(ESP_LOG_WARN, tag, fmt, ##__VA_ARGS__)
+#define TLOGI(tag, fmt, ...) TLOG_LEVEL(ESP_LOG_INFO, tag, fmt, ##__VA_ARGS__)
+#define TLOGD(tag, fmt, ...) TLOG_LEVEL(ESP_LOG_DEBUG, tag, fmt, ##__VA_ARGS__)
+#else
+#define TLOGW(tag, fmt, ...) ESP_LOGW(tag, fmt, ##__VA_ARGS__)
+#define TLOGI(tag, fmt, ...) ESP_LOGI(tag, fmt, ##__VA_ARGS__)
+#define TLOGD(tag, fmt, ...) ESP_LOGD(tag, fmt, ##__VA_ARGS__)
+#endif
+
+void tlog_write(esp_log_level_t level, const char *tag, const char *fmt, ...);
+
+esp_err_t tlog_init(context_t *context);
+
+#endif // HYDROPONICS_TLOG_H
@@ -6,24 +6,267 @@
 
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 
 #include "context.h"
 #include "error.h"
+#include "placement.h"
+#include "power.h"
 #include "smartconfig.h"
+#include "storage.h"
+#include "wifi.h"
 
 #define CONNECTED_BIT BIT(0)
 
+#define WIFI_CACHE_KEY "wifi_cache"
+#define WIFI_NETWORKS_KEY "wifi_networks"
+
+/* Last good association and IP lease, used to skip the full scan (and optionally DHCP) on the next connect. */
+typedef struct {
+    uint8_t ssid[32];
+    uint8_t bssid[6];
+    uint8_t channel;
+    esp_netif_ip_info_t ip_info;
+    esp_netif_dns_info_t dns_info;
+} wifi_cache_t;
+
 static const char *TAG = "wifi";
 
 static EventGroupHandle_t wifi_event_group;
 static context_t *context;
+static esp_netif_t *sta_netif;
+
+static wifi_cache_t wifi_cache;
+static bool wifi_cache_valid = false;
+
+static wifi_network_t networks[WIFI_MAX_NETWORKS];
+static size_t network_count = 0;
+static size_t network_index = 0;
+
+static struct {
+    volatile bool connecting;
+    volatile bool bssid_pinned;
+    bool got_ip_once;
+    int64_t started_at;
+} connect_state;
 
-int8_t wifi_get_ap_rssi(void)
+esp_err_t wifi_get_ap_rssi(int8_t *rssi)
 {
+    ARG_CHECK(rssi != NULL, ERR_PARAM_NULL);
+
     wifi_ap_record_t ap_info;
-    ESP_ERROR_CHECK(esp_wifi_sta_get_ap_info(&ap_info));
-    return ap_info.rssi;
+    esp_err_t err = esp_wifi_sta_get_ap_info(&ap_info);
+    if (err == ESP_OK) {
+        *rssi = ap_info.rssi;
+    }
+    return err;
+}
+
+static void wifi_networks_load(void)
+{
+    size_t length = sizeof(networks);
+    if (storage_get_blob(WIFI_NETWORKS_KEY, networks, &length) == ESP_OK) {
+        network_count = length / sizeof(wifi_network_t);
+    }
+    ESP_LOGI(TAG, "%d provisioned network(s)", network_count);
+}
+
+esp_err_t wifi_add_network(const uint8_t *ssid, const uint8_t *password)
+{
+    ARG_CHECK(ssid != NULL && password != NULL, ERR_PARAM_NULL);
+
+    wifi_network_t network = {0};
+    memcpy(network.ssid, ssid, strnlen((const char *)ssid, sizeof(network.ssid)));
+    memcpy(network.password, password, strnlen((const char *)password, sizeof(network.password)));
+
+    wifi_network_t updated[WIFI_MAX_NETWORKS];
+    size_t count = 0;
+    context_lock(context);
+    for (size_t i = 0; i < network_count; i++) {
+        if (memcmp(networks[i].ssid, network.ssid, sizeof(network.ssid)) != 0) {
+            updated[count++] = networks[i];
+        }
+    }
+    /* The most recently added network goes last, the oldest one is dropped when the list is full. */
+    if (count == WIFI_MAX_NETWORKS) {
+        memmove(&updated[0], &updated[1], (WIFI_MAX_NETWORKS - 1) * sizeof(wifi_network_t));
+        count--;
+    }
+    updated[count++] = network;
+    bool changed = count != network_count || memcmp(updated, networks, count * sizeof(wifi_network_t)) != 0;
+    memcpy(networks, updated, count * sizeof(wifi_network_t));
+    network_count = count;
+    context_unlock(context);
+
+    if (!changed) {
+        return ESP_OK;
+    }
+    ESP_LOGI(TAG, "Provisioned network %s, %d network(s)", (const char *)network.ssid, count);
+    return storage_set_blob(WIFI_NETWORKS_KEY, updated, count * sizeof(wifi_network_t));
+}
+
+size_t wifi_get_networks(wifi_network_t *out_networks, size_t max_networks)
+{
+    context_lock(context);
+    size_t count = network_count < max_networks ? network_count : max_networks;
+    memcpy(out_networks, networks, count * sizeof(wifi_network_t));
+    context_unlock(context);
+    return count;
+}
+
+static void wifi_select_network(wifi_config_t *wifi_config, const wifi_network_t *network)
+{
+    memcpy(wifi_config->sta.ssid, network->ssid, sizeof(wifi_config->sta.ssid));
+    memcpy(wifi_config->sta.password, network->password, sizeof(wifi_config->sta.password));
+    memcpy(context->config.ssid, network->ssid, sizeof(context->config.ssid));
+    memcpy(context->config.password, network->password, sizeof(context->config.password));
+}
+
+static void wifi_cache_load(void)
+{
+    size_t length = sizeof(wifi_cache);
+    esp_err_t err = storage_get_blob(WIFI_CACHE_KEY, &wifi_cache, &length);
+    wifi_cache_valid = err == ESP_OK && length == sizeof(wifi_cache);
+    if (wifi_cache_valid) {
+        ESP_LOGI(TAG, "Cached AP " MACSTR " on channel %d", MAC2STR(wifi_cache.bssid), wifi_cache.channel);
+    }
+}
+
+static void wifi_cache_update(void)
+{
+    wifi_cache_t cache = {0};
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK ||
+        esp_netif_get_ip_info(sta_netif, &cache.ip_info) != ESP_OK ||
+        esp_netif_get_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &cache.dns_info) != ESP_OK) {
+        return;
+    }
+    memcpy(cache.ssid, context->config.ssid, sizeof(cache.ssid));
+    memcpy(cache.bssid, ap_info.bssid, sizeof(cache.bssid));
+    cache.channel = ap_info.primary;
+
+    if (wifi_cache_valid && memcmp(&cache, &wifi_cache, sizeof(cache)) == 0) {
+        return;
+    }
+    wifi_cache = cache;
+    wifi_cache_valid = true;
+    ESP_ERROR_CHECK_WITHOUT_ABORT(storage_set_blob(WIFI_CACHE_KEY, &wifi_cache, sizeof(wifi_cache)));
+}
+
+/* Connects to the provisioned AP. When the last good BSSID and channel are known for this SSID, only that channel is
+ * probed. A failed fast connect falls back to a full scan from the disconnect handler. */
+static void wifi_connect(bool fast)
+{
+    wifi_config_t wifi_config;
+    ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &wifi_config));
+
+    bool pinned = fast && wifi_cache_valid &&
+                  memcmp(wifi_cache.ssid, wifi_config.sta.ssid, sizeof(wifi_cache.ssid)) == 0;
+    wifi_config.sta.bssid_set = pinned;
+    wifi_config.sta.channel = pinned ? wifi_cache.channel : 0;
+    wifi_config.sta.scan_method = pinned ? WIFI_FAST_SCAN : WIFI_ALL_CHANNEL_SCAN;
+    /* Let the AP assist roaming with neighbor reports (802.11k) and BSS transition requests (802.11v). */
+    wifi_config.sta.rm_enabled = 1;
+    wifi_config.sta.btm_enabled = 1;
+    wifi_config.sta.listen_interval = power_listen_interval();
+    if (pinned) {
+        memcpy(wifi_config.sta.bssid, wifi_cache.bssid, sizeof(wifi_config.sta.bssid));
+    } else {
+        esp_netif_dhcpc_start(sta_netif);
+    }
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+
+    if (!connect_state.connecting) {
+        connect_state.started_at = esp_timer_get_time();
+    }
+    connect_state.connecting = true;
+    connect_state.bssid_pinned = pinned;
+    ESP_LOGI(TAG, "Connecting to %s (%s)...", (const char *)wifi_config.sta.ssid,
+             pinned ? "fast connect" : "full scan");
+    ESP_ERROR_CHECK(esp_wifi_connect());
+}
+
+/* Moves to the next provisioned network after the current one could not be found. */
+static void wifi_connect_next_network(void)
+{
+    wifi_network_t network;
+    context_lock(context);
+    bool rotate = network_count > 1;
+    if (rotate) {
+        network_index = (network_index + 1) % network_count;
+        network = networks[network_index];
+    }
+    context_unlock(context);
+
+    if (rotate) {
+        wifi_config_t wifi_config;
+        ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &wifi_config));
+        wifi_select_network(&wifi_config, &network);
+        ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+        ESP_LOGW(TAG, "Trying provisioned network %s", (const char *)network.ssid);
+    }
+    wifi_connect(false);
+}
+
+esp_err_t wifi_roam(const wifi_network_t *network, const uint8_t *bssid, uint8_t channel)
+{
+    ARG_CHECK(network != NULL && bssid != NULL, ERR_PARAM_NULL);
+
+    wifi_config_t wifi_config;
+    ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &wifi_config));
+    if (memcmp(wifi_config.sta.ssid, network->ssid, sizeof(wifi_config.sta.ssid)) != 0) {
+        /* The cached IP lease belongs to the previous network. */
+        wifi_cache_valid = false;
+    }
+    wifi_select_network(&wifi_config, network);
+    wifi_config.sta.bssid_set = 1;
+    memcpy(wifi_config.sta.bssid, bssid, sizeof(wifi_config.sta.bssid));
+    wifi_config.sta.channel = channel;
+    wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+    esp_err_t err = esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Roaming to %s " MACSTR " on channel %d", (const char *)network->ssid, MAC2STR(bssid), channel);
+    connect_state.started_at = esp_timer_get_time();
+    connect_state.connecting = true;
+    connect_state.bssid_pinned = true;
+    /* The disconnect handler reconnects with the new configuration and falls back to a full scan on failure. */
+    return esp_wifi_disconnect();
+}
+
+/* The lease is only reused on the network it was obtained on, a roam to another SSID pins the BSSID but needs DHCP. */
+static void wifi_use_cached_lease(void)
+{
+#if CONFIG_HYDROPONICS_WIFI_STATIC_IP
+    wifi_config_t wifi_config;
+    ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &wifi_config));
+    if (!connect_state.bssid_pinned || !wifi_cache_valid ||
+        memcmp(wifi_cache.ssid, wifi_config.sta.ssid, sizeof(wifi_cache.ssid)) != 0) {
+        esp_netif_dhcpc_start(sta_netif);
+        return;
+    }
+    esp_netif_dhcpc_stop(sta_netif);
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_netif_set_ip_info(sta_netif, &wifi_cache.ip_info));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_netif_set_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &wifi_cache.dns_info));
+#endif
+}
+
+static void wifi_report_connected(void)
+{
+    int64_t now = esp_timer_get_time();
+    if (!connect_state.got_ip_once) {
+        ESP_LOGI(TAG, "Boot to IP: %lld ms (%s)", now / 1000,
+                 connect_state.bssid_pinned ? "fast connect" : "full scan");
+    } else {
+        ESP_LOGI(TAG, "Reconnect to IP: %lld ms (%s)", (now - connect_state.started_at) / 1000,
+                 connect_state.bssid_pinned ? "fast connect" : "full scan");
+    }
+    connect_state.got_ip_once = true;
+    connect_state.connecting = false;
 }
 
 static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
@@ -34,15 +277,30 @@ static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_
         ESP_LOGI(TAG, "Starting wifi...");
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
         ESP_LOGI(TAG, "Connected to %s...", context->config.ssid);
+        wifi_use_cached_lease();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
         wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *)event_data;
         ESP_LOGI(TAG, "Disconnected from %*s, reason: %d", event->ssid_len, event->ssid, event->reason);
         ESP_ERROR_CHECK(context_set_network_connected(context, false));
-        ESP_ERROR_CHECK(esp_wifi_connect());
+        if (connect_state.connecting && connect_state.bssid_pinned && event->reason != WIFI_REASON_ASSOC_LEAVE) {
+            /* The cached AP could not be joined, forget it and scan all channels. */
+            ESP_LOGW(TAG, "Fast connect failed, falling back to a full scan");
+            wifi_cache_valid = false;
+            wifi_connect(false);
+        } else if (connect_state.connecting && event->reason == WIFI_REASON_NO_AP_FOUND) {
+            wifi_connect_next_network();
+        } else {
+            if (!connect_state.connecting) {
+                connect_state.connecting = true;
+                connect_state.started_at = esp_timer_get_time();
+            }
+            ESP_ERROR_CHECK(esp_wifi_connect());
+        }
         xEventGroupClearBits(wifi_event_group, CONNECTED_BIT);
         ESP_ERROR_CHECK(context_set_network_error(context, true));
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ESP_LOGI(TAG, "Got ip address...");
+        wifi_report_connected();
         xEventGroupSetBits(wifi_event_group, CONNECTED_BIT);
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_LOST_IP) {
         ESP_LOGI(TAG, "Lost ip address...");
@@ -63,7 +321,7 @@ static void wifi_dev_init(void)
 
     ESP_ERROR_CHECK(esp_netif_init());
     wifi_event_group = xEventGroupCreate();
-    esp_netif_t *sta_netif = esp_netif_create_default_wifi_sta();
+    sta_netif = esp_netif_create_default_wifi_sta();
     assert(sta_netif);
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -72,7 +330,7 @@ static void wifi_dev_init(void)
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_LOST_IP, &event_handler, NULL));
     ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_FLASH));
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_NONE));
+    ESP_ERROR_CHECK(esp_wifi_set_ps(power_wifi_ps_type()));
     ESP_ERROR_CHECK(esp_wifi_start());
     initialized = true;
 }
@@ -106,6 +364,8 @@ static void wifi_task(void *arg)
 
     ESP_ERROR_CHECK(context_set_network_connected(context, false));
     ESP_ERROR_CHECK(context_set_network_error(context, false));
+    wifi_cache_load();
+    wifi_networks_load();
     while (true) {
         wifi_dev_init();
         bool provisioned = false;
@@ -115,13 +375,15 @@ static void wifi_task(void *arg)
             ESP_ERROR_CHECK(smartconfig_init(context));
         }
         xEventGroupWaitBits(context->event_group, CONTEXT_EVENT_WIFI, pdTRUE, pdTRUE, portMAX_DELAY);
-        ESP_LOGI(TAG, "Connecting to %s...", (const char *)context->config.ssid);
-        ESP_ERROR_CHECK(esp_wifi_connect());
+        ESP_ERROR_CHECK_WITHOUT_ABORT(wifi_add_network(context->config.ssid, context->config.password));
+        network_index = network_count - 1;
+        wifi_connect(true);
         while (true) {
             ESP_ERROR_CHECK(context_set_network_connected(context, false));
             xEventGroupWaitBits(wifi_event_group, CONNECTED_BIT, pdTRUE, pdTRUE, portMAX_DELAY);
             ESP_ERROR_CHECK(context_set_network_connected(context, true));
             ESP_ERROR_CHECK(context_set_network_error(context, false));
+            wifi_cache_update();
 
             // Wait until network error is dispatched.
             xEventGroupWaitBits(context->event_group, CONTEXT_EVENT_NETWORK_ERROR, pdTRUE, pdTRUE, portMAX_DELAY);
@@ -136,6 +398,7 @@ esp_err_t wifi_init(context_t *context)
 {
     ARG_CHECK(context != NULL, ERR_PARAM_NULL);
 
-    xTaskCreatePinnedToCore(wifi_task, "wifi", 4096, context, configMAX_PRIORITIES - 7, NULL, tskNO_AFFINITY);
+    xTaskCreatePinnedToCore(wifi_task, "wifi", 4096, context, placement_priority(PLACEMENT_TASK_WIFI), NULL,
+                            placement_core(PLACEMENT_TASK_WIFI));
     return ESP_OK;
 }
\ No newline at end of file
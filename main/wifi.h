@@ -5,7 +5,20 @@
 
 #include "context.h"
 
-int8_t wifi_get_ap_rssi(void);
+#define WIFI_MAX_NETWORKS 4
+
+typedef struct {
+    uint8_t ssid[32];
+    uint8_t password[64];
+} wifi_network_t;
+
+esp_err_t wifi_get_ap_rssi(int8_t *rssi);
+
+esp_err_t wifi_add_network(const uint8_t *ssid, const uint8_t *password);
+
+size_t wifi_get_networks(wifi_network_t *out_networks, size_t max_networks);
+
+esp_err_t wifi_roam(const wifi_network_t *network, const uint8_t *bssid, uint8_t channel);
 
 esp_err_t wifi_init(context_t *context);
 
@@ -0,0 +1,49 @@
+/* Two revisions of a small program linked with the patcher, built to get a pair of real images the way a firmware
+ * change produces them: revision 2 adds a function and changes a constant, which moves the code and data after it. */
+#include <stdio.h>
+#include <string.h>
+
+#include "delta.h"
+
+#if FIXTURE_REVISION > 1
+#define FIXTURE_NAME "fixture revision 2"
+
+static unsigned int fixture_checksum(const char *text)
+{
+    unsigned int sum = 0;
+    while (*text != '\0') {
+        sum = sum * 31 + (unsigned char)*text++;
+    }
+    return sum;
+}
+#else
+#define FIXTURE_NAME "fixture revision 1"
+#endif
+
+static esp_err_t fixture_read(void *arg, size_t offset, void *out, size_t length)
+{
+    memset(out, 0, length);
+    return ESP_OK;
+}
+
+static esp_err_t fixture_write(void *arg, const void *data, size_t length)
+{
+    return fwrite(data, 1, length, stdout) == length ? ESP_OK : ESP_FAIL;
+}
+
+int main(void)
+{
+    const delta_io_t io = {
+        .read = fixture_read,
+        .write = fixture_write,
+    };
+    puts(FIXTURE_NAME);
+#if FIXTURE_REVISION > 1
+    printf("%u\n", fixture_checksum(FIXTURE_NAME));
+#endif
+    esp_err_t err = delta_begin(&io, NULL);
+    if (err == ESP_OK) {
+        delta_abort();
+    }
+    return err;
+}
@@ -0,0 +1,6 @@
+/* Definitions behind the host stand-ins in include/. */
+#include <stddef.h>
+
+#include "esp32/rom/miniz.h"
+
+size_t tinfl_host_max_output;
@@ -0,0 +1,111 @@
+/* Host stand-in for the ROM inflater on top of zlib. zlib keeps its own window, while tinfl reads its back references
+ * from the caller's wrapping output buffer, so the stand-in checks on every call what tinfl silently relies on: the
+ * buffer is a power of two at least as large as the window the stream declares, output continues exactly where the
+ * previous call left it modulo the buffer size, and the bytes already returned are still in place. A broken contract
+ * fails the stream like corrupt data would on the device. tinfl_host_max_output caps the bytes returned per call, so
+ * the caller sees output in arbitrary pieces and wraps at arbitrary offsets. */
+#ifndef HYDROPONICS_TEST_MINIZ_H
+#define HYDROPONICS_TEST_MINIZ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+typedef enum {
+    TINFL_STATUS_BAD_PARAM = -3,
+    TINFL_STATUS_ADLER32_MISMATCH = -2,
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+enum {
+    TINFL_FLAG_PARSE_ZLIB_HEADER = 1,
+    TINFL_FLAG_HAS_MORE_INPUT = 2,
+    TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4,
+    TINFL_FLAG_COMPUTE_ADLER32 = 8,
+};
+
+typedef struct {
+    bool started;
+    bool header_checked;
+    z_stream stream;
+    uint64_t total_out;
+    uint8_t *shadow; // What the output buffer has to hold, at the same offsets
+} tinfl_decompressor;
+
+#define tinfl_init(r) do { (r)->started = false; (r)->header_checked = false; } while (0)
+
+extern size_t tinfl_host_max_output; // 0 returns as much output as fits
+
+static inline tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *pIn_buf_next, size_t *pIn_buf_size,
+                                            uint8_t *pOut_buf_start, uint8_t *pOut_buf_next, size_t *pOut_buf_size,
+                                            const uint32_t decomp_flags)
+{
+    size_t buffer_size = (size_t)(pOut_buf_next - pOut_buf_start) + *pOut_buf_size;
+    if (pOut_buf_next < pOut_buf_start || *pOut_buf_size == 0 || (buffer_size & (buffer_size - 1)) != 0 ||
+        (decomp_flags & (TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF)) !=
+            TINFL_FLAG_PARSE_ZLIB_HEADER) {
+        *pIn_buf_size = *pOut_buf_size = 0;
+        return TINFL_STATUS_BAD_PARAM;
+    }
+    if (!r->started) {
+        memset(&r->stream, 0, sizeof(r->stream));
+        r->total_out = 0;
+        r->shadow = calloc(1, buffer_size);
+        if (r->shadow == NULL || inflateInit2(&r->stream, MAX_WBITS) != Z_OK) {
+            return TINFL_STATUS_FAILED;
+        }
+        r->started = true;
+    }
+    size_t filled = r->total_out < buffer_size ? (size_t)r->total_out : buffer_size;
+    if ((size_t)(pOut_buf_next - pOut_buf_start) != (r->total_out & (buffer_size - 1)) ||
+        memcmp(pOut_buf_start, r->shadow, filled) != 0) {
+        *pIn_buf_size = *pOut_buf_size = 0;
+        return TINFL_STATUS_FAILED;
+    }
+    /* Like tinfl, refuse a stream whose window does not fit the buffer. */
+    if (!r->header_checked && *pIn_buf_size > 0) {
+        if (buffer_size < (size_t)1 << (8 + (pIn_buf_next[0] >> 4))) {
+            *pIn_buf_size = *pOut_buf_size = 0;
+            return TINFL_STATUS_FAILED;
+        }
+        r->header_checked = true;
+    }
+
+    size_t out_size = *pOut_buf_size;
+    if (tinfl_host_max_output > 0 && out_size > tinfl_host_max_output) {
+        out_size = tinfl_host_max_output;
+    }
+    r->stream.next_in = (Bytef *)pIn_buf_next;
+    r->stream.avail_in = *pIn_buf_size;
+    r->stream.next_out = pOut_buf_next;
+    r->stream.avail_out = out_size;
+    int ret = inflate(&r->stream, Z_NO_FLUSH);
+    *pIn_buf_size -= r->stream.avail_in;
+    *pOut_buf_size = out_size - r->stream.avail_out;
+    memcpy(r->shadow + (pOut_buf_next - pOut_buf_start), pOut_buf_next, *pOut_buf_size);
+    r->total_out += *pOut_buf_size;
+
+    if (ret == Z_STREAM_END) {
+        inflateEnd(&r->stream);
+        free(r->shadow);
+        return TINFL_STATUS_DONE;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        return ret == Z_DATA_ERROR && r->stream.msg != NULL && strstr(r->stream.msg, "check") != NULL
+                   ? TINFL_STATUS_ADLER32_MISMATCH
+                   : TINFL_STATUS_FAILED;
+    }
+    if (r->stream.avail_out == 0) {
+        return TINFL_STATUS_HAS_MORE_OUTPUT;
+    }
+    return (decomp_flags & TINFL_FLAG_HAS_MORE_INPUT) ? TINFL_STATUS_NEEDS_MORE_INPUT : TINFL_STATUS_FAILED;
+}
+
+#endif // HYDROPONICS_TEST_MINIZ_H
@@ -0,0 +1,17 @@
+/* Host stand-in for the ESP-IDF header, only what the patcher uses. */
+#ifndef HYDROPONICS_TEST_ESP_ERR_H
+#define HYDROPONICS_TEST_ESP_ERR_H
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_SIZE 0x104
+#define ESP_ERR_INVALID_RESPONSE 0x108
+#define ESP_ERR_INVALID_CRC 0x109
+#define ESP_ERR_INVALID_VERSION 0x10A
+
+#endif // HYDROPONICS_TEST_ESP_ERR_H
@@ -0,0 +1,13 @@
+/* Host stand-in for the ESP-IDF header, logs go to stderr. */
+#ifndef HYDROPONICS_TEST_ESP_LOG_H
+#define HYDROPONICS_TEST_ESP_LOG_H
+
+#include <stdio.h>
+
+#define ESP_LOG_HOST(level, tag, format, ...) fprintf(stderr, level " (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGE(tag, format, ...) ESP_LOG_HOST("E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) ESP_LOG_HOST("W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) ESP_LOG_HOST("I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) ESP_LOG_HOST("D", tag, format, ##__VA_ARGS__)
+
+#endif // HYDROPONICS_TEST_ESP_LOG_H
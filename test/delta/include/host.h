@@ -0,0 +1,8 @@
+/* Included ahead of every source, stands in for the toolchain's sys/cdefs.h extensions the firmware relies on. */
+#ifndef HYDROPONICS_TEST_HOST_H
+#define HYDROPONICS_TEST_HOST_H
+
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define __printflike(a, b) __attribute__((format(printf, a, b)))
+
+#endif // HYDROPONICS_TEST_HOST_H
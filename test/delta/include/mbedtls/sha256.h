@@ -0,0 +1,37 @@
+/* Host stand-in for mbedtls SHA-256 on top of OpenSSL. */
+#ifndef HYDROPONICS_TEST_SHA256_H
+#define HYDROPONICS_TEST_SHA256_H
+
+#include <stddef.h>
+
+#include <openssl/evp.h>
+
+typedef EVP_MD_CTX *mbedtls_sha256_context;
+
+static inline void mbedtls_sha256_init(mbedtls_sha256_context *ctx)
+{
+    *ctx = EVP_MD_CTX_new();
+}
+
+static inline void mbedtls_sha256_free(mbedtls_sha256_context *ctx)
+{
+    EVP_MD_CTX_free(*ctx);
+    *ctx = NULL;
+}
+
+static inline int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224)
+{
+    return EVP_DigestInit_ex(*ctx, is224 ? EVP_sha224() : EVP_sha256(), NULL) == 1 ? 0 : -1;
+}
+
+static inline int mbedtls_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *input, size_t length)
+{
+    return EVP_DigestUpdate(*ctx, input, length) == 1 ? 0 : -1;
+}
+
+static inline int mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char *output)
+{
+    return EVP_DigestFinal_ex(*ctx, output, NULL) == 1 ? 0 : -1;
+}
+
+#endif // HYDROPONICS_TEST_SHA256_H
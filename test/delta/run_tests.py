@@ -0,0 +1,168 @@
+#!/usr/bin/env python3
+"""Round trips image pairs through tools/delta_ota.py and the patcher of the firmware (main/delta.c).
+
+For every old/new pair, creates a patch with the tool, applies it with test_delta under several seeds, each splitting
+the patch and the inflated body differently, and checks the result byte for byte against the new image. A generated
+pair is always added, large enough to wrap the inflate window many times. Then checks that the patcher rejects a
+wrong source image, a truncated patch and corrupt records. Prints patch size and patcher throughput per pair, e.g.:
+
+    python test/delta/run_tests.py --patcher build/test_delta/test_delta --tool tools/delta_ota.py \\
+        --work /tmp/delta old/hydroponics.bin build/hydroponics.bin
+"""
+
+import argparse
+import os
+import random
+import struct
+import subprocess
+import sys
+import zlib
+
+HEADER_SIZE = 80
+CONTROL = struct.Struct('<IIi')
+WINDOW_BITS = 12
+ESP_ERR_INVALID_ARG = 0x102
+ESP_ERR_INVALID_SIZE = 0x104
+ESP_ERR_INVALID_VERSION = 0x10A
+APPLY_TIMEOUT = 60  # seconds, a patcher stuck on a record counts as a failure
+
+
+class Patcher:
+    def __init__(self, path, work):
+        self.path = path
+        self.output = os.path.join(work, 'patched.bin')
+
+    def apply(self, source, patch, seed):
+        """Returns the error code, the seconds the patcher took and the patched image."""
+        result = subprocess.run([self.path, source, patch, self.output, str(seed)], capture_output=True, text=True,
+                                timeout=APPLY_TIMEOUT)
+        if result.returncode not in (0, 1) or not result.stdout.startswith('err '):
+            sys.stderr.write(result.stderr)
+            raise RuntimeError(f'test_delta failed with {result.returncode}')
+        fields = result.stdout.split()
+        with open(self.output, 'rb') as f:
+            return int(fields[1], 16), float(fields[7]), f.read()
+
+
+def write(path, data):
+    with open(path, 'wb') as f:
+        f.write(data)
+    return path
+
+
+def generated_pair(work):
+    """A 1.5 MB image and an update to it: inserted and removed code, scattered relocations and appended data."""
+    rng = random.Random(50)
+    old = bytearray(rng.randbytes(700000) + bytes(300000) + rng.randbytes(500000))
+    new = bytearray(old)
+    new[4096:4096] = rng.randbytes(3000)
+    for _ in range(3000):
+        offset = rng.randrange(len(new))
+        new[offset] = (new[offset] + rng.randrange(1, 4)) & 0xff
+    del new[900000:930000]
+    new += rng.randbytes(5000)
+    return write(os.path.join(work, 'generated_old.bin'), old), write(os.path.join(work, 'generated_new.bin'), new)
+
+
+def rewrite_patch(patch, edit):
+    """Patch with its inflated body passed through edit, recompressed like the tool does."""
+    body = bytearray(zlib.decompress(patch[HEADER_SIZE:]))
+    edit(body)
+    compressor = zlib.compressobj(9, zlib.DEFLATED, WINDOW_BITS)
+    return patch[:HEADER_SIZE] + compressor.compress(bytes(body)) + compressor.flush()
+
+
+def set_control(index, diff_len=None, extra_len=None, seek=None):
+    """Body edit replacing fields of the index-th record."""
+    def edit(body):
+        offset = 0
+        for _ in range(index):
+            diff, extra, _ = CONTROL.unpack_from(body, offset)
+            offset += CONTROL.size + diff + extra
+        fields = list(CONTROL.unpack_from(body, offset))
+        for i, value in enumerate((diff_len, extra_len, seek)):
+            if value is not None:
+                fields[i] = value
+        CONTROL.pack_into(body, offset, *fields)
+    return edit
+
+
+def round_trip(patcher, tool, work, old, new, seeds):
+    patch = os.path.join(work, 'update.hdp')
+    subprocess.run([sys.executable, tool, 'create', old, new, '-o', patch], check=True, stdout=subprocess.DEVNULL)
+    with open(new, 'rb') as f:
+        expected = f.read()
+    patch_size = os.path.getsize(patch)
+
+    best = None
+    for seed in range(seeds):
+        err, seconds, image = patcher.apply(old, patch, seed)
+        if err != 0 or image != expected:
+            print(f'FAIL {os.path.basename(new)}: seed {seed} gave err 0x{err:x}, {len(image)} bytes')
+            return False
+        best = seconds if best is None else min(best, seconds)
+    print(f'ok   {os.path.basename(old)} -> {os.path.basename(new)}: {len(expected)} bytes, patch {patch_size} bytes '
+          f'({100 * patch_size / max(len(expected), 1):.1f}%), {len(expected) / max(best, 1e-9) / 2**20:.1f} MiB/s')
+    return True
+
+
+def rejections(patcher, tool, work, old, new):
+    patch_path = os.path.join(work, 'update.hdp')
+    subprocess.run([sys.executable, tool, 'create', old, new, '-o', patch_path], check=True, stdout=subprocess.DEVNULL)
+    with open(patch_path, 'rb') as f:
+        patch = f.read()
+    with open(old, 'rb') as f:
+        wrong_source = bytearray(f.read())
+    wrong_source[len(wrong_source) // 2] ^= 0x01
+    corrupt_body = bytearray(patch)
+    corrupt_body[HEADER_SIZE + len(patch) // 2] ^= 0xff
+
+    # name, source, patch, expected error (None for any error), whether output may have been written
+    cases = [
+        ('wrong source', write(os.path.join(work, 'wrong.bin'), wrong_source), patch, ESP_ERR_INVALID_VERSION, False),
+        ('bad magic', old, b'XXXX' + patch[4:], ESP_ERR_INVALID_ARG, False),
+        ('truncated header', old, patch[:HEADER_SIZE // 2], ESP_ERR_INVALID_SIZE, False),
+        ('truncated body', old, patch[:len(patch) // 2], ESP_ERR_INVALID_SIZE, True),
+        ('record past the image', old, rewrite_patch(patch, set_control(1, extra_len=0x7fffffff)),
+         ESP_ERR_INVALID_ARG, True),
+        ('seek before the source', old, rewrite_patch(patch, set_control(0, seek=-2**31)), ESP_ERR_INVALID_ARG, True),
+        ('seek past the source', old, rewrite_patch(patch, set_control(0, seek=2**31 - 1)), ESP_ERR_INVALID_ARG, True),
+        ('corrupt body', old, bytes(corrupt_body), None, True),
+    ]
+    passed = True
+    for name, source, data, expected, may_write in cases:
+        patch_file = write(os.path.join(work, 'broken.hdp'), data)
+        for seed in (0, 1, 2):
+            err, _, image = patcher.apply(source, patch_file, seed)
+            if err == 0 or (expected is not None and err != expected) or (image and not may_write):
+                print(f'FAIL {name}: seed {seed} gave err 0x{err:x}, {len(image)} bytes written')
+                passed = False
+                break
+        else:
+            print(f'ok   rejects {name}')
+    return passed
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--patcher', required=True, help='test_delta executable')
+    parser.add_argument('--tool', required=True, help='tools/delta_ota.py')
+    parser.add_argument('--work', required=True, help='directory for the patches and patched images')
+    parser.add_argument('--seeds', type=int, default=8, help='ways to split every patch, seed 0 feeds it at once')
+    parser.add_argument('images', nargs='*', help='image pairs, old image followed by new image')
+    args = parser.parse_args()
+    if len(args.images) % 2:
+        parser.error('images come in old/new pairs')
+
+    os.makedirs(args.work, exist_ok=True)
+    patcher = Patcher(args.patcher, args.work)
+    generated = generated_pair(args.work)
+    pairs = list(zip(args.images[::2], args.images[1::2])) + [generated]
+
+    passed = all([round_trip(patcher, args.tool, args.work, old, new, args.seeds) for old, new in pairs])
+    passed = rejections(patcher, args.tool, args.work, *generated) and passed
+    sys.exit(0 if passed else 1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,137 @@
+/* Applies a patch with main/delta.c the way the OTA task does, from an in-memory source into an in-memory sink, then
+ * writes the patched image out. The patch is fed in chunks of random size and the inflater returns its output in
+ * pieces of random size, both drawn from the seed, so every run splits header, records and window wraps differently.
+ *
+ *     test_delta <source> <patch> <output> <seed>
+ *
+ * Seed 0 feeds the whole patch at once. Prints the result and the patcher throughput, exits non-zero on error. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_err.h"
+
+#include "esp32/rom/miniz.h"
+
+#include "delta.h"
+
+#define TEST_MAX_CHUNK 4096  // (int) Largest patch chunk fed at a time, OTA_READ_SIZE on the device is 1024
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+} buffer_t;
+
+static buffer_t source;
+static buffer_t sink;
+
+static esp_err_t test_read(void *arg, size_t offset, void *out, size_t length)
+{
+    if (offset > source.length || length > source.length - offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(out, source.data + offset, length);
+    return ESP_OK;
+}
+
+static esp_err_t test_write(void *arg, const void *data, size_t length)
+{
+    if (sink.length + length > sink.capacity) {
+        sink.capacity = 2 * (sink.length + length);
+        sink.data = realloc(sink.data, sink.capacity);
+        if (sink.data == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    memcpy(sink.data + sink.length, data, length);
+    sink.length += length;
+    return ESP_OK;
+}
+
+static int test_load(const char *path, buffer_t *out)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    out->length = out->capacity = ftell(f);
+    rewind(f);
+    out->data = malloc(out->length + 1);
+    size_t read = fread(out->data, 1, out->length, f);
+    fclose(f);
+    return read == out->length ? 0 : -1;
+}
+
+/* Mostly small chunks, with the odd large one, so that the 80 byte header and the 12 byte records land across them.
+ * Every third seed only uses tiny pieces, which splits nearly every record at every offset. */
+static size_t test_piece_size(unsigned int seed)
+{
+    if (seed == 0) {
+        return 0;
+    }
+    if (seed % 3 == 2) {
+        return 1 + rand() % 16;
+    }
+    switch (rand() % 4) {
+    case 0:
+        return 1 + rand() % 16;
+    case 1:
+        return 1 + rand() % 256;
+    default:
+        return 1 + rand() % TEST_MAX_CHUNK;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 5) {
+        fprintf(stderr, "usage: %s <source> <patch> <output> <seed>\n", argv[0]);
+        return 2;
+    }
+    buffer_t patch;
+    if (test_load(argv[1], &source) != 0 || test_load(argv[2], &patch) != 0) {
+        return 2;
+    }
+    unsigned int seed = strtoul(argv[4], NULL, 0);
+    srand(seed);
+
+    const delta_io_t io = {
+        .read = test_read,
+        .write = test_write,
+    };
+    struct timespec started_at, finished_at;
+    clock_gettime(CLOCK_MONOTONIC, &started_at);
+
+    esp_err_t err = delta_begin(&io, NULL);
+    for (size_t offset = 0; err == ESP_OK && offset < patch.length;) {
+        size_t length = seed == 0 ? patch.length : test_piece_size(seed);
+        length = length < patch.length - offset ? length : patch.length - offset;
+        tinfl_host_max_output = test_piece_size(seed);
+        err = delta_write(patch.data + offset, length);
+        offset += length;
+    }
+    delta_stats_t stats;
+    delta_get_stats(&stats);
+    if (err == ESP_OK) {
+        err = delta_end();
+    } else {
+        delta_abort();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finished_at);
+    double seconds = (finished_at.tv_sec - started_at.tv_sec) + (finished_at.tv_nsec - started_at.tv_nsec) / 1e9;
+    printf("err 0x%x patch %u image %u seconds %.6f\n", err, stats.patch_size, stats.written, seconds);
+
+    FILE *f = fopen(argv[3], "wb");
+    if (f == NULL || fwrite(sink.data, 1, sink.length, f) != sink.length) {
+        perror(argv[3]);
+        return 2;
+    }
+    fclose(f);
+    return err == ESP_OK ? 0 : 1;
+}
@@ -0,0 +1,240 @@
+#!/usr/bin/env python3
+"""Creates and applies the delta OTA patches of the firmware (main/delta.c).
+
+A patch rebuilds a new firmware image from the one running on the device, e.g.:
+
+    python tools/delta_ota.py create old/hydroponics.bin build/hydroponics.bin -o update.hdp
+    python tools/delta_ota.py apply old/hydroponics.bin update.hdp -o patched.bin
+    python tools/delta_ota.py bench old/hydroponics.bin build/hydroponics.bin
+
+"create" prints the patch size and the SHA-256 to send with the OTA command, "apply" runs the same streaming
+algorithm as the device and times it, "bench" does both on an image pair and checks the result byte for byte.
+
+Patch layout, integers are little endian:
+
+    header  "HDP1", source size u32, target size u32, source SHA-256, target SHA-256, flags u32 (0)
+    body    zlib stream (12 bit window) of records: diff_len u32, extra_len u32, seek i32, diff_len bytes added to
+            the source bytes at the source position, extra_len bytes copied as they are; the source position moves
+            by diff_len + seek
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+import time
+import zlib
+
+MAGIC = b'HDP1'
+HEADER = struct.Struct('<4sII32s32sI')
+CONTROL = struct.Struct('<IIi')
+WINDOW_BITS = 12      # DELTA_WINDOW_BITS, the device inflates into a window of this size
+SEED_LENGTH = 16      # bytes hashed to find match candidates
+SEED_STRIDE = 4       # source offsets indexed, a match is found as long as it spans SEED_LENGTH + SEED_STRIDE bytes
+MIN_MATCH = 24        # shorter matches cost more in control records than they save
+MISMATCH_RUN = 32     # bytes a match extends past its last improvement
+PATCH_CHUNK = 1024    # OTA_READ_SIZE, patch bytes the device receives at a time
+
+
+def index_source(source):
+    index = {}
+    for offset in range(0, len(source) - SEED_LENGTH + 1, SEED_STRIDE):
+        index.setdefault(source[offset:offset + SEED_LENGTH], offset)
+    return index
+
+
+def extend_forward(source, s, target, t):
+    """Length of the approximate match at s/t, scored like bsdiff: two points per equal byte, minus one per byte."""
+    limit = min(len(source) - s, len(target) - t)
+    score = best_score = best_length = length = 0
+    while length < limit and length - best_length <= MISMATCH_RUN:
+        # Skip over equal runs a block at a time, they only ever improve the score.
+        step = min(64, limit - length)
+        if source[s + length:s + length + step] == target[t + length:t + length + step]:
+            length += step
+            score += step
+        else:
+            score += 1 if source[s + length] == target[t + length] else -1
+            length += 1
+        if score > best_score:
+            best_score, best_length = score, length
+    return best_length
+
+
+def extend_backward(source, s, target, t, floor):
+    """Bytes the match at s/t extends backwards, without going below target offset floor."""
+    limit = min(s, t - floor)
+    score = best_score = best_length = length = 0
+    while length < limit and length - best_length <= MISMATCH_RUN:
+        length += 1
+        score += 1 if source[s - length] == target[t - length] else -1
+        if score > best_score:
+            best_score, best_length = score, length
+    return best_length
+
+
+def find_matches(source, target):
+    """Approximate matches (target offset, source offset, length) in target order, not overlapping."""
+    index = index_source(source)
+    matches = []
+    covered = 0      # target bytes before this are taken by the previous match
+    shift = 0        # source - target offset of the previous match, code moved by an edit keeps it
+    t = 0
+    while t <= len(target) - SEED_LENGTH:
+        seed = target[t:t + SEED_LENGTH]
+        s = t + shift
+        if not (0 <= s <= len(source) - SEED_LENGTH and source[s:s + SEED_LENGTH] == seed):
+            s = index.get(seed)
+            if s is None:
+                t += 1
+                continue
+        back = extend_backward(source, s, target, t, covered)
+        length = back + extend_forward(source, s, target, t)
+        if length < MIN_MATCH:
+            t += 1
+            continue
+        matches.append((t - back, s - back, length))
+        covered = t - back + length
+        shift = s - t
+        t = covered
+    return matches
+
+
+def diff(source, target):
+    """Patch body records for source -> target, before compression."""
+    out = bytearray()
+    matches = find_matches(source, target)
+    # Every record holds a match followed by the literal bytes up to the next one, the first one has no match.
+    t, s, length = 0, 0, 0
+    for next_t, next_s, next_length in matches + [(len(target), None, 0)]:
+        extra_start = t + length
+        seek = 0 if next_s is None else next_s - (s + length)
+        out += CONTROL.pack(length, next_t - extra_start, seek)
+        out += bytes((b - a) & 0xff for a, b in zip(source[s:s + length], target[t:t + length]))
+        out += target[extra_start:next_t]
+        t, s, length = next_t, next_s, next_length
+    return bytes(out)
+
+
+def create(source, target):
+    body = zlib.compressobj(9, zlib.DEFLATED, WINDOW_BITS)
+    header = HEADER.pack(MAGIC, len(source), len(target), hashlib.sha256(source).digest(),
+                         hashlib.sha256(target).digest(), 0)
+    return header + body.compress(diff(source, target)) + body.flush()
+
+
+def apply(source, chunks):
+    """Applies the patch arriving in chunks like main/delta.c, with a bounded window and no look ahead."""
+    pending = b''
+    inflater = zlib.decompressobj(WINDOW_BITS)
+    target = bytearray()
+    header = None
+    control = b''
+    diff_left = extra_left = seek = source_pos = 0
+    in_record = False
+    for chunk in chunks:
+        if header is None:
+            pending += chunk
+            if len(pending) < HEADER.size:
+                continue
+            header = HEADER.unpack(pending[:HEADER.size])
+            magic, source_size, target_size, source_sha256, target_sha256, flags = header
+            if magic != MAGIC or flags != 0:
+                raise ValueError('not a delta patch')
+            if hashlib.sha256(source[:source_size]).digest() != source_sha256:
+                raise ValueError('patch was made against another image')
+            chunk = pending[HEADER.size:]
+        data = inflater.decompress(chunk)
+        while data:
+            if not in_record:
+                n = min(len(data), CONTROL.size - len(control))
+                control += data[:n]
+                if len(control) == CONTROL.size:
+                    diff_left, extra_left, seek = CONTROL.unpack(control)
+                    control = b''
+                    in_record = True
+            elif diff_left:
+                n = min(len(data), diff_left)
+                target += bytes((a + b) & 0xff for a, b in zip(source[source_pos:source_pos + n], data[:n]))
+                source_pos += n
+                diff_left -= n
+            else:
+                n = min(len(data), extra_left)
+                target += data[:n]
+                extra_left -= n
+            data = data[n:]
+            if in_record and not diff_left and not extra_left:
+                source_pos += seek
+                in_record = False
+    if header is None or not inflater.eof or len(target) != header[2]:
+        raise ValueError('truncated patch')
+    if hashlib.sha256(target).digest() != header[4]:
+        raise ValueError('patched image hash mismatch')
+    return bytes(target)
+
+
+def read(path):
+    with open(path, 'rb') as f:
+        return f.read()
+
+
+def chunked(data):
+    return (data[i:i + PATCH_CHUNK] for i in range(0, len(data), PATCH_CHUNK))
+
+
+def report_create(source, target, patch, seconds):
+    print(f'source  {len(source):9} bytes')
+    print(f'target  {len(target):9} bytes  sha256 {hashlib.sha256(target).hexdigest()}')
+    print(f'patch   {len(patch):9} bytes  {100 * len(patch) / max(len(target), 1):.1f}% of the target, '
+          f'{100 * len(zlib.compress(target, 9)) / max(len(target), 1):.1f}% compressed in full, '
+          f'created in {seconds:.1f} s')
+
+
+def report_apply(patched, seconds):
+    print(f'applied {len(patched):9} bytes  in {seconds:.2f} s, {len(patched) / max(seconds, 1e-9) / 1024:.0f} KiB/s')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest='command', required=True)
+    create_parser = commands.add_parser('create', help='create a patch from the running image to the new one')
+    create_parser.add_argument('source', help='image running on the device')
+    create_parser.add_argument('target', help='new image')
+    create_parser.add_argument('-o', '--output', required=True, help='patch file')
+    apply_parser = commands.add_parser('apply', help='apply a patch to the running image')
+    apply_parser.add_argument('source', help='image running on the device')
+    apply_parser.add_argument('patch', help='patch file')
+    apply_parser.add_argument('-o', '--output', required=True, help='patched image')
+    bench_parser = commands.add_parser('bench', help='create and apply a patch, check the round trip')
+    bench_parser.add_argument('source', help='image running on the device')
+    bench_parser.add_argument('target', help='new image')
+    args = parser.parse_args()
+
+    source = read(args.source)
+    if args.command in ('create', 'bench'):
+        target = read(args.target)
+        started_at = time.perf_counter()
+        patch = create(source, target)
+        report_create(source, target, patch, time.perf_counter() - started_at)
+        if args.command == 'create':
+            with open(args.output, 'wb') as f:
+                f.write(patch)
+            return
+    else:
+        patch = read(args.patch)
+
+    started_at = time.perf_counter()
+    try:
+        patched = apply(source, chunked(patch))
+    except ValueError as e:
+        sys.exit(f'error: {e}')
+    report_apply(patched, time.perf_counter() - started_at)
+    if args.command == 'apply':
+        with open(args.output, 'wb') as f:
+            f.write(patched)
+    elif patched != target:
+        sys.exit('error: round trip differs from the target')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""Decodes the tokenized log records of the firmware (main/tlog.c).
+
+Reads a serial capture (or stdin), passes regular lines through and expands "TLOG:" lines using the format strings
+and tags found in the firmware ELF, e.g.:
+
+    idf.py monitor | tee capture.txt
+    python tools/tlog_decode.py build/hydroponics.elf capture.txt
+
+Requires pyelftools, which ships with ESP-IDF.
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+from elftools.elf.elffile import ELFFile
+
+LINE_PREFIX = 'TLOG:'
+RECORD_SIZE = 28  # fmt, tag, meta, 4 argument words
+MAX_ARGS = 4
+LEVELS = {1: 'E', 2: 'W', 3: 'I', 4: 'D', 5: 'V'}
+COLORS = {'E': '\033[0;31m', 'W': '\033[0;33m', 'I': '\033[0;32m'}
+CONVERSION = re.compile(r'%([-+ #0]*)(\d+|\*)?(\.\d+)?(hh|h|ll|l|z|j|t)?([diouxXeEfFgGcspn%])')
+
+
+class Image:
+    """Read-only view of the allocated sections of the ELF, addressed like the device memory."""
+
+    def __init__(self, path):
+        self.sections = []
+        with open(path, 'rb') as f:
+            elf = ELFFile(f)
+            for section in elf.iter_sections():
+                if section['sh_flags'] & 0x2 and section['sh_type'] != 'SHT_NOBITS':
+                    self.sections.append((section['sh_addr'], section.data()))
+
+    def string(self, address):
+        for start, data in self.sections:
+            if start <= address < start + len(data):
+                end = data.find(b'\0', address - start)
+                return data[address - start:end].decode('utf-8', 'replace')
+        return None
+
+
+def format_record(image, fmt, words):
+    out = []
+    pos = 0
+    arg = 0
+    for match in CONVERSION.finditer(fmt):
+        out.append(fmt[pos:match.start()])
+        pos = match.end()
+        flags, width, precision, length, conversion = match.groups()
+        if conversion == '%':
+            out.append('%')
+            continue
+        if arg >= len(words):
+            out.append('<?>')
+            continue
+        spec = '%' + (flags or '') + (width or '') + (precision or '')
+        if conversion in 'eEfFgG':
+            value = struct.unpack('<f', struct.pack('<I', words[arg]))[0]
+            arg += 1
+            out.append((spec + conversion) % value)
+        elif length == 'll':
+            value = words[arg] | (words[arg + 1] << 32 if arg + 1 < len(words) else 0)
+            arg += 2
+            if conversion in 'di' and value & (1 << 63):
+                value -= 1 << 64
+            out.append((spec + ('d' if conversion in 'diu' else conversion)) % value)
+        elif conversion == 's':
+            text = image.string(words[arg])
+            arg += 1
+            out.append((spec + 's') % (text if text is not None else '<0x%08x>' % words[arg - 1]))
+        elif conversion == 'p':
+            arg += 1
+            out.append('0x%08x' % words[arg - 1])
+        elif conversion == 'c':
+            arg += 1
+            out.append(chr(words[arg - 1] & 0xff))
+        else:
+            value = words[arg]
+            arg += 1
+            if conversion in 'di' and value & (1 << 31):
+                value -= 1 << 32
+            out.append((spec + ('d' if conversion in 'diu' else conversion)) % value)
+    out.append(fmt[pos:])
+    return ''.join(out)
+
+
+def decode_line(image, line, color):
+    payload = bytes.fromhex(line[len(LINE_PREFIX):].strip())
+    for offset in range(0, len(payload) - RECORD_SIZE + 1, RECORD_SIZE):
+        fmt_address, tag_address, meta, *words = struct.unpack_from('<3I%dI' % MAX_ARGS, payload, offset)
+        fmt = image.string(fmt_address)
+        tag = image.string(tag_address) or '?'
+        level = LEVELS.get(meta >> 28, '?')
+        timestamp = meta & 0x0fffffff
+        if fmt is None:
+            text = 'unknown format string 0x%08x, is the ELF the one running on the device?' % fmt_address
+        else:
+            text = format_record(image, fmt, words)
+        if color and level in COLORS:
+            yield '%s%s (%d) %s: %s\033[0m' % (COLORS[level], level, timestamp, tag, text)
+        else:
+            yield '%s (%d) %s: %s' % (level, timestamp, tag, text)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('elf', help='firmware ELF the capture was taken from')
+    parser.add_argument('capture', nargs='?', type=argparse.FileType('r', errors='replace'), default=sys.stdin,
+                        help='serial capture, defaults to stdin')
+    parser.add_argument('--color', action='store_true', help='color the decoded lines like the ESP-IDF log')
+    args = parser.parse_args()
+
+    image = Image(args.elf)
+    for line in args.capture:
+        index = line.find(LINE_PREFIX)
+        if index < 0:
+            sys.stdout.write(line)
+            continue
+        try:
+            for decoded in decode_line(image, line[index:], args.color):
+                print(decoded)
+        except ValueError:
+            sys.stdout.write(line)
+
+
+if __name__ == '__main__':
+    main()